@@ -0,0 +1,857 @@
+//////////////////////////////////////////////////////////////////////////////////////////////
+//
+//  LatencyHarness
+//
+//  End-to-end latency harness for RTProfileSelector: replays a directory of RawTherapee
+//  keyfiles (like samples/CPB_temp_7.txt) through the RTProfileSelector binary, called
+//  exactly as RT calls it, with a stub exiftool serving canned "exiftool -t" output after
+//  a configurable delay. No RawTherapee and no raw files are needed.
+//
+//  Runs are executed at a configurable concurrency and the harness reports p50/p95/p99
+//  wall times per run, the time spent in each phase (from the "Timings" lines logged by
+//  RTProfileSelector with LogTimings=1) and how much latency grows compared to a serial
+//  run of the same workload (contention between parallel instances on shared files).
+//
+//  With --check-matchers, it instead generates random rule sets, rule statistics and Exif
+//  fields, builds the compiled rules module of each rule set, and checks with
+//  "RTProfileSelector --check-matchers" that all the ways of matching the rules agree.
+//
+//  Linux/POSIX only.
+//
+//  Copyright 2014 Marcos Capelini
+//
+//  This program is free software : you can redistribute it and / or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.If not, see <http://www.gnu.org/licenses/>.
+//
+//  Note: source best viewed with a tab size of four spaces
+//
+//////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <iomanip>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <cstdlib>
+#include <cstring>
+
+#include <dirent.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+extern char** environ;
+
+using std::string;
+
+typedef std::vector<std::pair<string, string>> EntryList;
+typedef std::vector<std::pair<string, EntryList>> SectionList;	// keeps the file order
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Harness settings (command line)
+//
+
+struct Settings
+{
+	string rtps;				// RTProfileSelector binary
+	string keyfiles;			// directory with RT keyfiles to replay
+	string install;				// directory with RTProfileSelector.ini, rules and profile folders
+	string exif;				// directory with canned "exiftool -t" outputs (<image name>.txt)
+	string work;				// scratch directory
+	string useExifTool;			// UseExifTool setting for RTProfileSelector ("1", "lazy")
+	int delayMs;				// stub exiftool delay
+	int concurrency;
+	int iterations;				// times each keyfile is replayed
+	double maxP99;				// fail if p99 wall time (ms) is above this (0 = no limit)
+	bool baseline;				// also run serially, to measure contention
+	int checkRounds;			// --check-matchers: rule sets to generate (0 = latency run)
+	int checkImages;			// Exif field sets per rule set
+	unsigned seed;				// random generator seed for the rule sets
+	string cxx;					// compiler for the compiled rules modules
+
+	Settings() : useExifTool("1"), delayMs(0), concurrency(4), iterations(10), maxP99(0.0), baseline(true),
+		checkRounds(0), checkImages(200), seed(1), cxx("g++") {}
+};
+
+void usage()
+{
+	std::cerr <<
+		"Usage: LatencyHarness --rtps <RTProfileSelector binary> --keyfiles <dir> [options]\n"
+		"       LatencyHarness --rtps <RTProfileSelector binary> --check-matchers <rule sets> [options]\n"
+		"  --install <dir>       RTProfileSelector.ini, RTProfileSelectorRules.ini, 'ISO Profiles'\n"
+		"                        and 'Lens Profiles' to use (default: the binary's folder)\n"
+		"  --exif <dir>          canned 'exiftool -t' outputs, named <image name>.txt\n"
+		"                        (default: synthesized from the keyfile's [Common Data])\n"
+		"  --delay <ms>          stub exiftool delay (default 0)\n"
+		"  --use-exiftool <mode> UseExifTool setting: 1 (default) or lazy\n"
+		"  --concurrency <n>     parallel RTProfileSelector instances (default 4)\n"
+		"  --iterations <n>      times each keyfile is replayed (default 10)\n"
+		"  --work <dir>          scratch directory (default /tmp/rtps-harness-<pid>)\n"
+		"  --max-p99 <ms>        exit with an error if the p99 wall time is above this\n"
+		"  --no-baseline         skip the serial run used to measure contention\n"
+		"Matcher check options:\n"
+		"  --check-matchers <n>  generate n random rule sets and check that all the ways of\n"
+		"                        matching them agree (no latency run)\n"
+		"  --images <n>          Exif field sets generated per rule set (default 200)\n"
+		"  --seed <n>            random generator seed (default 1)\n"
+		"  --cxx <compiler>      compiler for the compiled rules modules (default g++)\n";
+}
+
+bool parseArgs(int argc, const char* argv[], Settings& settings)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		string arg = argv[i];
+		if (arg == "--no-baseline")
+		{
+			settings.baseline = false;
+			continue;
+		}
+		if (i + 1 >= argc)
+			return false;
+		string value = argv[++i];
+		if (arg == "--rtps")
+			settings.rtps = value;
+		else if (arg == "--keyfiles")
+			settings.keyfiles = value;
+		else if (arg == "--install")
+			settings.install = value;
+		else if (arg == "--exif")
+			settings.exif = value;
+		else if (arg == "--work")
+			settings.work = value;
+		else if (arg == "--use-exiftool")
+			settings.useExifTool = value;
+		else if (arg == "--delay")
+			settings.delayMs = std::atoi(value.c_str());
+		else if (arg == "--concurrency")
+			settings.concurrency = std::max(1, std::atoi(value.c_str()));
+		else if (arg == "--iterations")
+			settings.iterations = std::max(1, std::atoi(value.c_str()));
+		else if (arg == "--max-p99")
+			settings.maxP99 = std::atof(value.c_str());
+		else if (arg == "--check-matchers")
+			settings.checkRounds = std::max(1, std::atoi(value.c_str()));
+		else if (arg == "--images")
+			settings.checkImages = std::max(1, std::atoi(value.c_str()));
+		else if (arg == "--seed")
+			settings.seed = static_cast<unsigned>(std::strtoul(value.c_str(), nullptr, 10));
+		else if (arg == "--cxx")
+			settings.cxx = value;
+		else
+			return false;
+	}
+	return !settings.rtps.empty() && (!settings.keyfiles.empty() || settings.checkRounds > 0);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//
+// File utilities
+//
+
+string absolutePath(const string& path)
+{
+	char* resolved = realpath(path.c_str(), nullptr);
+	if (resolved == nullptr)
+		return path;
+	string result = resolved;
+	free(resolved);
+	return result;
+}
+
+string dirName(const string& path)
+{
+	size_t slash = path.find_last_of('/');
+	return slash == string::npos ? "." : path.substr(0, slash);
+}
+
+// file name from a path written by RT on either Windows ("K:\\a\\b.RW2") or *nix
+string baseName(const string& path)
+{
+	size_t slash = path.find_last_of("/\\");
+	return slash == string::npos ? path : path.substr(slash + 1);
+}
+
+string stripExtension(const string& name)
+{
+	size_t dot = name.find_last_of('.');
+	return dot == string::npos ? name : name.substr(0, dot);
+}
+
+bool exists(const string& path)
+{
+	struct stat st;
+	return stat(path.c_str(), &st) == 0;
+}
+
+std::vector<string> listFiles(const string& dir)
+{
+	std::vector<string> files;
+	DIR* d = opendir(dir.c_str());
+	if (d == nullptr)
+		return files;
+	while (struct dirent* entry = readdir(d))
+	{
+		string path = dir + "/" + entry->d_name;
+		struct stat st;
+		if (entry->d_name[0] != '.' && stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+			files.push_back(path);
+	}
+	closedir(d);
+	std::sort(files.begin(), files.end());
+	return files;
+}
+
+void writeFile(const string& path, const string& contents)
+{
+	std::ofstream out(path, std::ios::binary);
+	out << contents;
+}
+
+// INI reader keeping sections and keys in file order (keyfiles are rewritten, not just read)
+SectionList readSections(const string& path)
+{
+	SectionList sections;
+	std::ifstream in(path);
+	string line;
+	while (std::getline(in, line))
+	{
+		if (!line.empty() && line[line.size() - 1] == '\r')
+			line.resize(line.size() - 1);
+		if (line.size() >= 2 && line[0] == '[' && line[line.size() - 1] == ']')
+			sections.push_back(std::make_pair(line.substr(1, line.size() - 2), EntryList()));
+		else if (!sections.empty() && !line.empty() && line[0] != ';' && line.find('=') != string::npos)
+		{
+			size_t eq = line.find('=');
+			sections.back().second.push_back(std::make_pair(line.substr(0, eq), line.substr(eq + 1)));
+		}
+	}
+	return sections;
+}
+
+string findValue(const SectionList& sections, const string& section, const string& key)
+{
+	for (const auto& s : sections)
+	{
+		if (s.first != section)
+			continue;
+		for (const auto& entry : s.second)
+		{
+			if (entry.first == key)
+				return entry.second;
+		}
+	}
+	return "";
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Sandbox setup: RTProfileSelector (linked into the work dir, as it reads its configuration
+// next to its binary), a stub exiftool, fake images and keyfiles rewritten to point to them
+//
+
+// Writes RTProfileSelector.ini: the installed one, with the settings the harness depends on overridden
+void writeConfig(const Settings& settings)
+{
+	static const char* overridden[] = { "ExifTool", "UseExifTool", "LogTimings", "LogLevel", "LogMaxSize",
+										"ViewExifKeys", "ViewProfileDebug" };
+
+	std::ostringstream out;
+	std::ifstream in(settings.install + "/RTProfileSelector.ini");
+	string line;
+	bool general = false, written = false;
+	auto writeOverrides = [&]()
+	{
+		out << "ExifTool=" << settings.work << "/stub_exiftool\n"
+			<< "UseExifTool=" << settings.useExifTool << "\nLogTimings=1\nLogLevel=info\nLogMaxSize=0\n";
+		written = true;
+	};
+
+	while (std::getline(in, line))
+	{
+		if (!line.empty() && line[0] == '[')
+		{
+			general = line.compare(0, 9, "[General]") == 0;
+			out << line << "\n";
+			if (general)
+				writeOverrides();
+			continue;
+		}
+		bool skip = false;
+		for (const char* key : overridden)
+			skip |= general && line.compare(0, strlen(key) + 1, string(key) + "=") == 0;
+		if (!skip)
+			out << line << "\n";
+	}
+	if (!written)
+	{
+		out << "[General]\n";
+		writeOverrides();
+	}
+	writeFile(settings.work + "/RTProfileSelector.ini", out.str());
+}
+
+// Writes the stub exiftool: ignores all options and prints the canned output for the image (last argument)
+void writeStubExiftool(const Settings& settings)
+{
+	std::ostringstream script;
+	script << "#!/bin/sh\n"
+		<< "# stub exiftool generated by LatencyHarness: serves canned 'exiftool -t' output\n"
+		<< "for arg; do image=\"$arg\"; done\n"
+		<< "name=$(basename \"$image\")\n";
+	if (settings.delayMs > 0)
+		script << "sleep " << settings.delayMs / 1000 << "." << std::setw(3) << std::setfill('0') << settings.delayMs % 1000 << "\n";
+	script << "exec cat \"" << settings.work << "/exif/${name%.*}.txt\"\n";
+
+	string path = settings.work + "/stub_exiftool";
+	writeFile(path, script.str());
+	chmod(path.c_str(), 0755);
+}
+
+// Canned exiftool output for an image: from --exif if available, else synthesized from the keyfile
+string cannedExif(const Settings& settings, const string& imageName, const SectionList& keyfile)
+{
+	if (!settings.exif.empty())
+	{
+		std::ifstream in(settings.exif + "/" + stripExtension(imageName) + ".txt");
+		if (in.good())
+		{
+			std::ostringstream ss;
+			ss << in.rdbuf();
+			return ss.str();
+		}
+	}
+
+	static const char* mapping[][2] = {
+		{ "Make", "Make" }, { "Model", "Camera Model Name" }, { "ISO", "ISO" }, { "Lens", "Lens ID" },
+		{ "FNumber", "F Number" }, { "Shutter", "Exposure Time" } };
+	std::ostringstream ss;
+	for (const auto& m : mapping)
+	{
+		string value = findValue(keyfile, "Common Data", m[0]);
+		if (!value.empty() && value != "Unknown")
+			ss << m[1] << "\t" << value << "\n";
+	}
+	string focalLength = findValue(keyfile, "Common Data", "FocalLength");
+	if (!focalLength.empty())
+		ss << "Focal Length\t" << std::fixed << std::setprecision(1) << std::atof(focalLength.c_str()) << " mm\n";
+	return ss.str();
+}
+
+// Sets up the work dir, returning the rewritten keyfiles
+std::vector<string> setupSandbox(const Settings& settings)
+{
+	for (const char* dir : { "", "/exif", "/images", "/keys", "/out", "/cache", "/profiles" })
+		mkdir((settings.work + dir).c_str(), 0755);
+
+	string binary = settings.work + "/RTProfileSelector";
+	unlink(binary.c_str());
+	symlink(absolutePath(settings.rtps).c_str(), binary.c_str());
+	for (const char* item : { "RTProfileSelectorRules.ini", "ISO Profiles", "Lens Profiles" })
+	{
+		string target = absolutePath(settings.install + "/" + item);
+		string link = settings.work + "/" + item;
+		unlink(link.c_str());
+		if (exists(target))
+			symlink(target.c_str(), link.c_str());
+	}
+	writeConfig(settings);
+	writeStubExiftool(settings);
+	writeFile(settings.work + "/profiles/Default.pp3", "[Version]\nAppVersion=4.2\nVersion=321\n\n[Exposure]\nAuto=false\n\n[Distortion]\nAmount=0\n");
+
+	std::vector<string> keyfiles;
+	for (const string& path : listFiles(settings.keyfiles))
+	{
+		SectionList keyfile = readSections(path);
+		string imageName = baseName(findValue(keyfile, "RT General", "ImageFileName"));
+		if (imageName.empty())
+		{
+			std::cerr << "Skipping " << path << ": not a RT keyfile\n";
+			continue;
+		}
+
+		// fake image + canned Exif
+		string image = settings.work + "/images/" + imageName;
+		writeFile(image, "");
+		writeFile(settings.work + "/exif/" + stripExtension(imageName) + ".txt", cannedExif(settings, imageName, keyfile));
+
+		// rewritten keyfile
+		string defaultProfile = findValue(keyfile, "RT General", "DefaultProcParams");
+		if (!exists(defaultProfile))
+			defaultProfile = settings.work + "/profiles/Default.pp3";
+		std::ostringstream out;
+		for (const auto& section : keyfile)
+		{
+			out << "[" << section.first << "]\n";
+			for (const auto& entry : section.second)
+			{
+				string value = entry.second;
+				if (section.first == "RT General")
+				{
+					if (entry.first == "ImageFileName")
+						value = image;
+					else if (entry.first == "OutputProfileFileName")
+						value = settings.work + "/out/" + imageName + ".pp3";
+					else if (entry.first == "CachePath")
+						value = settings.work + "/cache";
+					else if (entry.first == "DefaultProcParams")
+						value = defaultProfile;
+				}
+				out << entry.first << "=" << value << "\n";
+			}
+			out << "\n";
+		}
+		string key = settings.work + "/keys/" + std::to_string(keyfiles.size()) + ".txt";
+		writeFile(key, out.str());
+		keyfiles.push_back(key);
+	}
+	return keyfiles;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Running and measuring
+//
+
+struct RunStats
+{
+	std::vector<double> wall;								// per-run wall times (ms)
+	std::vector<std::pair<string, std::vector<double>>> phases;	// per-phase times (ms) from the log, in pipeline order
+	int failures;
+	double elapsed;											// whole batch (ms)
+
+	RunStats() : failures(0), elapsed(0.0) {}
+};
+
+double percentile(std::vector<double> values, double p)
+{
+	if (values.empty())
+		return 0.0;
+	std::sort(values.begin(), values.end());
+	size_t rank = static_cast<size_t>(p / 100.0 * values.size() + 0.999999);	// nearest rank
+	return values[std::min(values.size(), std::max<size_t>(rank, 1)) - 1];
+}
+
+// Runs a program (searched in PATH) with its arguments, returning the exit status
+int runProcess(const std::vector<string>& args)
+{
+	std::vector<char*> argv;
+	for (const string& arg : args)
+		argv.push_back(const_cast<char*>(arg.c_str()));
+	argv.push_back(nullptr);
+	pid_t pid;
+	if (posix_spawnp(&pid, argv[0], nullptr, nullptr, argv.data(), environ) != 0)
+		return -1;
+	int status = 0;
+	if (waitpid(pid, &status, 0) < 0)
+		return -1;
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// Runs RTProfileSelector once for a keyfile, returning the exit status
+int runOnce(const string& binary, const string& keyfile)
+{
+	return runProcess({ binary, keyfile });
+}
+
+// Parses the "Timings (ms): config=0.210 keyfile=0.051 ... total=4.733 [image]" lines from the log
+void readTimings(const string& logPath, RunStats& stats)
+{
+	static const string marker = "Timings (ms): ";
+	std::ifstream log(logPath);
+	string line;
+	while (std::getline(log, line))
+	{
+		size_t pos = line.find(marker);
+		if (pos == string::npos)
+			continue;
+		std::istringstream ss(line.substr(pos + marker.size()));
+		string item;
+		while (ss >> item && item[0] != '[')
+		{
+			size_t eq = item.find('=');
+			if (eq == string::npos)
+				continue;
+			string phase = item.substr(0, eq);
+			auto iter = std::find_if(stats.phases.begin(), stats.phases.end(),
+				[&phase](const std::pair<string, std::vector<double>>& p) { return p.first == phase; });
+			if (iter == stats.phases.end())
+				iter = stats.phases.insert(stats.phases.end(), std::make_pair(phase, std::vector<double>()));
+			iter->second.push_back(std::atof(item.c_str() + eq + 1));
+		}
+	}
+}
+
+RunStats runBatch(const Settings& settings, const std::vector<string>& keyfiles, int concurrency)
+{
+	string binary = settings.work + "/RTProfileSelector";
+	string logPath = settings.work + "/RTProfileSelector.log";
+	remove(logPath.c_str());
+
+	size_t jobs = keyfiles.size() * settings.iterations;
+	std::vector<double> wall(jobs, 0.0);
+	std::atomic<size_t> next(0);
+	std::atomic<int> failures(0);
+
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> workers;
+	for (int w = 0; w < concurrency; ++w)
+	{
+		workers.push_back(std::thread([&]()
+		{
+			for (size_t job = next++; job < jobs; job = next++)
+			{
+				auto runStart = std::chrono::steady_clock::now();
+				if (runOnce(binary, keyfiles[job % keyfiles.size()]) != 0)
+					++failures;
+				wall[job] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - runStart).count();
+			}
+		}));
+	}
+	for (auto& worker : workers)
+		worker.join();
+
+	RunStats stats;
+	stats.elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	stats.wall = wall;
+	stats.failures = failures;
+	readTimings(logPath, stats);
+	return stats;
+}
+
+void printRow(const string& name, const std::vector<double>& values)
+{
+	double sum = 0.0;
+	for (double v : values)
+		sum += v;
+	std::cout << "  " << std::left << std::setw(10) << name << std::right << std::fixed << std::setprecision(3)
+		<< std::setw(10) << percentile(values, 50) << std::setw(10) << percentile(values, 95)
+		<< std::setw(10) << percentile(values, 99) << std::setw(10) << percentile(values, 100)
+		<< std::setw(10) << (values.empty() ? 0.0 : sum / values.size()) << "\n";
+}
+
+void printReport(const string& title, const RunStats& stats)
+{
+	std::cout << "\n" << title << ": " << stats.wall.size() << " runs in " << std::fixed << std::setprecision(1)
+		<< stats.elapsed << " ms (" << stats.wall.size() * 1000.0 / std::max(stats.elapsed, 1e-3) << " runs/s), "
+		<< stats.failures << " failure(s)\n";
+	std::cout << "  " << std::left << std::setw(10) << "(ms)" << std::right
+		<< std::setw(10) << "p50" << std::setw(10) << "p95" << std::setw(10) << "p99"
+		<< std::setw(10) << "max" << std::setw(10) << "mean" << "\n";
+	printRow("wall", stats.wall);
+	size_t logged = 0;
+	for (const auto& phase : stats.phases)
+	{
+		printRow(phase.first, phase.second);
+		logged = std::max(logged, phase.second.size());
+	}
+	if (logged < stats.wall.size())
+		std::cout << "  (only " << logged << " runs logged their timings)\n";
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Matcher equivalence check (--check-matchers): random rule sets, with statistics (so that rules
+// and conditions are evaluated in random orders) and Exif fields drawn from the same values, 
+// including reserved chars, numbers and values no rule mentions. Each rule set is compiled into a
+// module, then "RTProfileSelector --check-matchers" compares all the ways of matching it.
+//
+
+struct CheckKey
+{
+	const char* name;
+	std::vector<string> values;
+	bool numeric;		// used with ranges
+};
+
+const std::vector<CheckKey>& checkKeys()
+{
+	static const std::vector<CheckKey> keys = {
+		{ "Camera Model Name", { "DMC-GM1", "DMC-GX7", "DMC-LX5", "X-T2", "EOS 5D Mark III", "Mono|chrome", "A ~ B", "!Odd", "" }, false },
+		{ "Photo Style", { "Monochrome", "Standard", "Vivid", "Dynamic (B&W)", "Scenery" }, false },
+		{ "White Balance", { "Auto", "Manual", "Custom 2", "Daylight" }, false },
+		{ "Lens ID", { "LUMIX G VARIO 14-42/F3.5-5.6", "LUMIX G 20/F1.7", "XF35mmF1.4 R", "Unknown" }, false },
+		{ "ISO", { "100", "200", "400", "800", "1600", "3200", "6400", "Auto" }, true },
+		{ "Focal Length", { "12.0 mm", "14.0 mm", "25.0 mm", "45.0 mm", "100.0 mm" }, true },
+		{ "F Number", { "1.7", "2.8", "4.0", "5.6", "8.0" }, true },
+	};
+	return keys;
+}
+
+class RuleSetGenerator
+{
+public:
+	explicit RuleSetGenerator(unsigned seed) : random(seed) {}
+
+	int below(int n) { return std::uniform_int_distribution<int>(0, n - 1)(random); }
+	bool chance(int percent) { return below(100) < percent; }
+
+	template <typename T>
+	const T& pick(const std::vector<T>& items) { return items[below(static_cast<int>(items.size()))]; }
+
+	// a key's value, mostly one of the first two (so that rules often match, and several at once)
+	const string& value(const CheckKey& key) { return chance(70) ? key.values[below(2)] : pick(key.values); }
+
+	// A rule value for a key: exact values, lists, ranges, regular expressions, negated or not
+	string ruleValue(const CheckKey& key)
+	{
+		static const std::vector<string> patterns = {
+			"DMC-G[A-Z]\\d+", "\\d+", ".*F1\\.[4-7]", "(?i)lumix.*", "(a{2,3}|b)+", "[^ ]+ mm", "X-.", 
+			"(unclosed", "a{99999999999}", "((a{255}){255}){255}", "Mono\\|chrome", ".*" };
+		string negation = chance(20) ? "!" : "";
+		switch (below(10))
+		{
+		case 0:
+		case 1:
+		case 2:
+			return negation + value(key);
+		case 3:
+		case 4:
+		{
+			string list = value(key);
+			for (int i = below(3); i >= 0; --i)
+				list += "|" + value(key);
+			return negation + list;
+		}
+		case 5:
+		case 6:
+		{
+			string range = value(key) + (chance(50) ? "~" : " ~ ") + value(key);
+			return negation + (chance(30) ? value(key) + "|" + range : range);
+		}
+		case 7:
+		case 8:
+			return negation + "re:" + (chance(30) ? value(key) : pick(patterns));
+		default:
+			return chance(50) ? "" : negation + "~" + value(key);
+		}
+	}
+
+	// Conditions on distinct keys
+	EntryList conditions(int count)
+	{
+		std::vector<const CheckKey*> keys;
+		for (const CheckKey& key : checkKeys())
+			keys.push_back(&key);
+		std::shuffle(keys.begin(), keys.end(), random);
+		EntryList entries;
+		for (int i = 0; i < count && i < static_cast<int>(keys.size()); ++i)
+			entries.push_back(std::make_pair(keys[i]->name, ruleValue(*keys[i])));
+		return entries;
+	}
+
+	// Rules (some with the same section name), partial rules and rule groups (one enclosed in 
+	// itself, one named but not defined), in file order
+	SectionList rules()
+	{
+		static const std::vector<string> names = { "Full A.pp3", "Full B.pp3", "Full C.pp3", "Partial X.pp3", "Partial Y.pp3" };
+		static const std::vector<string> groupNames = { "G1", "G2", "G3", "Undefined" };
+		SectionList sections;
+		EntryList g1 = conditions(1 + below(2)), g2 = conditions(1 + below(2)), g3 = conditions(1);
+		g2.push_back(std::make_pair("@Group", "G1"));
+		g3.push_back(std::make_pair("@Group", "G3"));
+		sections.push_back(std::make_pair("@G1", g1));
+		sections.push_back(std::make_pair("@G2", g2));
+		sections.push_back(std::make_pair("@G3", g3));
+
+		for (int rule = 4 + below(22); rule > 0; --rule)
+		{
+			string name = pick(names);
+			EntryList entries = conditions(below(4));
+			if (name.compare(0, 7, "Partial") == 0)
+			{
+				entries.push_back(std::make_pair("@Sections", "*"));
+				if (chance(50))
+					entries.push_back(std::make_pair("@Rank", std::to_string(below(4))));
+			}
+			if (chance(30))
+				entries.push_back(std::make_pair("@Group", pick(groupNames)));
+			sections.push_back(std::make_pair(name, entries));
+		}
+		return sections;
+	}
+
+	// Statistics for the rules (see RuleStats), in RTProfileSelectorRules.stats' format
+	string statistics(const SectionList& rules)
+	{
+		std::ostringstream out;
+		std::vector<string> seen;
+		for (const auto& rule : rules)
+		{
+			if (rule.first[0] == '@')
+				continue;
+			int occurrence = static_cast<int>(std::count(seen.begin(), seen.end(), rule.first));
+			seen.push_back(rule.first);
+			string id = occurrence == 0 ? rule.first : rule.first + "#" + std::to_string(occurrence + 1);
+			out << id << "\t@\t" << counts() << "\n";
+			for (const auto& entry : rule.second)
+				if (entry.first[0] != '@')
+					out << id << "\t" << entry.first << "\t" << counts() << "\n";
+		}
+		return out.str();
+	}
+
+	// "exiftool -t" output: most keys, with values from the rules' (and some no rule mentions)
+	string exifFields()
+	{
+		std::ostringstream out;
+		for (const CheckKey& key : checkKeys())
+		{
+			if (chance(10))
+				continue;
+			string exifValue = chance(10) ? "Other" : value(key);
+			out << key.name << "\t" << exifValue << "\n";
+		}
+		return out.str();
+	}
+
+private:
+	string counts()
+	{
+		int evaluated = below(5000);
+		return std::to_string(evaluated) + "\t" + std::to_string(below(evaluated + 1));
+	}
+
+	std::mt19937 random;
+};
+
+void writeSections(const string& path, const SectionList& sections)
+{
+	std::ostringstream out;
+	for (const auto& section : sections)
+	{
+		out << "[" << section.first << "]\n";
+		for (const auto& entry : section.second)
+			out << entry.first << "=" << entry.second << "\n";
+		out << "\n";
+	}
+	writeFile(path, out.str());
+}
+
+// Generates and checks the rule sets, stopping at the first one that fails (kept in the work dir); returns false if one did
+bool checkMatchers(const Settings& settings)
+{
+	string binary = settings.work + "/RTProfileSelector";
+	unlink(binary.c_str());
+	symlink(absolutePath(settings.rtps).c_str(), binary.c_str());
+	string exifDir = settings.work + "/exif";
+	mkdir(exifDir.c_str(), 0755);
+
+	RuleSetGenerator generator(settings.seed);
+	for (int round = 0; round < settings.checkRounds; ++round)
+	{
+		// every fourth rule set with complex rules disabled, and some with no statistics
+		bool complexRules = round % 4 != 3;
+		writeFile(settings.work + "/RTProfileSelector.ini", string("[General]\nLogLevel=warning\nLogMaxSize=0\n") +
+			"ComplexRulesEnabled=" + (complexRules ? "1" : "0") + "\nCompiledRules=RTProfileSelectorRules.so\n");
+		SectionList rules = generator.rules();
+		writeSections(settings.work + "/RTProfileSelectorRules.ini", rules);
+		string statsPath = settings.work + "/RTProfileSelectorRules.stats";
+		remove(statsPath.c_str());
+		if (generator.chance(80))
+			writeFile(statsPath, generator.statistics(rules));
+		for (const string& file : listFiles(exifDir))
+			remove(file.c_str());
+		for (int image = 0; image < settings.checkImages; ++image)
+			writeFile(exifDir + "/" + std::to_string(image) + ".txt", generator.exifFields());
+
+		string source = settings.work + "/RTProfileSelectorRules.cpp", module = settings.work + "/RTProfileSelectorRules.so";
+		remove(module.c_str());
+		std::cout << "Rule set " << round + 1 << ": " << std::flush;
+		if (runProcess({ binary, "--compile-rules", source }) != 0 ||
+			runProcess({ settings.cxx, "-O1", "-std=c++11", "-shared", "-fPIC", source, "-o", module }) != 0)
+		{
+			std::cout << "\nCan't build the compiled rules module (see " << settings.work << ")\n";
+			return false;
+		}
+		if (runProcess({ binary, "--check-matchers", exifDir }) != 0)
+		{
+			std::cout << "\nMatchers disagree on rule set " << round + 1 << " from seed " << settings.seed 
+				<< " (rules, statistics and Exif fields kept in " << settings.work << ")\n";
+			return false;
+		}
+	}
+	std::cout << "\n" << settings.checkRounds << " rule set(s) from seed " << settings.seed << ": all matchers agree\n";
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Usage: LatencyHarness --rtps <RTProfileSelector binary> --keyfiles <dir> [options]
+//        LatencyHarness --rtps <RTProfileSelector binary> --check-matchers <rule sets> [options]
+//
+int main(int argc, const char* argv[])
+{
+	Settings settings;
+	if (!parseArgs(argc, argv, settings))
+	{
+		usage();
+		return 2;
+	}
+	if (settings.install.empty())
+		settings.install = dirName(settings.rtps);
+	if (settings.work.empty())
+		settings.work = "/tmp/rtps-harness-" + std::to_string(getpid());
+	mkdir(settings.work.c_str(), 0755);
+	settings.work = absolutePath(settings.work);
+
+	if (settings.checkRounds > 0)
+		return checkMatchers(settings) ? 0 : 1;
+
+	std::vector<string> keyfiles = setupSandbox(settings);
+	if (keyfiles.empty())
+	{
+		std::cerr << "No RT keyfiles found in " << settings.keyfiles << "\n";
+		return 2;
+	}
+
+	std::cout << "RTProfileSelector end-to-end latency: " << keyfiles.size() << " keyfile(s) x " << settings.iterations
+		<< " iteration(s), exiftool delay " << settings.delayMs << " ms, work dir " << settings.work << "\n";
+
+	RunStats serial;
+	if (settings.baseline)
+	{
+		serial = runBatch(settings, keyfiles, 1);
+		printReport("Serial baseline (concurrency 1)", serial);
+	}
+
+	RunStats parallel = runBatch(settings, keyfiles, settings.concurrency);
+	printReport("Concurrency " + std::to_string(settings.concurrency), parallel);
+
+	// contention: how much each run slows down when instances run side by side
+	// (shared log, LastProfile*.txt and ExifFields.txt files, exiftool processes, disk)
+	if (settings.baseline && settings.concurrency > 1)
+	{
+		std::cout << "\nContention (concurrency " << settings.concurrency << " vs serial): " << std::fixed << std::setprecision(2)
+			<< "p50 x" << percentile(parallel.wall, 50) / std::max(percentile(serial.wall, 50), 1e-6)
+			<< ", p95 x" << percentile(parallel.wall, 95) / std::max(percentile(serial.wall, 95), 1e-6)
+			<< ", p99 x" << percentile(parallel.wall, 99) / std::max(percentile(serial.wall, 99), 1e-6)
+			<< ", throughput x" << (serial.elapsed / std::max(parallel.elapsed, 1e-6)) << "\n";
+	}
+
+	int result = (serial.failures + parallel.failures) != 0 ? 1 : 0;
+	if (settings.maxP99 > 0.0 && percentile(parallel.wall, 99) > settings.maxP99)
+	{
+		std::cout << "\np99 wall time above limit (" << settings.maxP99 << " ms)\n";
+		result = 1;
+	}
+	return result;
+}
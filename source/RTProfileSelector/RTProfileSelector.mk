@@ -35,7 +35,7 @@ PreprocessOnlySwitch   :=-E
 ObjectsFileList        :="RTProfileSelector.txt"
 PCHCompileFlags        :=
 MakeDirCommand         :=mkdir -p
-LinkOptions            :=  
+LinkOptions            :=  -pthread -ldl
 IncludePath            :=  $(IncludeSwitch). $(IncludeSwitch). 
 IncludePCH             := 
 RcIncludePath          := 
@@ -50,7 +50,7 @@ LibPath                := $(LibraryPathSwitch).
 AR       := /usr/bin/ar rcu
 CXX      := /usr/bin/g++
 CC       := /usr/bin/gcc
-CXXFLAGS :=  -O2 -Wall -std=c++0x $(Preprocessors)
+CXXFLAGS :=  -O2 -Wall -std=c++0x -pthread $(Preprocessors)
 CFLAGS   :=  -O2 -Wall $(Preprocessors)
 ASFLAGS  := 
 AS       := /usr/bin/as
@@ -60,7 +60,7 @@ AS       := /usr/bin/as
 ## User defined environment variables
 ##
 CodeLiteDir:=/usr/share/codelite
-Objects0=$(IntermediateDirectory)/RTProfileSelector.cpp$(ObjectSuffix) 
+Objects0=$(IntermediateDirectory)/RTProfileSelector.cpp$(ObjectSuffix) $(IntermediateDirectory)/librtps.cpp$(ObjectSuffix) 
 
 
 
@@ -99,6 +99,14 @@ $(IntermediateDirectory)/RTProfileSelector.cpp$(DependSuffix): RTProfileSelector
 $(IntermediateDirectory)/RTProfileSelector.cpp$(PreprocessSuffix): RTProfileSelector.cpp
 	$(CXX) $(CXXFLAGS) $(IncludePCH) $(IncludePath) $(PreprocessOnlySwitch) $(OutputSwitch) $(IntermediateDirectory)/RTProfileSelector.cpp$(PreprocessSuffix) RTProfileSelector.cpp
 
+$(IntermediateDirectory)/librtps.cpp$(ObjectSuffix): librtps.cpp $(IntermediateDirectory)/librtps.cpp$(DependSuffix)
+	$(CXX) $(IncludePCH) $(SourceSwitch) "/home/mc/Software/RTProfileSelector/source/RTProfileSelector/librtps.cpp" $(CXXFLAGS) $(ObjectSwitch)$(IntermediateDirectory)/librtps.cpp$(ObjectSuffix) $(IncludePath)
+$(IntermediateDirectory)/librtps.cpp$(DependSuffix): librtps.cpp
+	@$(CXX) $(CXXFLAGS) $(IncludePCH) $(IncludePath) -MG -MP -MT$(IntermediateDirectory)/librtps.cpp$(ObjectSuffix) -MF$(IntermediateDirectory)/librtps.cpp$(DependSuffix) -MM librtps.cpp
+
+$(IntermediateDirectory)/librtps.cpp$(PreprocessSuffix): librtps.cpp
+	$(CXX) $(CXXFLAGS) $(IncludePCH) $(IncludePath) $(PreprocessOnlySwitch) $(OutputSwitch) $(IntermediateDirectory)/librtps.cpp$(PreprocessSuffix) librtps.cpp
+
 
 -include $(IntermediateDirectory)/*$(DependSuffix)
 ##
@@ -0,0 +1,8442 @@
+//////////////////////////////////////////////////////////////////////////////////////////////
+//
+//  RTProfileSelector
+//
+//  RTProfileSelector is a RawTherapee custom profile builder plugin that automatically 
+//  selects custom processing profiles(.pp3 files) based on user - defined rules.The rules 
+//  are sets of Exif fields and values which are matched against the actual values extracted 
+//  from the raw files.
+//
+//  librtps: everything but main() (see RTProfileSelector.cpp), also usable in-process (see librtps.h)
+//
+//	Copyright 2014 Marcos Capelini 
+//
+//  This program is free software : you can redistribute it and / or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.If not, see <http://www.gnu.org/licenses/>.
+//
+//	v1.0 - 20-Nov-2014
+//
+//  Note: source best viewed with a tab size of four spaces
+//
+//////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <set>
+#include <bitset>
+#include <iomanip>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <locale>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <chrono>
+#include <memory>
+#include <functional>
+#include <cstdint>
+#include <limits>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <csignal>
+#include <ctime>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define RTPS_HAVE_SSE2
+#endif
+
+#include "librtps.h"
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+// Hate this, but had to use CreateProcess() (see executeProcess() below) to get
+// rid of a nagging console windows created by calling system() on MS Windows :(
+#ifdef _WIN32
+// By default Windows defines max macro which conflicts with std::numeric_limits<double>::max() 
+#define NOMINMAX		
+#include <windows.h>
+#include <io.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <dlfcn.h>
+#include <signal.h>
+#endif
+//////////////////////////////////////////////////////////////////////////////////////////////
+
+using std::string;
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+
+// Names of the files INI values are read from (or how they were calculated), interned: values only keep
+// an id (see IniValue), resolved into the name only when written out (debug profile). Ids are never reused.
+class SourceTable
+{
+public:
+	// id of a file name (0 is no file)
+	static uint32_t intern(const string& path)
+	{
+		SourceTable& table = instance();
+		std::lock_guard<std::mutex> lock(table.mutex);
+		auto iter = table.ids.find(path);
+		if (iter != table.ids.end())
+			return iter->second;
+		table.names.push_back(path);
+		uint32_t id = static_cast<uint32_t>(table.names.size());
+		table.ids[path] = id;
+		return id;
+	}
+
+	// name of an interned file (empty for 0)
+	static string name(uint32_t id)
+	{
+		SourceTable& table = instance();
+		std::lock_guard<std::mutex> lock(table.mutex);
+		return id == 0 || id > table.names.size() ? string() : table.names[id - 1];
+	}
+
+private:
+	static SourceTable& instance()
+	{
+		static SourceTable table;
+		return table;
+	}
+
+	std::mutex mutex;
+	std::vector<string> names;				// by id - 1
+	std::map<string, uint32_t> ids;
+};
+
+// struct for storing value and source file info for INI keys
+struct IniValue
+{
+	string value;	
+	uint32_t source;	// file the value was read from (see SourceTable), 0 if none
+	uint32_t line;		// line in that file, 0 if unknown
+
+	IniValue() : source(0), line(0) {}
+	
+	// some convenience operators to work with strings
+	string& operator=(const string& s) { value = s; return value;}	
+	operator const string&() const { return value; }
+	bool operator==(const string& s) const { return value == s; }
+	bool operator!=(const string& s) const { return value != s; }
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+
+// Some useful typedefs
+typedef std::pair<string, string> StrPair;
+typedef std::map<string, string> StrMap;
+
+typedef std::map<string, IniValue> EntryMap;
+typedef std::pair<string, IniValue> IniEntry;
+
+typedef std::map<string, EntryMap> IniMap;
+typedef std::multimap<string, EntryMap> IniMultiMap;
+
+typedef std::set<string> StrSet;
+typedef std::pair<string, StrSet> StrSetPair;
+typedef std::vector<StrSetPair> StrSetVector;
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+
+// OS-specific definitions
+
+#ifdef _WIN32
+// Slash char for Windows
+#define SLASH_CHAR				'\\'	
+#define REVERSE_SLASH_CHAR		'/'	
+// Out of convenience, for Windows we assume the user may have copied the exiftool binary to RTProfileSelector's folder
+#define DEFAULT_EXIFTOOL_CMD	(basePath + "exiftool")
+// Default text viewer for Windows = Notepad
+#define DEFAULT_TEXTVIEWER_CMD	("notepad.exe")
+// Where the output of detached processes goes
+#define NULL_DEVICE				"NUL"
+#else
+// Slash char for *nix
+#define SLASH_CHAR				'/'
+#define REVERSE_SLASH_CHAR		'\\'	
+// Exiftool is simply exiftool
+#define DEFAULT_EXIFTOOL_CMD	("exiftool")
+// Default text viewer for Ubuntu = Gedit
+#define DEFAULT_TEXTVIEWER_CMD	("gedit")
+// Where the output of detached processes goes
+#define NULL_DEVICE				"/dev/null"
+#endif
+
+#ifdef __GNUC__
+// Disable annoying warning on GCC for not testing the return of system()
+#pragma GCC diagnostic ignored "-Wunused-result"
+#endif
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+// A few string constants
+
+// Exif keys
+#define EXIF_LENS_ID				"Lens ID"
+#define EXIF_LENS_TYPE				"Lens Type"
+#define EXIF_CAMERA_MODEL			"Camera Model Name"
+#define EXIF_ISO					"ISO"
+#define EXIF_FOCAL_LENGTH			"Focal Length"
+
+// Keys read from RT's keyfile (see getParamsExifFields())
+#define EXIF_KEYFILE_MODEL			"CommonData.Model"
+#define EXIF_KEYFILE_LENS			"CommonData.Lens"
+#define EXIF_KEYFILE_FOCAL_LENGTH	"CommonData.FocalLength"
+
+// PP3 file constants
+#define PP3_VERSION_SECTION			"Version"
+#define PP3_DISTORTION_SECTION		"Distortion"
+#define PP3_DISTORTION_AMOUNT		"Amount"
+#define PP3_LENS_PROFILE_SECTION	"LensProfile"
+#define PP3_LENS_PROFILE_KEY		"LCPFile"
+
+// RT's keyfile definitions
+#define RT_KEYFILE_GENERAL_SECTION	"RT General"
+
+// Folder names for our profile definitions 
+#define LENS_PROFILE_DIR			"Lens Profiles"
+#define ISO_PROFILE_DIR				"ISO Profiles"
+
+// RTPS's ini-file definitions
+#define RTPS_INI_SECTION_GENERAL	"General"
+#define RTPS_INI_SECTION_ISO		"ISO Profile Sections"
+
+// Partial profiles reules specific keys
+#define RTPS_RULES_PRIVATE_KEY_CHAR	'@'
+#define RTPS_RULES_PP3_SECTIONS_KEY	"@Sections"
+#define RTPS_RULES_SECT_WILDCARD	"*"
+#define RTPS_RULES_PROFILE_RANK		"@Rank"
+#define RTPS_RULES_REGEX_PREFIX		"re:"
+#define RTPS_RULES_GROUP_KEY		"@Group"		// rule group a rule (or group) belongs to (see RuleGroup)
+
+// Metadata cache and folder prefetch (see prefetchFolder())
+#define RTPS_METADATA_CACHE_DIR		"RTProfileSelector"
+#define RTPS_METADATA_CACHE_HEADER	"#RTPS"
+#define RTPS_PREFETCH_EXTENSIONS	"3fr,arw,cr2,cr3,crw,dcr,dng,erf,iiq,kdc,mef,mos,mrw,nef,nrw,orf,pef,raf,raw,rw2,rwl,sr2,srf,srw,x3f"
+#define RTPS_PREFETCH_LOCK_TIMEOUT	600		// seconds after which a prefetch lock is considered stale
+
+// Default deadline for exiftool (milliseconds, see "ExifToolTimeout")
+#define RTPS_EXIFTOOL_TIMEOUT		10000
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Logging
+//
+// A log call only formats its message and copies it into a ring buffer owned by the calling 
+// thread (lock-free, single producer/single consumer), so it never waits for the disk. A 
+// background thread drains the rings and appends the records to the log file, rotating it 
+// once it grows past the configured size. If a ring is full the message is dropped (and 
+// counted) rather than blocking the caller.
+//
+// Usage:
+//		RTPS_LOG(Info) << "Base profile file selected: " << sourceProfile;
+//
+// Arguments are not even evaluated when the level is disabled.
+//
+
+enum class LogLevel { None, Error, Warning, Info, Debug };
+
+// Parses a log level name from RTProfileSelector.ini ("error", "warning", "info", "debug" or "none")
+LogLevel parseLogLevel(string name, LogLevel defaultLevel)
+{
+	std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+	if (name == "none" || name == "0")
+		return LogLevel::None;
+	if (name == "error")
+		return LogLevel::Error;
+	if (name == "warning")
+		return LogLevel::Warning;
+	if (name == "info")
+		return LogLevel::Info;
+	if (name == "debug")
+		return LogLevel::Debug;
+	return defaultLevel;
+}
+
+// Fixed-size byte ring holding length-prefixed log records for a single thread
+// head is only written by the owner thread, tail only by the flusher thread
+class LogRing
+{
+public:
+	struct Header
+	{
+		uint32_t size;		// message size in bytes (header not included)
+		uint32_t level;
+		uint64_t seq;		// global sequence number, used to merge the rings in order
+		int64_t micros;		// timestamp (microseconds since epoch)
+	};
+
+	struct Record
+	{
+		Header header;
+		unsigned threadId;
+		string message;
+	};
+
+	LogRing(unsigned threadId, size_t capacity) : threadId(threadId), orphaned(false), buf(capacity), head(0), tail(0) {}
+
+	// producer side: returns false if there's no room left for the record
+	bool push(const Header& header, const char* message)
+	{
+		size_t h = head.load(std::memory_order_relaxed);
+		size_t t = tail.load(std::memory_order_acquire);
+		if (buf.size() - (h - t) < sizeof(Header) + header.size)
+			return false;
+		copyIn(h, &header, sizeof(Header));
+		copyIn(h + sizeof(Header), message, header.size);
+		head.store(h + sizeof(Header) + header.size, std::memory_order_release);
+		return true;
+	}
+
+	// consumer side: moves all pending records to 'records'
+	void drain(std::vector<Record>& records)
+	{
+		size_t t = tail.load(std::memory_order_relaxed);
+		size_t h = head.load(std::memory_order_acquire);
+		while (t != h)
+		{
+			Record record;
+			record.threadId = threadId;
+			copyOut(t, &record.header, sizeof(Header));
+			record.message.resize(record.header.size);
+			if (record.header.size != 0)
+				copyOut(t + sizeof(Header), &record.message[0], record.header.size);
+			t += sizeof(Header) + record.header.size;
+			records.push_back(std::move(record));
+		}
+		tail.store(t, std::memory_order_release);
+	}
+
+	size_t capacity() const { return buf.size(); }
+
+	const unsigned threadId;
+	std::atomic<bool> orphaned;		// owner thread has exited: ring can be discarded once drained
+
+private:
+	void copyIn(size_t pos, const void* src, size_t size)
+	{
+		size_t offset = pos % buf.size();
+		size_t first = std::min(size, buf.size() - offset);
+		memcpy(&buf[offset], src, first);
+		memcpy(&buf[0], static_cast<const char*>(src) + first, size - first);
+	}
+
+	void copyOut(size_t pos, void* dst, size_t size) const
+	{
+		size_t offset = pos % buf.size();
+		size_t first = std::min(size, buf.size() - offset);
+		memcpy(dst, &buf[offset], first);
+		memcpy(static_cast<char*>(dst) + first, &buf[0], size - first);
+	}
+
+	std::vector<char> buf;
+	std::atomic<size_t> head;	// total bytes written
+	std::atomic<size_t> tail;	// total bytes consumed
+};
+
+// The process-wide logger: per-thread rings + background flusher writing to an append-mode, size-rotated file
+// (shared by the instances RT runs in parallel: the file is opened for each flush, so that they all write to the
+// current one after any of them rotates it, and its size is checked on disk)
+class Logger
+{
+public:
+	static bool enabled(LogLevel level)
+	{
+		return static_cast<int>(level) <= threshold.load(std::memory_order_relaxed);
+	}
+
+	// opens (appends to) the log file and starts the flusher thread
+	static void start(const string& path)
+	{
+		Logger& logger = instance();
+		std::lock_guard<std::mutex> session(logger.sessionMutex);
+		std::lock_guard<std::mutex> lock(logger.wakeMutex);
+		if (logger.running)
+			return;
+		logger.path = path;
+		logger.running = true;
+		// nothing is logged (or even formatted) until a log session starts
+		if (threshold.load(std::memory_order_relaxed) == static_cast<int>(LogLevel::None))
+			threshold.store(static_cast<int>(LogLevel::Info), std::memory_order_relaxed);
+		logger.stopping = false;
+		logger.flusher = std::thread(&Logger::flusherLoop, &logger);
+	}
+
+	// applies settings read from RTProfileSelector.ini
+	static void configure(LogLevel level, size_t maxSize, int maxFiles)
+	{
+		Logger& logger = instance();
+		threshold.store(static_cast<int>(level), std::memory_order_relaxed);
+		logger.maxSize.store(maxSize, std::memory_order_relaxed);
+		logger.maxFiles.store(maxFiles, std::memory_order_relaxed);
+	}
+
+	// flushes everything still buffered and stops the flusher thread
+	static void stop()
+	{
+		Logger& logger = instance();
+		std::lock_guard<std::mutex> session(logger.sessionMutex);		// (a new session waits for the flusher to end)
+		{
+			std::lock_guard<std::mutex> lock(logger.wakeMutex);
+			if (!logger.running)
+				return;
+			logger.running = false;
+			logger.stopping = true;
+		}
+		logger.wake.notify_one();
+		logger.flusher.join();
+		// nothing is logged (or even formatted) again until another log session starts
+		threshold.store(static_cast<int>(LogLevel::None), std::memory_order_relaxed);
+	}
+
+	// queues a message into the calling thread's ring (never blocks)
+	static void write(LogLevel level, const string& message)
+	{
+		Logger& logger = instance();
+		LogRing& ring = logger.threadRing();
+
+		LogRing::Header header;
+		header.size = static_cast<uint32_t>(std::min(message.size(), ring.capacity() / 4));
+		header.level = static_cast<uint32_t>(level);
+		header.seq = logger.seq.fetch_add(1, std::memory_order_relaxed);
+		header.micros = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+		if (!ring.push(header, message.data()))
+			logger.dropped.fetch_add(1, std::memory_order_relaxed);
+		else if (header.seq % 64 == 0)
+			logger.wake.notify_one();		// nudge the flusher every now and then on busy runs
+	}
+
+	// also used to name temporary files shared by concurrent instances
+	static unsigned long processId()
+	{
+#ifdef _WIN32
+		return GetCurrentProcessId();
+#else
+		return static_cast<unsigned long>(getpid());
+#endif
+	}
+
+private:
+	// owns the calling thread's ring, marking it as orphaned when the thread exits
+	struct RingHolder
+	{
+		std::shared_ptr<LogRing> ring;
+		~RingHolder() { if (ring) ring->orphaned = true; }
+	};
+
+	Logger() : running(false), stopping(false), maxSize(1024 * 1024), maxFiles(3), seq(0), dropped(0), nextThreadId(1) {}
+	~Logger() { stop(); }
+
+	static Logger& instance()
+	{
+		static Logger logger;
+		return logger;
+	}
+
+	LogRing& threadRing()
+	{
+		static thread_local RingHolder holder;
+		if (!holder.ring)
+		{
+			std::lock_guard<std::mutex> lock(ringsMutex);
+			holder.ring = std::make_shared<LogRing>(nextThreadId++, 64 * 1024);
+			rings.push_back(holder.ring);
+		}
+		return *holder.ring;
+	}
+
+	void flusherLoop()
+	{
+		std::unique_lock<std::mutex> lock(wakeMutex);
+		while (!stopping)
+		{
+			wake.wait_for(lock, std::chrono::milliseconds(200));
+			lock.unlock();
+			flush();
+			lock.lock();
+		}
+		lock.unlock();
+		flush();
+	}
+
+	// drains all rings and appends their records (in global order) to the log file
+	void flush()
+	{
+		std::vector<LogRing::Record> records;
+		{
+			std::lock_guard<std::mutex> lock(ringsMutex);
+			for (auto iter = rings.begin(); iter != rings.end(); )
+			{
+				bool orphaned = (*iter)->orphaned;
+				(*iter)->drain(records);
+				if (orphaned)
+					iter = rings.erase(iter);
+				else
+					++iter;
+			}
+		}
+
+		uint64_t droppedCount = dropped.exchange(0, std::memory_order_relaxed);
+		if (records.empty() && droppedCount == 0)
+			return;
+
+		std::sort(records.begin(), records.end(),
+			[](const LogRing::Record& r1, const LogRing::Record& r2) -> bool
+			{
+				return r1.header.seq < r2.header.seq;
+			}
+		);
+
+		std::ostringstream out;
+		for (const auto& record : records)
+			formatRecord(out, record);
+		if (droppedCount != 0)
+			out << "*** " << droppedCount << " log message(s) dropped (log buffer full)\n";
+
+		{
+			std::ofstream file(path, std::ios::out | std::ios::app | std::ios::binary);
+			file << out.str();
+		}
+
+		// size-based rotation: RTProfileSelector.log -> RTProfileSelector.log.1 -> ... -> RTProfileSelector.log.<maxFiles>
+		size_t limit = maxSize.load(std::memory_order_relaxed);
+		if (limit != 0 && fileSize(path) >= limit)
+			rotate(limit);
+	}
+
+	// size of a file on disk (0 if none)
+	static size_t fileSize(const string& filePath)
+	{
+		std::ifstream file(filePath, std::ios::in | std::ios::binary | std::ios::ate);
+		std::streamoff size = file ? static_cast<std::streamoff>(file.tellg()) : 0;
+		return size > 0 ? static_cast<size_t>(size) : 0;
+	}
+
+	// Other instances may find the log too large at the same time: the log is first claimed by renaming 
+	// it to a name of this process, which only one of them can do. One that claims a log still under the 
+	// limit (started again by a message written after the other one's claim) puts it back instead.
+	void rotate(size_t limit)
+	{
+		std::ostringstream claimedPath;
+		claimedPath << path << "." << processId() << ".rotating";
+		string claimed = claimedPath.str();
+		if (rename(path.c_str(), claimed.c_str()) != 0)
+			return;		// rotated by another instance
+		if (fileSize(claimed) < limit)
+		{
+			{
+				std::ifstream in(claimed, std::ios::in | std::ios::binary);
+				std::ofstream out(path, std::ios::out | std::ios::app | std::ios::binary);
+				out << in.rdbuf();
+			}
+			remove(claimed.c_str());
+			return;
+		}
+
+		int keep = maxFiles.load(std::memory_order_relaxed);
+		if (keep <= 0)
+			remove(claimed.c_str());
+		else
+		{
+			remove((path + "." + std::to_string(keep)).c_str());
+			for (int i = keep - 1; i > 0; --i)
+				rename((path + "." + std::to_string(i)).c_str(), (path + "." + std::to_string(i + 1)).c_str());
+			rename(claimed.c_str(), (path + ".1").c_str());
+		}
+	}
+
+	static void formatRecord(std::ostream& out, const LogRing::Record& record)
+	{
+		static const char* levelNames[] = { "", "ERROR", "WARN ", "INFO ", "DEBUG" };
+
+		time_t seconds = static_cast<time_t>(record.header.micros / 1000000);
+		struct tm local;
+#ifdef _WIN32
+		localtime_s(&local, &seconds);
+#else
+		localtime_r(&seconds, &local);
+#endif
+		char timeStr[32];
+		strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", &local);
+
+		out << timeStr << "." << std::setfill('0') << std::setw(3) << (record.header.micros / 1000) % 1000 << std::setfill(' ')
+			<< " [" << processId() << ":" << record.threadId << "] "
+			<< levelNames[record.header.level < 5 ? record.header.level : 0] << " "
+			<< record.message << "\n";
+	}
+
+	static std::atomic<int> threshold;
+
+	string path;
+	bool running;
+	bool stopping;
+	std::thread flusher;
+	std::mutex sessionMutex;		// held by start() and stop()
+	std::mutex wakeMutex;
+	std::condition_variable wake;
+
+	std::atomic<size_t> maxSize;
+	std::atomic<int> maxFiles;
+
+	std::atomic<uint64_t> seq;
+	std::atomic<uint64_t> dropped;
+
+	std::mutex ringsMutex;		// only taken by the flusher and the first log call of each thread
+	std::vector<std::shared_ptr<LogRing>> rings;
+	unsigned nextThreadId;
+};
+
+std::atomic<int> Logger::threshold(static_cast<int>(LogLevel::None));
+
+// One log line: accumulates the message and queues it on destruction
+class LogLine
+{
+public:
+	explicit LogLine(LogLevel level) : level(level) {}
+	~LogLine() { Logger::write(level, stream.str()); }
+
+	template <typename T>
+	LogLine& operator<<(const T& value)
+	{
+		stream << value;
+		return *this;
+	}
+
+private:
+	LogLevel level;
+	std::ostringstream stream;
+};
+
+// Turns a whole "LogLine(...) << ..." expression into void, so that it can be used in the macro's conditional expression
+struct LogVoidify
+{
+	void operator&(const LogLine&) {}
+};
+
+#define RTPS_LOG(level)		!Logger::enabled(LogLevel::level) ? (void)0 : LogVoidify() & LogLine(LogLevel::level)
+
+// Keeps the logger running for the scope of main()
+struct LogSession
+{
+	explicit LogSession(const string& path) { Logger::start(path); }
+	~LogSession() { Logger::stop(); }
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Tracing
+//
+// With "TraceFile" set in RTProfileSelector.ini, the stages each image goes through (keyfile parse,
+// Exif extraction, matching, partial profiles, ISO/lens lookups, merge and write) are recorded as
+// spans, with the image and thread, and appended to that file in Chrome's trace event format
+// (a JSON array of "complete" events), for chrome://tracing or https://ui.perfetto.dev.
+// Spans go to per-thread buffers (no locking) and are written when the trace session ends, all 
+// at once; the array is left open, which both viewers accept, so that runs (processes) can keep
+// appending to the same file.
+//
+
+// A recorded span
+struct TraceEvent
+{
+	const char* stage;
+	string image;
+	int64_t begin;			// microseconds since the epoch (comparable across processes)
+	int64_t duration;
+};
+
+// Spans recorded by a single thread (only written by that thread)
+struct TraceBuffer
+{
+	unsigned threadId;
+	std::vector<TraceEvent> events;
+
+	explicit TraceBuffer(unsigned threadId) : threadId(threadId) {}
+};
+
+// The process-wide tracer: per-thread buffers, written out by stop()
+class Tracer
+{
+public:
+	static bool enabled() { return active.load(std::memory_order_relaxed); }
+
+	static int64_t now()
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	}
+
+	static void start(const string& path)
+	{
+		Tracer& tracer = instance();
+		std::lock_guard<std::mutex> lock(tracer.buffersMutex);
+		tracer.path = path;
+		active.store(true, std::memory_order_relaxed);
+	}
+
+	// appends the spans recorded so far to the trace file (threads must be done tracing by then)
+	static void stop()
+	{
+		Tracer& tracer = instance();
+		if (!active.exchange(false))
+			return;
+		std::lock_guard<std::mutex> lock(tracer.buffersMutex);
+		std::ostringstream out;
+		for (const auto& buffer : tracer.buffers)
+		{
+			for (const auto& event : buffer->events)
+			{
+				out << "{\"name\":\"" << event.stage << "\",\"cat\":\"rtps\",\"ph\":\"X\",\"ts\":" << event.begin 
+					<< ",\"dur\":" << event.duration << ",\"pid\":" << Logger::processId() << ",\"tid\":" << buffer->threadId
+					<< ",\"args\":{\"image\":\"" << jsonEscape(event.image) << "\"}},\n";
+			}
+			buffer->events.clear();
+		}
+		string events = out.str();
+		if (events.empty())
+			return;
+
+		// a single write, so that concurrent runs don't mix their events
+		FILE* file = fopen(tracer.path.c_str(), "ab");
+		if (file == nullptr)
+		{
+			RTPS_LOG(Warning) << "Can't open trace file: " << tracer.path;
+			return;
+		}
+		fseek(file, 0, SEEK_END);
+		if (ftell(file) == 0)
+			events = "[\n" + events;
+		fwrite(events.data(), 1, events.size(), file);
+		fclose(file);
+	}
+
+	// image the calling thread's spans are about
+	static string& currentImage()
+	{
+		static thread_local string image;
+		return image;
+	}
+
+	static void record(const char* stage, int64_t begin, int64_t end)
+	{
+		instance().threadBuffer().events.push_back({ stage, currentImage(), begin, end - begin });
+	}
+
+private:
+	Tracer() : nextThreadId(1) {}
+
+	static Tracer& instance()
+	{
+		static Tracer tracer;
+		return tracer;
+	}
+
+	TraceBuffer& threadBuffer()
+	{
+		// buffers outlive their threads (their spans are written out by stop())
+		static thread_local std::shared_ptr<TraceBuffer> buffer;
+		if (!buffer)
+		{
+			std::lock_guard<std::mutex> lock(buffersMutex);
+			buffer = std::make_shared<TraceBuffer>(nextThreadId++);
+			buffers.push_back(buffer);
+		}
+		return *buffer;
+	}
+
+	static string jsonEscape(const string& text)
+	{
+		string escaped;
+		for (char c : text)
+		{
+			if (c == '"' || c == '\\')
+				escaped += '\\';
+			if (static_cast<unsigned char>(c) >= 0x20)
+				escaped += c;
+		}
+		return escaped;
+	}
+
+	static std::atomic<bool> active;
+	string path;
+	std::mutex buffersMutex;
+	std::vector<std::shared_ptr<TraceBuffer>> buffers;
+	unsigned nextThreadId;
+};
+
+std::atomic<bool> Tracer::active(false);
+
+// Records the time spent in the enclosing scope as a span of the given stage
+class TraceSpan
+{
+public:
+	explicit TraceSpan(const char* stage) : stage(stage), begin(Tracer::enabled() ? Tracer::now() : 0) {}
+	~TraceSpan() { end(); }
+
+	// ends the span before the end of the scope
+	void end()
+	{
+		if (begin != 0)
+			Tracer::record(stage, begin, Tracer::now());
+		begin = 0;
+	}
+
+private:
+	const char* stage;
+	int64_t begin;
+};
+
+// Sets the image the calling thread's spans are about, for the enclosing scope
+class TraceImage
+{
+public:
+	explicit TraceImage(const string& image = "") : previous(Tracer::currentImage()) { set(image); }
+	~TraceImage() { Tracer::currentImage() = previous; }
+
+	void set(const string& image)
+	{
+		if (Tracer::enabled())
+			Tracer::currentImage() = image.substr(image.find_last_of("\\/") + 1);
+	}
+
+private:
+	string previous;
+};
+
+// Keeps the tracer running for the scope of main(), if a trace file is given
+struct TraceSession
+{
+	explicit TraceSession(const string& path) { if (!path.empty()) Tracer::start(path); }
+	~TraceSession() { Tracer::stop(); }
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Utility functions for dealing with INI-styled files
+//
+
+// Length of the ASCII prefix of a buffer (up to the first byte with the high bit set): 16 bytes
+// at a time with SSE2, 8 at a time otherwise
+inline size_t asciiPrefix(const char* data, size_t size)
+{
+	size_t i = 0;
+#ifdef RTPS_HAVE_SSE2
+	for (; i + 16 <= size; i += 16)
+	{
+		// the high bits of the 16 bytes
+		if (_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i))) != 0)
+			break;
+	}
+#endif
+	for (; i + 8 <= size; i += 8)
+	{
+		uint64_t word;
+		memcpy(&word, data + i, sizeof(word));
+		if (word & 0x8080808080808080ULL)
+			break;
+	}
+	while (i < size && static_cast<unsigned char>(data[i]) < 0x80)
+		i++;
+	return i;
+}
+
+// How text read from INI files is converted from UTF-8 (see utf8ToString()): settings of the snapshot
+// (or library tables) being used, so that a reload doesn't change it under the threads still reading
+struct TextEncoding
+{
+	std::locale locale;		// "DefaultLocale" (ex: DefaultLocale=.1252), the default one if not set
+	bool keepUtf8;			// "KeepUTF8=1" (and no "DefaultLocale"): kept as UTF-8, like exiftool's output
+
+	TextEncoding() : keepUtf8(false) {}
+};
+
+// Encoding of the text read by the current thread, if set (see EncodingScope)
+thread_local const TextEncoding* textEncoding = nullptr;
+
+// Sets the encoding of the text read by the current thread during its lifetime
+struct EncodingScope
+{
+	explicit EncodingScope(const TextEncoding* encoding) : previous(textEncoding) { textEncoding = encoding; }
+	~EncodingScope() { textEncoding = previous; }
+
+	const TextEncoding* previous;
+};
+
+// convert UTF-8 string to current locale single-byte string (in place)
+// ASCII text (nearly all of it) is left untouched; characters the locale doesn't have, and invalid 
+// UTF-8 sequences, become '?'
+void utf8ToString(string& utf8str)
+{
+	static const TextEncoding defaultEncoding;
+	const TextEncoding& encoding = textEncoding != nullptr ? *textEncoding : defaultEncoding;
+	size_t i = asciiPrefix(utf8str.data(), utf8str.size());
+	if (i == utf8str.size() || encoding.keepUtf8)
+		return;
+
+	const std::ctype<wchar_t>& facet = std::use_facet<std::ctype<wchar_t>>(encoding.locale);
+	string result(utf8str, 0, i);
+	result.reserve(utf8str.size());
+	while (i < utf8str.size())
+	{
+		// ASCII run
+		size_t ascii = asciiPrefix(utf8str.data() + i, utf8str.size() - i);
+		result.append(utf8str, i, ascii);
+		i += ascii;
+		if (i == utf8str.size())
+			break;
+
+		// one multi-byte sequence
+		unsigned char lead = static_cast<unsigned char>(utf8str[i]);
+		size_t length = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : lead >= 0xC0 ? 2 : 1;
+		uint32_t codePoint = lead & (0x7F >> length);
+		bool valid = length > 1 && lead < 0xF5 && i + length <= utf8str.size();
+		for (size_t j = 1; valid && j < length; j++)
+		{
+			unsigned char next = static_cast<unsigned char>(utf8str[i + j]);
+			valid = (next & 0xC0) == 0x80;
+			codePoint = (codePoint << 6) | (next & 0x3F);
+		}
+		static const uint32_t minimum[] = { 0, 0, 0x80, 0x800, 0x10000 };
+		valid = valid && codePoint >= minimum[length] && codePoint <= 0x10FFFF && (codePoint < 0xD800 || codePoint > 0xDFFF);
+		if (valid && codePoint <= static_cast<uint32_t>(std::numeric_limits<wchar_t>::max()))
+			result += facet.narrow(static_cast<wchar_t>(codePoint), '?');
+		else
+			result += '?';
+		i += valid ? length : 1;
+	}
+	utf8str.swap(result);
+}
+
+// Lines of a text file, read and converted from UTF-8 (see utf8ToString()) all at once
+class TextLines
+{
+public:
+	explicit TextLines(const string& path) : pos(0), lines(0)
+	{
+		std::ifstream file(path, std::ios::binary);
+		std::ostringstream contents;
+		contents << file.rdbuf();
+		text = contents.str();
+		// skip UTF-8 byte order mark (before the conversion, which would turn it into a '?')
+		if (text.compare(0, 3, "\xEF\xBB\xBF") == 0)
+			text.erase(0, 3);
+		utf8ToString(text);
+	}
+
+	// next line (without its end of line), false at the end of the file
+	bool next(string& line)
+	{
+		if (pos >= text.size())
+			return false;
+		size_t end = text.find('\n', pos);
+		if (end == string::npos)
+			end = text.size();
+		line.assign(text, pos, end - pos);
+		pos = end + 1;
+		lines++;
+		return true;
+	}
+
+	// number of the last line returned by next() (1 for the first)
+	uint32_t lineNumber() const { return lines; }
+
+private:
+	string text;
+	size_t pos;
+	uint32_t lines;
+};
+
+// Removes trailing '\r', fust in case we're reading a Windows text file in Linux
+inline void removeReturnChar(string& line)
+{
+	if (!line.empty() && line[line.size() - 1] == '\r')
+		line.resize(line.size() - 1);
+}
+
+// Parses line as INI section ("[section]")
+// returns true if line was correctly parsed as a INI section and loaded int 'section'
+bool parseSection(const string& line, string& section)
+{
+	if (line.size() < 2 ||				// must have at least opening and closing brackets
+		line[0] != '[' ||				// first char must be opening bracket
+		line[line.size() - 1] != ']')	// last char must be closing bracket
+		return false;
+	section = line.substr(1, line.size() - 2);	// section name without brackets 
+	return true;
+}
+
+// Parses line as INI entry pair ("Key=Value")
+// returns true if line was correctly parsed as a key=value pair and loaded into 'keyVal'
+bool parseEntry(const string line, IniEntry& entry)
+{
+	size_t eq = line.find('=');
+	if (eq == string::npos ||			// key-value separator not found
+		eq == 0 ||						// separator at start of line (empty key)
+		line[0] == ';')					// comment line
+		return false;					// => not a valid line
+
+	entry.first = line.substr(0, eq);
+	entry.second = line.substr(eq + 1);
+	return true;
+}
+
+// Files read by the current thread while building a profile (found or not), if being recorded (see DependencyScope)
+thread_local std::vector<string>* dependencyLog = nullptr;
+
+inline void recordDependency(const string& path)
+{
+	if (dependencyLog != nullptr)
+		dependencyLog->push_back(path);
+}
+
+// Records the files read by the current thread during its lifetime
+struct DependencyScope
+{
+	explicit DependencyScope(std::vector<string>& files) : previous(dependencyLog) { dependencyLog = &files; }
+	~DependencyScope() { dependencyLog = previous; }
+
+	std::vector<string>* previous;
+};
+
+// Value of a key from an INI map (empty if not found), without adding it to the map
+const string& getIniValue(const IniMap& ini, const string& section, const string& key)
+{
+	static const string empty;
+	auto sectionIter = ini.find(section);
+	if (sectionIter == ini.end())
+		return empty;
+	auto entry = sectionIter->second.find(key);
+	return entry == sectionIter->second.end() ? empty : entry->second.value;
+}
+
+// Text encoding set in RTProfileSelector.ini ("DefaultLocale", "KeepUTF8")
+TextEncoding readTextEncoding(const IniMap& rtSelectorIni)
+{
+	TextEncoding encoding;
+	const string& localeName = getIniValue(rtSelectorIni, RTPS_INI_SECTION_GENERAL, "DefaultLocale");
+	if (!localeName.empty())
+		encoding.locale = std::locale(localeName);
+	encoding.keepUtf8 = localeName.empty() && getIniValue(rtSelectorIni, RTPS_INI_SECTION_GENERAL, "KeepUTF8") == "1";
+	return encoding;
+}
+
+bool takeReadAhead(const string& path, IniMap& ini);
+
+// Reads the whole INI file contents (sections, keys and values) into a map for easy access
+// note: section names must be unique, otherwise entries from different sections with the same name will be merged
+IniMap readIni(const string& iniPath)
+{
+	recordDependency(iniPath);
+	IniMap iniMap;
+	if (takeReadAhead(iniPath, iniMap))		// (see ProfileReadAhead)
+		return iniMap;
+	string line, section;
+	TextLines iniFile(iniPath);
+	uint32_t source = SourceTable::intern(iniPath);
+
+	while (iniFile.next(line))
+	{
+		removeReturnChar(line);
+		IniEntry entry;
+		if (!parseSection(line, section) &&		// not a section
+			!section.empty() &&					// we already have a valid section
+			parseEntry(line, entry))			// line was correctly read as key=value
+		{
+			entry.second.source = source;
+			entry.second.line = iniFile.lineNumber();
+			iniMap[section].insert(entry);		// one more entry in the current section
+		}
+	}
+
+	return iniMap;
+}
+
+// Rules files may include other rules files with "@Include=<path>" lines, where the file name (not the 
+// folders) may have wildcards (e.g. "@Include=rules.d/*.ini"), relative to the including file's folder
+// unless a full path. The sections of the matching files, taken in name order, are inserted where the
+// line is, exactly as if they were all concatenated into the including file; the lines after it up to 
+// the next section are ignored. Included files are parsed in parallel. A file already being included
+// (e.g. matched by its own "*.ini" pattern) is skipped. Includes nested too deeply are an error, and
+// then only the sections of the top file itself are used.
+#define RTPS_INCLUDE_DIRECTIVE		"@Include="
+#define RTPS_INCLUDE_MAX_DEPTH		8
+
+// Sections of an INI file, in file order
+typedef std::vector<std::pair<string, EntryMap>> IniSectionList;
+
+std::vector<string> listDirectory(const string& path);
+bool isFullPath(const string& path);
+
+// Matches a file name against a pattern with '*' (any characters) and '?' (any single character) wildcards
+bool matchWildcard(const char* pattern, const char* name)
+{
+	const char* star = nullptr;
+	const char* retry = nullptr;
+	while (*name != '\0')
+	{
+		if (*pattern == '*')
+		{
+			star = pattern++;
+			retry = name;
+		}
+		else if (*pattern == '?' || *pattern == *name)
+		{
+			pattern++;
+			name++;
+		}
+		else if (star != nullptr)
+		{	// let the last '*' take one more character
+			pattern = star + 1;
+			name = ++retry;
+		}
+		else
+			return false;
+	}
+	while (*pattern == '*')
+		pattern++;
+	return *pattern == '\0';
+}
+
+// Files included by an "@Include" line, in name order
+std::vector<string> expandInclude(const string& includingPath, string pattern)
+{
+	std::replace(pattern.begin(), pattern.end(), REVERSE_SLASH_CHAR, SLASH_CHAR);
+	if (!isFullPath(pattern))
+	{
+		size_t slash = includingPath.find_last_of(SLASH_CHAR);
+		if (slash != string::npos)
+			pattern = includingPath.substr(0, slash + 1) + pattern;
+	}
+
+	size_t slash = pattern.find_last_of(SLASH_CHAR);
+	string folder = slash == string::npos ? "." : pattern.substr(0, slash);
+	string namePattern = slash == string::npos ? pattern : pattern.substr(slash + 1);
+	if (namePattern.find_first_of("*?") == string::npos)
+		return std::vector<string>(1, pattern);
+
+	std::vector<string> files;
+	for (const auto& name : listDirectory(folder))
+		if (matchWildcard(namePattern.c_str(), name.c_str()))
+			files.push_back(folder + SLASH_CHAR + name);
+	return files;
+}
+
+// Absolute path of a file, without "." or ".." components nor symbolic links (the path as is if it can't be resolved)
+string canonicalPath(const string& path)
+{
+#ifdef _WIN32
+	char resolved[MAX_PATH];
+	DWORD size = GetFullPathNameA(path.c_str(), MAX_PATH, resolved, NULL);
+	if (size == 0 || size >= MAX_PATH)
+		return path;
+	string result(resolved, size);
+	std::transform(result.begin(), result.end(), result.begin(), ::tolower);		// (case-insensitive file system)
+	return result;
+#else
+	char* resolved = realpath(path.c_str(), nullptr);
+	if (resolved == nullptr)
+		return path;
+	string result = resolved;
+	free(resolved);
+	return result;
+#endif
+}
+
+// Reads the sections of a rules file, including the sections of the files it includes (see above)
+// 'chain': canonical paths of the files being included down to this one (this one last); false if an include failed
+// (then 'sections' only has the file's own sections)
+bool readIniSections(const string& iniPath, const std::vector<string>& chain, IniSectionList& sections)
+{
+	// sections of this file, and the files included before each section
+	recordDependency(iniPath);
+	std::vector<std::pair<size_t, string>> includes;
+	string line, section;
+	TextLines iniFile(iniPath);
+	uint32_t source = SourceTable::intern(iniPath);
+
+	while (iniFile.next(line))
+	{
+		removeReturnChar(line);
+		// check section
+		if (parseSection(line, section))
+		{
+			// allows multiple sections with the same name
+			sections.push_back(std::make_pair(section, EntryMap()));
+		}
+		else if (line.compare(0, strlen(RTPS_INCLUDE_DIRECTIVE), RTPS_INCLUDE_DIRECTIVE) == 0)
+		{
+			for (const auto& file : expandInclude(iniPath, line.substr(strlen(RTPS_INCLUDE_DIRECTIVE))))
+			{
+				if (std::find(chain.begin(), chain.end(), canonicalPath(file)) == chain.end())
+					includes.push_back(std::make_pair(sections.size(), file));
+				else
+					RTPS_LOG(Debug) << "Rules file " << file << " already being included: not included again by " << iniPath;
+			}
+			section.clear();
+		}
+		else // may be an entry
+		{	
+			IniEntry entry;
+			if (!section.empty() &&						// already have a valid section
+				parseEntry(line, entry))				// line was correctly read as key=value
+			{
+				entry.second.source = source;
+				entry.second.line = iniFile.lineNumber();
+				sections.back().second.insert(entry);	// one more entry in the current section
+			}
+		}
+	}
+	if (includes.empty())
+		return true;
+	if (chain.size() > RTPS_INCLUDE_MAX_DEPTH)
+	{
+		RTPS_LOG(Error) << "Rules files included too deeply: " << iniPath;
+		return false;
+	}
+
+	// included files: read in parallel by the top file, each into its own list
+	std::vector<IniSectionList> included(includes.size());
+	std::vector<unsigned char> includedOk(includes.size(), 0);
+	std::vector<std::vector<string>> includedFiles(includes.size());
+	std::atomic<size_t> next(0);
+	const TextEncoding* encoding = textEncoding;
+	auto worker = [&]()
+	{
+		for (size_t i = next++; i < includes.size(); i = next++)
+		{
+			DependencyScope scope(includedFiles[i]);
+			EncodingScope encodingScope(encoding);
+			std::vector<string> includedChain = chain;
+			includedChain.push_back(canonicalPath(includes[i].second));
+			includedOk[i] = readIniSections(includes[i].second, includedChain, included[i]);
+		}
+	};
+	std::vector<std::thread> threads;
+	if (chain.size() == 1)
+		for (unsigned i = 1; i < std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), includes.size()); i++)
+			threads.push_back(std::thread(worker));
+	worker();
+	for (auto& thread : threads)
+		thread.join();
+	for (const auto& files : includedFiles)
+		for (const auto& file : files)
+			recordDependency(file);
+	RTPS_LOG(Debug) << "Rules file " << iniPath << ": " << includes.size() << " file(s) included";
+	if (std::find(includedOk.begin(), includedOk.end(), 0) != includedOk.end())
+		return false;
+
+	// merged in file order
+	IniSectionList merged;
+	auto include = includes.begin();
+	for (size_t i = 0; i <= sections.size(); i++)
+	{
+		for (; include != includes.end() && include->first == i; ++include)
+			for (auto& includedSection : included[include - includes.begin()])
+				merged.push_back(std::move(includedSection));
+		if (i < sections.size())
+			merged.push_back(std::move(sections[i]));
+	}
+	sections = std::move(merged);
+	return true;
+}
+
+// Reads the whole INI file contents (sections, keys and values) into a map for easy access
+// note: sections duplicated in the INI file will be treated as distinct entry maps
+IniMultiMap readMultiIni(const string& iniPath)
+{
+	IniMultiMap iniMap;
+	IniSectionList sections;
+	if (!readIniSections(iniPath, std::vector<string>(1, canonicalPath(iniPath)), sections))
+		RTPS_LOG(Error) << "Rules file " << iniPath << ": included files ignored (see above)";
+	for (auto& section : sections)
+		iniMap.insert(IniMultiMap::value_type(section.first, std::move(section.second)));
+	return iniMap;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Utility functions for parsing a tab-delimited (key-TAB-value) file generated by "exiftool -t"
+//
+
+// Parses line as a key-value pair delimited by a single tab character
+bool parseExifLine(const string& line, StrPair& keyVal)
+{
+	size_t tab = line.find('\t');
+	if (tab == string::npos)
+		return false;			// tab separator not found
+
+	keyVal.first = line.substr(0, tab);
+	keyVal.second = line.substr(tab + 1);
+	return true;
+}
+
+// Reads the whole Exif file contents (list of tab separated key-values) into a map for easy access
+StrMap readExifOutput(const string& path)
+{
+	StrMap exifMap;
+	string line;
+	std::ifstream iniFile(path);
+
+	while (std::getline(iniFile, line))
+	{
+		StrPair keyVal;
+		if (parseExifLine(line, keyVal))
+			exifMap.insert(keyVal);
+	}
+
+	return exifMap;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//
+// General utility functions
+//
+
+// Simple trim removing tabs and spaces from begin of string
+inline string trimLeft(const string& s)
+{
+	size_t firstNonSpace = s.find_first_not_of("\t ");
+	if (string::npos != firstNonSpace)
+		return s.substr(firstNonSpace);
+	return s;
+}
+
+// Evaluates a string as a double.  
+// Attempts to perform a division operation if "/" is found, so that we can convert Exif exposure values
+// such as in "Exposure Time=1/1300"
+double eval(const string& str, double defaultValue)
+{
+	double d = defaultValue;
+	try
+	{
+		size_t divPos = str.find_first_of('/');
+		if (divPos == string::npos)
+			d = std::stod(str);		// simple conversion
+		else
+		{
+			// does division
+			double denominator = std::stod(str.substr(divPos + 1));
+			if (denominator != 0.0)
+				d = std::stod(str.substr(0, divPos)) / denominator;
+		}
+	}
+	catch (...)
+	{
+	}
+	return d;
+}
+
+// Wall-clock stopwatch splitting a run into named phases (logged when "LogTimings=1")
+class PhaseTimer
+{
+public:
+	PhaseTimer() : start(std::chrono::steady_clock::now()), last(start) {}
+
+	// ends the current phase, naming it
+	void lap(const string& phase)
+	{
+		auto now = std::chrono::steady_clock::now();
+		phases.push_back(std::make_pair(phase, milliseconds(last, now)));
+		last = now;
+	}
+
+	// adds phases timed elsewhere (e.g. by RtpsSnapshot::select()), which end now
+	void append(const std::vector<std::pair<string, double>>& laps)
+	{
+		phases.insert(phases.end(), laps.begin(), laps.end());
+		last = std::chrono::steady_clock::now();
+	}
+
+	const std::vector<std::pair<string, double>>& laps() const { return phases; }
+
+	// "phase1=0.123 phase2=4.567 ... total=4.690" (milliseconds)
+	string summary() const
+	{
+		std::ostringstream ss;
+		ss << std::setiosflags(std::ios::fixed) << std::setprecision(3);
+		for (const auto& phase : phases)
+			ss << phase.first << "=" << phase.second << " ";
+		ss << "total=" << milliseconds(start, last);
+		return ss.str();
+	}
+
+private:
+	static double milliseconds(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to)
+	{
+		return std::chrono::duration<double, std::milli>(to - from).count();
+	}
+
+	std::chrono::steady_clock::time_point start, last;
+	std::vector<std::pair<string, double>> phases;
+};
+
+// Whether a path is a full one (as opposed to relative to the current folder)
+bool isFullPath(const string& path)
+{
+#ifdef _WIN32
+	return (path.size() > 1 && path[1] == ':') || (!path.empty() && (path[0] == SLASH_CHAR || path[0] == REVERSE_SLASH_CHAR));
+#else
+	return !path.empty() && path[0] == SLASH_CHAR;
+#endif
+}
+
+// Removes double slashes ("\\") from path values read from RT's keyfile on Windows
+string removeDoubleSlashes(const string& path)
+{
+	string result = path;
+	string doubleSlash = { SLASH_CHAR, SLASH_CHAR };
+	string singleSlash = { SLASH_CHAR };
+	size_t pos = 0;
+
+	while ((pos = result.find(doubleSlash, pos)) != string::npos)
+	{
+		result.replace(pos, doubleSlash.length(), singleSlash);
+		pos += singleSlash.length();
+	}
+
+	return result;
+}
+
+// Adds double slashes ("\\") to path values that are to be written to .pp3 files
+string addDoubleSlashes(const string& path)
+{
+	string result = path;
+
+#ifdef _WIN32
+	string doubleSlash = { SLASH_CHAR, SLASH_CHAR };
+	string singleSlash = { SLASH_CHAR };
+	size_t pos = 0;
+
+	while ((pos = result.find(singleSlash, pos)) != string::npos)
+	{
+		result.replace(pos, singleSlash.length(), doubleSlash);
+		pos += doubleSlash.length();
+	}
+#endif
+
+	return result;
+}
+
+// Prepares path string for output in .PP3-compatible format
+string adjustRTOutputSlashes(const string& path)
+{
+	return addDoubleSlashes(removeDoubleSlashes(path));
+}
+
+// Converts any of the reverse slash char (for Windows: '/', for *nix:'\') to the current OS path slash
+string convertoToCurrentOSPath(const string& path)
+{
+	string result = path;
+	string currentSlash = { SLASH_CHAR };
+	string reverseSlash = { REVERSE_SLASH_CHAR };
+	size_t pos = 0;
+
+	while ((pos = result.find(reverseSlash, pos)) != string::npos)
+	{
+		result.replace(pos, 1, currentSlash);
+		pos += 1;
+	}
+
+	return result;
+}
+
+// Replaces reserved (forbidden) characters with space (' ') so as to create a valid file name according to the target OS
+string safeFileName(const string& str)
+{
+	string safeStr = str;
+	std::replace_if(safeStr.begin(), safeStr.end(),
+		[](char c) -> bool
+		{
+#ifdef _WIN32
+			static const string reservedChars = "<>:\"/\\|?";
+#else
+			static const string reservedChars = "/";
+#endif
+			return reservedChars.find(c) != string::npos;
+		}, '_');
+	return safeStr;
+}
+
+// Lists the names of the files (not subdirectories) in a directory, sorted
+std::vector<string> listDirectory(const string& path)
+{
+	std::vector<string> names;
+#ifdef _WIN32
+	WIN32_FIND_DATA data;
+	HANDLE find = FindFirstFile((path + "\\*").c_str(), &data);
+	if (find != INVALID_HANDLE_VALUE)
+	{
+		do
+		{
+			if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+				names.push_back(data.cFileName);
+		} while (FindNextFile(find, &data));
+		FindClose(find);
+	}
+#else
+	DIR* dir = opendir(path.c_str());
+	if (dir != nullptr)
+	{
+		while (struct dirent* entry = readdir(dir))
+		{
+			struct stat st;
+			if (stat((path + SLASH_CHAR + entry->d_name).c_str(), &st) == 0 && S_ISREG(st.st_mode))
+				names.push_back(entry->d_name);
+		}
+		closedir(dir);
+	}
+#endif
+	std::sort(names.begin(), names.end());
+	return names;
+}
+
+// Gets a file's size and the time (seconds since the epoch) it was last modified or created, whichever
+// is later (so that files copied with their original modification time still count as changed)
+bool fileStat(const string& path, long long& size, long long& changed)
+{
+#ifdef _WIN32
+	struct __stat64 st;
+	if (_stat64(path.c_str(), &st) != 0)
+		return false;
+#else
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0)
+		return false;
+#endif
+	size = st.st_size;
+	changed = std::max<long long>(st.st_mtime, st.st_ctime);
+	return true;
+}
+
+// Creates a directory (its parent must exist), returning whether it exists afterwards
+bool makeDirectory(const string& path)
+{
+#ifdef _WIN32
+	return CreateDirectory(path.c_str(), NULL) || GetLastError() == ERROR_ALREADY_EXISTS;
+#else
+	return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+#endif
+}
+
+// Removes an empty directory
+bool removeDirectory(const string& path)
+{
+#ifdef _WIN32
+	return RemoveDirectory(path.c_str()) != 0;
+#else
+	return rmdir(path.c_str()) == 0;
+#endif
+}
+
+// 64-bit FNV-1a hash, continuing from a previous one
+inline uint64_t hashBytes(const char* data, size_t size, uint64_t hash = 14695981039346656037ULL)
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= static_cast<unsigned char>(data[i]);
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+inline string hashToString(uint64_t hash)
+{
+	char hex[17];
+	snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(hash));
+	return hex;
+}
+
+// Hash of a string as 16 hex digits, used for naming cache files
+string hashString(const string& str)
+{
+	return hashToString(hashBytes(str.data(), str.size()));
+}
+
+// Hash of a file's contents as 16 hex digits ("-" if the file can't be read)
+string hashFile(const string& path)
+{
+	std::ifstream file(path, std::ios::binary);
+	if (!file.good())
+		return "-";
+	uint64_t hash = hashBytes(nullptr, 0);
+	char buffer[16384];
+	while (file.read(buffer, sizeof(buffer)) || file.gcount() > 0)
+		hash = hashBytes(buffer, static_cast<size_t>(file.gcount()), hash);
+	return hashToString(hash);
+}
+
+// Renames a file over another one, replacing it at once if it exists (rename() doesn't on Windows)
+bool replaceFile(const string& srcPath, const string& destPath)
+{
+#ifdef _WIN32
+	return MoveFileEx(srcPath.c_str(), destPath.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	return rename(srcPath.c_str(), destPath.c_str()) == 0;
+#endif
+}
+
+// Copies the contents of a source file to a destination file
+bool copyFile(const string& srcPath, const string& destPath)
+{
+	std::ifstream  src(srcPath, std::ios::binary);
+	if (!src.good())
+		return false;
+
+	std::ofstream  dst(destPath, std::ios::binary);
+	if (!dst.good())
+		return false;
+
+	dst << src.rdbuf();
+	return true;	// no error checking...
+}
+
+// Launches a process, optionally redirecting output and waiting for termination
+// Note: this is bad and ugly, I wanted to have as little OS-specific code as possible, but on Windows
+// the call to system() always flashes a nagging console window, so had to resort to CreateProcess()
+// When waiting with a timeout (milliseconds, 0 = none), the process and its children are killed at the
+// deadline and false is returned
+bool executeProcess(const string& cmdline, const string& redirectFile, bool waitForTermination, int timeoutMs = 0)
+{
+	bool finished = true;
+#ifdef _WIN32
+	SECURITY_ATTRIBUTES sa = { sizeof(SECURITY_ATTRIBUTES), NULL, TRUE };
+	HANDLE hfile = redirectFile.empty() ? NULL : CreateFile(redirectFile.c_str(), FILE_APPEND_DATA, FILE_SHARE_WRITE, &sa, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	
+	PROCESS_INFORMATION pi = { 0 };
+	STARTUPINFO si = { sizeof(STARTUPINFO) };
+	si.dwFlags |= STARTF_USESTDHANDLES;
+	si.hStdError = si.hStdOutput = hfile;
+
+	// with a deadline, the process runs in a job object so that any child it starts is killed along with it
+	HANDLE job = waitForTermination && timeoutMs > 0 ? CreateJobObject(NULL, NULL) : NULL;
+
+	std::vector<char> cmd(cmdline.c_str(), cmdline.c_str() + cmdline.size() + 1);
+	if (CreateProcess(NULL, &cmd[0], NULL, NULL, TRUE, CREATE_NO_WINDOW | (job != NULL ? CREATE_SUSPENDED : 0), NULL, NULL, &si, &pi))
+	{
+		if (job != NULL)
+		{
+			AssignProcessToJobObject(job, pi.hProcess);
+			ResumeThread(pi.hThread);
+		}
+		if (waitForTermination && WaitForSingleObject(pi.hProcess, job != NULL ? timeoutMs : INFINITE) == WAIT_TIMEOUT)
+		{
+			TerminateJobObject(job, 1);
+			WaitForSingleObject(pi.hProcess, INFINITE);
+			finished = false;
+		}
+		CloseHandle(pi.hProcess);
+		CloseHandle(pi.hThread);
+	}
+	if (job != NULL)
+		CloseHandle(job);
+	if (hfile != 0)
+		CloseHandle(hfile);
+#else
+	string cmd = cmdline;
+	if (!redirectFile.empty())
+		cmd += " > \"" + redirectFile + "\"";
+
+	// with a deadline, the shell runs in its own process group so that it can be killed along with its children
+	pid_t pid = waitForTermination && timeoutMs > 0 ? fork() : -1;
+	if (pid == 0)
+	{
+		setpgid(0, 0);
+		execl("/bin/sh", "sh", "-c", cmd.c_str(), static_cast<char*>(nullptr));
+		_exit(127);
+	}
+	else if (pid > 0)
+	{
+		setpgid(pid, pid);
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+		int status, pollMs = 1;
+		while (waitpid(pid, &status, WNOHANG) == 0)
+		{
+			if (std::chrono::steady_clock::now() >= deadline)
+			{
+				kill(-pid, SIGKILL);
+				waitpid(pid, &status, 0);
+				finished = false;
+				break;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(pollMs));
+			pollMs = std::min(pollMs * 2, 20);
+		}
+	}
+	else
+	{
+		if (!waitForTermination)
+			cmd += "&";
+		system(cmd.c_str());
+	}
+#endif
+	return finished;
+}
+
+// Starts a program (args[0], searched in the PATH if without a path) detached from this process: in a
+// session of its own without a console, its output discarded, left running when this process exits
+// ('error' says why it couldn't start)
+bool startDetachedProcess(const std::vector<string>& args, string& error)
+{
+#ifdef _WIN32
+	string cmdline;
+	for (const auto& arg : args)
+		cmdline += (cmdline.empty() ? "\"" : " \"") + arg + "\"";
+	std::vector<char> cmd(cmdline.c_str(), cmdline.c_str() + cmdline.size() + 1);
+	PROCESS_INFORMATION pi = { 0 };
+	STARTUPINFO si = { sizeof(STARTUPINFO) };
+	if (!CreateProcess(NULL, &cmd[0], NULL, NULL, FALSE, DETACHED_PROCESS | CREATE_NEW_PROCESS_GROUP, NULL, NULL, &si, &pi))
+	{
+		error = "CreateProcess() failed, error " + std::to_string(GetLastError());
+		return false;
+	}
+	CloseHandle(pi.hProcess);
+	CloseHandle(pi.hThread);
+	return true;
+#else
+	std::vector<char*> argv;
+	for (const auto& arg : args)
+		argv.push_back(const_cast<char*>(arg.c_str()));
+	argv.push_back(nullptr);
+
+	// forked twice (the program isn't this process' child, so never left a zombie), the second child
+	// writing back through a close-on-exec pipe why exec failed (nothing written if it succeeded)
+	int status[2];
+	if (pipe(status) != 0)
+	{
+		error = string("pipe() failed: ") + strerror(errno);
+		return false;
+	}
+	fcntl(status[1], F_SETFD, FD_CLOEXEC);
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		close(status[0]);
+		setsid();
+		if (fork() != 0)
+			_exit(0);
+		int null = open(NULL_DEVICE, O_RDWR);
+		if (null >= 0)
+		{
+			dup2(null, 0);
+			dup2(null, 1);
+			dup2(null, 2);
+		}
+		execvp(argv[0], &argv[0]);
+		int execError = errno;
+		if (write(status[1], &execError, sizeof(execError)) < 0) {}
+		_exit(127);
+	}
+	close(status[1]);
+	if (pid < 0)
+	{
+		error = string("fork() failed: ") + strerror(errno);
+		close(status[0]);
+		return false;
+	}
+	waitpid(pid, nullptr, 0);
+	int execError = 0;
+	ssize_t size;
+	while ((size = read(status[0], &execError, sizeof(execError))) < 0 && errno == EINTR) {}
+	close(status[0]);
+	if (size == sizeof(execError))
+	{
+		error = args[0] + ": " + strerror(execError);
+		return false;
+	}
+	return true;
+#endif
+}
+
+void copyKeys(StrMap& exifFields, const IniMap& rtProfileParams, const string& section, const string& scope = "")
+{
+	std::string preffix = scope.empty() ? "" : scope + "."; 
+	auto iter = rtProfileParams.find(section);
+	if (iter != rtProfileParams.end())
+	{
+		for (auto keyval: iter->second)
+		{
+			if (keyval.second == "$subdir")
+				copyKeys(exifFields, rtProfileParams, section + "/" + keyval.first, preffix + keyval.first);
+			else
+				exifFields[preffix + keyval.first] = keyval.second;
+		}
+	}	
+}
+
+// Extracts Exif fields from RawTherapee key file params
+StrMap getParamsExifFields(const IniMap& rtProfileParams)
+{
+	StrMap exifFields;
+	copyKeys(exifFields, rtProfileParams, "Common Data", "CommonData");
+	copyKeys(exifFields, rtProfileParams, "EXIF");
+	return exifFields;
+}
+
+
+// Extracts Exif fields from an image file into a map, using exiftool
+// (timedOut is set if exiftool had to be killed for not finishing within timeoutMs, see "ExifToolTimeout")
+StrMap getExifFields(const string& exiftool, const string& cachePath, const string& imageFileName, int timeoutMs, bool& timedOut)
+{
+	TraceSpan traceSpan("exiftool");
+	// output file named for the image file
+	size_t slash = imageFileName.find_last_of(SLASH_CHAR);
+	size_t dot = imageFileName.find_last_of('.');
+	if (slash == string::npos || dot == string::npos)
+		return StrMap();
+
+	// exif output file (unique, as several threads or processes may be reading the same image)
+	static std::atomic<unsigned> calls(0);
+	std::ostringstream exifOutFileName;
+	exifOutFileName << cachePath << SLASH_CHAR << string(imageFileName.begin() + slash + 1, imageFileName.begin() + dot) 
+		<< "." << Logger::processId() << "." << calls++ << ".txt";
+	string exifOutFile = exifOutFileName.str();
+
+	// uses exiftool to extract Exif values from raw file into 'FILENAME.txt' 
+	string exiftoolCmd = exiftool + " -t -m -q \"" + imageFileName + "\"";
+	RTPS_LOG(Info) << "Calling exiftool: " << exiftoolCmd << " > " << exifOutFile;
+
+	// call exiftool, redirecting output to a text file
+	timedOut = !executeProcess(exiftoolCmd, exifOutFile, true, timeoutMs);
+	if (timedOut)
+	{
+		RTPS_LOG(Warning) << "exiftool killed after " << timeoutMs << " ms: " << imageFileName;
+		remove(exifOutFile.c_str());
+		return StrMap();
+	}
+
+	// reads Exif file into map 
+	StrMap exifFields = readExifOutput(exifOutFile);
+	remove(exifOutFile.c_str());
+
+	return exifFields;
+}
+
+// Saves the keys and values to a file containing a list of "key=value" lines that cam be directly copied to a rules file
+void saveExifFields(const StrMap& exifFields, const string& imageFileName, const string& outputFile, const string& textViewer, bool showTextFile)
+{
+	remove(outputFile.c_str());
+
+	// writes fields as key=value lines
+	std::ofstream out(outputFile);
+
+	out << "Exif fields for image [" + imageFileName + "]:\n\n";
+
+	for (const auto& entry : exifFields)
+		out << entry.first << "=" << entry.second << "\n";
+	out.close();
+
+	if (showTextFile)
+		executeProcess(textViewer + " \"" + outputFile + "\"", "", false);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//
+// XMP sidecars ("UseXmpSidecars=1")
+//
+// Ingest tools and raw converters often leave a sidecar next to the image ("IMG_1234.CR2.xmp" or 
+// "IMG_1234.xmp") with a copy of its main Exif fields, which is a few KB of XML to parse instead of
+// running exiftool on the raw file. The properties known to have the same meaning as exiftool's keys
+// are mapped to them (with exiftool's formatting), and the sidecar is only used when those fields are
+// enough to select the profiles (see exifToolNeeded()): otherwise exiftool is called as usual.
+//
+// Properties are recognized by their usual prefixes (tiff:, exif:, exifEX:, aux:), as attributes of
+// rdf:Description or as elements (the first rdf:li of an array).
+//
+
+#define RTPS_XMP_MAX_DEPTH			32		// deeper elements are skipped
+
+// A span of an XML document's text
+struct XmlSpan
+{
+	const char* data;
+	size_t size;
+
+	XmlSpan() : data(nullptr), size(0) {}
+	XmlSpan(const char* data, size_t size) : data(data), size(size) {}
+	bool is(const char* name) const { return strlen(name) == size && memcmp(data, name, size) == 0; }
+	bool blank() const { return std::all_of(data, data + size, [](char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n'; }); }
+};
+
+// Tokens of an XML document, as spans of its text: nothing is copied nor allocated. Comments, 
+// processing instructions and declarations are skipped; CDATA sections are returned as text.
+class XmlTokenizer
+{
+public:
+	enum class Kind { StartTag, EndTag, Text };
+
+	struct Token
+	{
+		Kind kind;
+		XmlSpan name;			// tags
+		XmlSpan body;			// start tags: the attributes; text: the text (entities not decoded)
+		bool empty;				// start tag of an empty element ("<x/>")
+	};
+
+	XmlTokenizer(const char* begin, const char* end) : pos(begin), end(end) {}
+
+	// next token, false at the end of the document (or of its well-formed part)
+	bool next(Token& token)
+	{
+		while (pos < end)
+		{
+			if (*pos != '<')
+			{
+				const char* text = pos;
+				pos = std::find(pos, end, '<');
+				token.kind = Kind::Text;
+				token.body = XmlSpan(text, pos - text);
+				return true;
+			}
+			if (startsWith("<!--"))
+				skipPast("-->");
+			else if (startsWith("<![CDATA["))
+			{
+				const char* text = pos + 9;
+				skipPast("]]>");
+				token.kind = Kind::Text;
+				token.body = XmlSpan(text, std::max(text, pos - 3) - text);
+				return true;
+			}
+			else if (startsWith("<?"))
+				skipPast("?>");
+			else if (startsWith("<!"))
+				skipPast(">");
+			else
+				return tag(token);
+		}
+		return false;
+	}
+
+	// next attribute of a start tag's body (advancing 'attributes'), false after the last one
+	static bool nextAttribute(XmlSpan& attributes, XmlSpan& name, XmlSpan& value)
+	{
+		const char* p = attributes.data;
+		const char* last = p + attributes.size;
+		while (p < last && isSpace(*p))
+			p++;
+		const char* nameBegin = p;
+		while (p < last && *p != '=' && !isSpace(*p))
+			p++;
+		name = XmlSpan(nameBegin, p - nameBegin);
+		while (p < last && (isSpace(*p) || *p == '='))
+			p++;
+		if (name.size == 0 || p == last || (*p != '"' && *p != '\''))
+			return false;
+		const char* valueEnd = std::find(p + 1, last, *p);
+		if (valueEnd == last)
+			return false;
+		value = XmlSpan(p + 1, valueEnd - p - 1);
+		attributes = XmlSpan(valueEnd + 1, last - valueEnd - 1);
+		return true;
+	}
+
+	static bool isSpace(char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n'; }
+
+private:
+	bool startsWith(const char* prefix) const
+	{
+		size_t length = strlen(prefix);
+		return static_cast<size_t>(end - pos) >= length && memcmp(pos, prefix, length) == 0;
+	}
+
+	void skipPast(const char* terminator)
+	{
+		size_t length = strlen(terminator);
+		const char* found = std::search(pos, end, terminator, terminator + length);
+		pos = found == end ? end : found + length;
+	}
+
+	bool tag(Token& token)
+	{
+		bool endTag = pos + 1 < end && pos[1] == '/';
+		const char* p = pos + (endTag ? 2 : 1);
+		const char* nameBegin = p;
+		while (p < end && !isSpace(*p) && *p != '/' && *p != '>')
+			p++;
+		token.name = XmlSpan(nameBegin, p - nameBegin);
+
+		// attributes: up to the closing '>' (not one within a quoted value)
+		const char* bodyBegin = p;
+		char quote = 0;
+		while (p < end && (quote != 0 || *p != '>'))
+		{
+			if (quote != 0 && *p == quote)
+				quote = 0;
+			else if (quote == 0 && (*p == '"' || *p == '\''))
+				quote = *p;
+			p++;
+		}
+		if (p == end)
+		{
+			pos = end;
+			return false;
+		}
+		token.empty = !endTag && p[-1] == '/';
+		token.kind = endTag ? Kind::EndTag : Kind::StartTag;
+		token.body = XmlSpan(bodyBegin, p - bodyBegin - (token.empty ? 1 : 0));
+		pos = p + 1;
+		return token.name.size != 0;
+	}
+
+	const char* pos;
+	const char* end;
+};
+
+// Text of an XML span, with its entities decoded (UTF-8, as exiftool's output)
+string xmlText(const XmlSpan& span)
+{
+	string text;
+	text.reserve(span.size);
+	for (const char* p = span.data; p < span.data + span.size; p++)
+	{
+		const char* semicolon = *p == '&' ? std::find(p, span.data + span.size, ';') : p;
+		if (*p != '&' || semicolon == span.data + span.size)
+		{
+			text += *p;
+			continue;
+		}
+		XmlSpan entity(p + 1, semicolon - p - 1);
+		unsigned long code = 0;
+		if (entity.is("lt")) code = '<';
+		else if (entity.is("gt")) code = '>';
+		else if (entity.is("amp")) code = '&';
+		else if (entity.is("quot")) code = '"';
+		else if (entity.is("apos")) code = '\'';
+		else if (entity.size > 1 && entity.data[0] == '#')
+			code = entity.data[1] == 'x' ? strtoul(string(entity.data + 2, entity.size - 2).c_str(), nullptr, 16) : 
+				strtoul(string(entity.data + 1, entity.size - 1).c_str(), nullptr, 10);
+		if (code == 0 || code > 0x10FFFF)
+		{
+			text += *p;
+			continue;
+		}
+		if (code < 0x80)
+			text += static_cast<char>(code);
+		else if (code < 0x800)
+			text += { static_cast<char>(0xC0 | (code >> 6)), static_cast<char>(0x80 | (code & 0x3F)) };
+		else if (code < 0x10000)
+			text += { static_cast<char>(0xE0 | (code >> 12)), static_cast<char>(0x80 | ((code >> 6) & 0x3F)), static_cast<char>(0x80 | (code & 0x3F)) };
+		else
+			text += { static_cast<char>(0xF0 | (code >> 18)), static_cast<char>(0x80 | ((code >> 12) & 0x3F)), 
+				static_cast<char>(0x80 | ((code >> 6) & 0x3F)), static_cast<char>(0x80 | (code & 0x3F)) };
+		p = semicolon;
+	}
+	return text;
+}
+
+// How a value from another source is turned into exiftool's
+enum class ExifFormat { Text, FocalLength, ExposureTime, FNumber, DateTime, LensId, CameraModel };
+
+// XMP properties with the same meaning as exiftool's keys (the first one found for a key is used)
+static const struct { const char* property; const char* exiftoolKey; ExifFormat format; } xmpExifKeys[] = {
+	{ "tiff:Make",							"Make",					ExifFormat::Text },
+	{ "tiff:Model",							EXIF_CAMERA_MODEL,		ExifFormat::Text },
+	{ "exif:ISOSpeedRatings",				EXIF_ISO,				ExifFormat::Text },
+	{ "exifEX:PhotographicSensitivity",		EXIF_ISO,				ExifFormat::Text },
+	{ "exif:FocalLength",					EXIF_FOCAL_LENGTH,		ExifFormat::FocalLength },
+	{ "exif:ExposureTime",					"Exposure Time",		ExifFormat::ExposureTime },
+	{ "exif:FNumber",						"F Number",				ExifFormat::FNumber },
+	{ "exif:DateTimeOriginal",				"Date/Time Original",	ExifFormat::DateTime },
+	{ "exifEX:LensModel",					"Lens Model",			ExifFormat::Text },
+	{ "exifEX:LensModel",					EXIF_LENS_ID,			ExifFormat::LensId },
+	{ "aux:Lens",							"Lens",					ExifFormat::Text },
+	{ "aux:Lens",							EXIF_LENS_ID,			ExifFormat::LensId },
+	{ "exifEX:BodySerialNumber",			"Serial Number",		ExifFormat::Text },
+	{ "aux:SerialNumber",					"Serial Number",		ExifFormat::Text },
+};
+
+// Whether there's a lens profile for a lens name (see getLensPartialProfile())
+bool hasLensProfile(const string& basePath, const string& lens)
+{
+	return !lens.empty() && lens != "Unknown" && 
+		std::ifstream(basePath + LENS_PROFILE_DIR + SLASH_CHAR + "lens." + safeFileName(lens) + ".ini").good();
+}
+
+// Whether there's an ISO or lens profile for a camera model name (see getISOProfileIni() and getLensPartialProfile()).
+// They're named for exiftool's "Camera Model Name", so this tells a model name given by another source (RT normalizes
+// some, e.g. "EOS 5D Mark III" for exiftool's "Canon EOS 5D Mark III") is exiftool's too
+bool hasCameraProfile(const string& basePath, const string& model)
+{
+	return !model.empty() &&
+		(std::ifstream(basePath + ISO_PROFILE_DIR + SLASH_CHAR + "iso." + safeFileName(model) + ".ini").good() ||
+		 std::ifstream(basePath + LENS_PROFILE_DIR + SLASH_CHAR + "lens." + safeFileName(model) + ".ini").good());
+}
+
+// Whether a folder has profiles named "<prefix><name>.ini", other than 'except'
+bool hasProfiles(const string& folder, const string& prefix, const string& except)
+{
+	for (const string& name : listDirectory(folder))
+	{
+		if (name.compare(0, prefix.size(), prefix) == 0 && name.size() > prefix.size() + 4 && 
+			name.compare(name.size() - 4, 4, ".ini") == 0 && name != except)
+			return true;
+	}
+	return false;
+}
+
+// Rational (XMP's "120/10") or decimal value
+double rationalValue(const string& value)
+{
+	size_t slash = value.find('/');
+	if (slash == string::npos)
+		return eval(value, 0.0);
+	double denominator = eval(value.substr(slash + 1), 0.0);
+	return denominator != 0 ? eval(value.substr(0, slash), 0.0) / denominator : 0.0;
+}
+
+// A value (XMP, RT's cache data) as exiftool prints it (empty if it can't be converted)
+string exiftoolValue(const string& value, ExifFormat format, const string& basePath)
+{
+	std::ostringstream ss;
+	ss << std::setiosflags(std::ios::fixed);
+	double number = rationalValue(value);
+	switch (format)
+	{
+	case ExifFormat::Text:
+		return value;
+	case ExifFormat::FocalLength:		// "12.0 mm"
+		if (number <= 0)
+			return string();
+		ss << std::setprecision(1) << number << " mm";
+		break;
+	case ExifFormat::ExposureTime:		// "1/250", "0.5", "2"
+		if (number <= 0)
+			return string();
+		if (number < 0.25001)
+			ss << "1/" << static_cast<int>(0.5 + 1 / number);
+		else
+		{
+			ss << std::setprecision(1) << number;
+			string seconds = ss.str();
+			return seconds.compare(seconds.size() - 2, 2, ".0") == 0 ? seconds.substr(0, seconds.size() - 2) : seconds;
+		}
+		break;
+	case ExifFormat::FNumber:			// "5.6", "0.95"
+		if (number <= 0)
+			return string();
+		ss << std::setprecision(number < 1 ? 2 : 1) << number;
+		break;
+	case ExifFormat::DateTime:			// "2014:05:01 10:00:00" (from "2014-05-01T10:00:00+02:00")
+		if (value.size() < 19 || value[10] != 'T')
+			return string();
+		ss << value.substr(0, 4) << ':' << value.substr(5, 2) << ':' << value.substr(8, 2) << ' ' << value.substr(11, 8);
+		break;
+	case ExifFormat::LensId:				// exiftool's "Lens ID" is its own name for the lens, so only when there's a profile for this one
+		return hasLensProfile(basePath, value) ? value : string();
+	case ExifFormat::CameraModel:		// RT's normalized model name, so only when there's a profile for it (see hasCameraProfile())
+		return hasCameraProfile(basePath, value) ? value : string();
+	}
+	return ss.str();
+}
+
+// Sidecar of an image: "<image>.xmp" or "<image without extension>.xmp" (empty if none)
+string findXmpSidecar(const string& imageFileName)
+{
+	size_t slash = imageFileName.find_last_of("\\/");
+	size_t dot = imageFileName.find_last_of('.');
+	string stem = dot != string::npos && (slash == string::npos || dot > slash) ? imageFileName.substr(0, dot) : imageFileName;
+	long long size, changed;
+	for (const string& candidate : { imageFileName + ".xmp", imageFileName + ".XMP", stem + ".xmp", stem + ".XMP" })
+	{
+		if (fileStat(candidate, size, changed) && size > 0)
+			return candidate;
+	}
+	return string();
+}
+
+// Reads the Exif fields of an XMP sidecar, with exiftool's names and formatting
+StrMap readXmpSidecar(const string& sidecarFileName, const string& basePath)
+{
+	TraceSpan traceSpan("xmp sidecar");
+	StrMap exifFields;
+	std::ifstream file(sidecarFileName, std::ios::binary);
+	std::ostringstream contents;
+	contents << file.rdbuf();
+	const string xml = contents.str();
+
+	auto store = [&exifFields, &basePath](const XmlSpan& property, const XmlSpan& value)
+	{
+		for (const auto& key : xmpExifKeys)
+		{
+			if (property.is(key.property) && exifFields.count(key.exiftoolKey) == 0)
+			{
+				string converted = exiftoolValue(xmlText(value), key.format, basePath);
+				if (!converted.empty())
+					exifFields[key.exiftoolKey] = converted;
+			}
+		}
+	};
+
+	XmlTokenizer tokenizer(xml.data(), xml.data() + xml.size());
+	XmlTokenizer::Token token;
+	size_t depth = 0;
+	XmlSpan property;				// property element open (size 0 if none)
+	size_t propertyDepth = 0;
+	bool propertyDone = false;		// its value was found
+	while (tokenizer.next(token))
+	{
+		switch (token.kind)
+		{
+		case XmlTokenizer::Kind::StartTag:
+			if (token.name.is("rdf:Description"))
+			{
+				// simple properties as attributes
+				XmlSpan attributes = token.body, name, value;
+				while (XmlTokenizer::nextAttribute(attributes, name, value))
+					store(name, value);
+			}
+			else if (property.size == 0 && !token.empty)
+			{
+				for (const auto& key : xmpExifKeys)
+				{
+					if (token.name.is(key.property))
+					{
+						property = token.name;
+						propertyDepth = depth;
+						propertyDone = false;
+						break;
+					}
+				}
+			}
+			if (!token.empty && ++depth > RTPS_XMP_MAX_DEPTH)
+				return exifFields;
+			break;
+		case XmlTokenizer::Kind::EndTag:
+			if (depth > 0)
+				depth--;
+			if (property.size != 0 && depth == propertyDepth)
+				property = XmlSpan();
+			break;
+		case XmlTokenizer::Kind::Text:
+			// property value (or the first item of its array)
+			if (property.size != 0 && !propertyDone && !token.body.blank())
+			{
+				store(property, token.body);
+				propertyDone = true;
+			}
+			break;
+		}
+	}
+	return exifFields;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//
+// RawTherapee's cache data ("UseRTCache=1")
+//
+// Once RT has shown an image in its file browser, its cache (the keyfile's "CachePath") has a data 
+// file for it, "data/<image name>.<MD5>.txt" (MD5 of the image's path and size or, on Windows, of its
+// size, creation time and path, as RT's CacheManager names them), with the Exif fields RT shows: 
+// camera, lens, ISO, exposure, focal length and date. These are given exiftool's names and formats,
+// and used as a sidecar's are (see above): only when they are enough to select the profiles.
+//
+
+// MD5 of a string, in hexadecimal (as GLib's checksums)
+string md5Hex(const string& data)
+{
+	static const uint32_t k[64] = {
+		0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+		0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+		0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+		0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+		0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+		0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+		0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+		0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391 };
+	static const int shifts[16] = { 7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21 };
+
+	// padded message: data, 0x80, zeros, and the length in bits (little endian)
+	string message = data;
+	message += '\x80';
+	while (message.size() % 64 != 56)
+		message += '\0';
+	uint64_t bits = static_cast<uint64_t>(data.size()) * 8;
+	for (int i = 0; i < 8; i++)
+		message += static_cast<char>((bits >> (8 * i)) & 0xFF);
+
+	uint32_t state[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+	for (size_t block = 0; block < message.size(); block += 64)
+	{
+		uint32_t w[16];
+		for (int i = 0; i < 16; i++)
+		{
+			const unsigned char* p = reinterpret_cast<const unsigned char*>(message.data() + block + i * 4);
+			w[i] = p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+		}
+		uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+		for (int i = 0; i < 64; i++)
+		{
+			uint32_t f;
+			int g;
+			if (i < 16)			{ f = (b & c) | (~b & d);	g = i; }
+			else if (i < 32)	{ f = (d & b) | (~d & c);	g = (5 * i + 1) % 16; }
+			else if (i < 48)	{ f = b ^ c ^ d;			g = (3 * i + 5) % 16; }
+			else				{ f = c ^ (b | ~d);			g = (7 * i) % 16; }
+			uint32_t rotated = a + f + k[i] + w[g];
+			int shift = shifts[(i / 16) * 4 + i % 4];
+			a = d;
+			d = c;
+			c = b;
+			b += (rotated << shift) | (rotated >> (32 - shift));
+		}
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+	}
+
+	std::ostringstream hex;
+	hex << std::hex << std::setfill('0');
+	for (uint32_t word : state)
+		for (int i = 0; i < 4; i++)
+			hex << std::setw(2) << ((word >> (8 * i)) & 0xFF);
+	return hex.str();
+}
+
+// RT's cache data file for an image (empty if the image can't be found)
+string rtCacheDataPath(const string& cachePath, const string& imageFileName)
+{
+	std::ostringstream identifier;
+#ifdef _WIN32
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+	if (!GetFileAttributesExA(imageFileName.c_str(), GetFileExInfoStandard, &attributes))
+		return string();
+	identifier << attributes.nFileSizeLow << '-' << attributes.ftCreationTime.dwHighDateTime << '-' 
+		<< attributes.ftCreationTime.dwLowDateTime << '-' << imageFileName;
+#else
+	long long size, changed;
+	if (!fileStat(imageFileName, size, changed))
+		return string();
+	identifier << imageFileName << size;
+#endif
+	size_t slash = imageFileName.find_last_of("\\/");
+	return cachePath + SLASH_CHAR + "data" + SLASH_CHAR + imageFileName.substr(slash == string::npos ? 0 : slash + 1) + 
+		"." + md5Hex(identifier.str()) + ".txt";
+}
+
+// RT's cache data keys with the same meaning as exiftool's
+// note: RT normalizes the make and model (e.g. "Nikon" and "D800" where exiftool has "NIKON CORPORATION" and "NIKON D800"),
+// so the make is left out and the model only kept when it's exiftool's too
+static const struct { const char* key; const char* exiftoolKey; ExifFormat format; } rtCacheExifKeys[] = {
+	{ "CameraModel",	EXIF_CAMERA_MODEL,		ExifFormat::CameraModel },
+	{ "ISO",			EXIF_ISO,				ExifFormat::Text },
+	{ "FocalLen",		EXIF_FOCAL_LENGTH,		ExifFormat::FocalLength },
+	{ "Shutter",		"Exposure Time",		ExifFormat::ExposureTime },
+	{ "FNumber",		"F Number",				ExifFormat::FNumber },
+	{ "Lens",			EXIF_LENS_ID,			ExifFormat::LensId },
+};
+
+// Reads the Exif fields of an image from RT's cache data, with exiftool's names and formatting (empty if
+// RT has no valid data for the image)
+StrMap readRTCacheExifFields(const string& cachePath, const string& imageFileName, const string& basePath)
+{
+	TraceSpan traceSpan("rt cache");
+	StrMap exifFields;
+	string path = rtCacheDataPath(cachePath, imageFileName);
+	if (path.empty())
+		return exifFields;
+	std::ifstream file(path, std::ios::binary);
+	if (!file)
+		return exifFields;
+	std::ostringstream contents;
+	contents << file.rdbuf();
+	const string text = contents.str();
+
+	// the [ExifInfo] and [DateTime] keys, as spans of the text (a GLib keyfile, in which these values have no escapes)
+	std::map<string, XmlSpan> exifInfo;
+	int dateTime[6] = { -1, -1, -1, -1, -1, -1 };
+	static const char* dateTimeKeys[6] = { "Year", "Month", "Day", "Hour", "Min", "Sec" };
+	XmlSpan section;
+	for (const char* line = text.data(); line < text.data() + text.size(); )
+	{
+		const char* end = std::find(line, text.data() + text.size(), '\n');
+		const char* last = end > line && end[-1] == '\r' ? end - 1 : end;
+		const char* equal = std::find(line, last, '=');
+		if (line < last && *line == '[')
+			section = XmlSpan(line + 1, std::max(line + 1, last - 1) - line - 1);
+		else if (equal != last && section.is("ExifInfo"))
+			exifInfo[string(line, equal)] = XmlSpan(equal + 1, last - equal - 1);
+		else if (equal != last && section.is("DateTime"))
+		{
+			for (int i = 0; i < 6; i++)
+			{
+				if (XmlSpan(line, equal - line).is(dateTimeKeys[i]))
+					dateTime[i] = atoi(string(equal + 1, last).c_str());
+			}
+		}
+		line = end + 1;
+	}
+	auto valid = exifInfo.find("Valid");
+	if (valid == exifInfo.end() || !valid->second.is("true"))
+		return exifFields;
+
+	for (const auto& key : rtCacheExifKeys)
+	{
+		auto value = exifInfo.find(key.key);
+		if (value != exifInfo.end() && value->second.size != 0 && !value->second.is("0"))
+		{
+			string converted = exiftoolValue(string(value->second.data, value->second.size), key.format, basePath);
+			if (!converted.empty())
+				exifFields[key.exiftoolKey] = converted;
+		}
+	}
+	if (*std::min_element(dateTime, dateTime + 6) >= 0 && dateTime[0] != 0)
+	{
+		std::ostringstream date;
+		date << std::setfill('0') << std::setw(4) << dateTime[0] << ':' << std::setw(2) << dateTime[1] << ':' << std::setw(2) << dateTime[2] 
+			<< ' ' << std::setw(2) << dateTime[3] << ':' << std::setw(2) << dateTime[4] << ':' << std::setw(2) << dateTime[5];
+		exifFields["Date/Time Original"] = date.str();
+	}
+	return exifFields;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Metadata cache and folder prefetch
+//
+// When RT browses a folder it calls RTProfileSelector once for each image, and each call runs its 
+// own exiftool. With "Prefetch=1", a call that finds no cached metadata for its image starts a 
+// detached worker ("RTProfileSelector --prefetch <image> <cache path>") which extracts the Exif 
+// fields of the sibling raw files, many files per exiftool call, into a cache under RT's CachePath: 
+// one file per image, named for a hash of its path and validated against its size and time stamp.
+// The calls that follow for those siblings read the cache instead of running exiftool.
+//
+// The worker runs at a lower priority and pauses between exiftool calls, and stops after the current 
+// call on SIGINT/SIGTERM or when its lock file ("<folder hash>.lock" in the cache) is deleted.
+//
+
+// Prefetch options from RTProfileSelector.ini
+struct PrefetchSettings
+{
+	bool enabled;
+	string exiftool;
+	string cacheDir;		// <CachePath>/RTProfileSelector
+	size_t batchSize;		// files per exiftool call
+	int pauseMs;			// pause between exiftool calls
+	size_t maxFiles;		// files extracted per folder, at most
+	int timeoutMs;			// exiftool deadline per file ("ExifToolTimeout")
+	StrSet extensions;		// lower case, without the dot
+};
+
+// Extensions of the raw files to prefetch or process in library mode ("PrefetchExtensions"), lower case, without the dot
+StrSet readRawExtensions(const IniMap& rtSelectorIni)
+{
+	string extensions = getIniValue(rtSelectorIni, RTPS_INI_SECTION_GENERAL, "PrefetchExtensions");
+	if (extensions.empty())
+		extensions = RTPS_PREFETCH_EXTENSIONS;
+
+	StrSet extensionSet;
+	std::istringstream list(extensions);
+	string ext;
+	while (std::getline(list, ext, ','))
+	{
+		ext = trimLeft(ext);
+		ext.erase(ext.find_last_not_of("\t ") + 1);
+		if (!ext.empty() && ext[0] == '.')
+			ext.erase(0, 1);
+		std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+		if (!ext.empty())
+			extensionSet.insert(ext);
+	}
+	return extensionSet;
+}
+
+// Whether a file name has one of the extensions
+bool hasExtension(const string& fileName, const StrSet& extensions)
+{
+	size_t dot = fileName.find_last_of('.');
+	if (dot == string::npos)
+		return false;
+	string ext = fileName.substr(dot + 1);
+	std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+	return extensions.count(ext) != 0;
+}
+
+PrefetchSettings readPrefetchSettings(const IniMap& rtSelectorIni, const string& cachePath)
+{
+	auto general = [&rtSelectorIni](const char* key) -> const string& { return getIniValue(rtSelectorIni, RTPS_INI_SECTION_GENERAL, key); };
+
+	PrefetchSettings settings;
+	settings.enabled = general("Prefetch") == "1" && general("UseExifTool") != "0" && !cachePath.empty();
+	settings.exiftool = general("ExifTool");
+	if (settings.exiftool.empty())
+		settings.exiftool = DEFAULT_EXIFTOOL_CMD;
+	settings.cacheDir = cachePath + SLASH_CHAR + RTPS_METADATA_CACHE_DIR;
+	settings.batchSize = static_cast<size_t>(std::max(1.0, eval(general("PrefetchBatchSize"), 20)));
+	settings.pauseMs = static_cast<int>(std::max(0.0, eval(general("PrefetchPause"), 250)));
+	settings.maxFiles = static_cast<size_t>(std::max(0.0, eval(general("PrefetchMaxFiles"), 500)));
+	settings.timeoutMs = static_cast<int>(std::max(0.0, eval(general("ExifToolTimeout"), RTPS_EXIFTOOL_TIMEOUT)));
+	settings.extensions = readRawExtensions(rtSelectorIni);
+	return settings;
+}
+
+// Cache file for an image's metadata
+inline string cacheEntryPath(const PrefetchSettings& settings, const string& imageFileName)
+{
+	return settings.cacheDir + SLASH_CHAR + hashString(imageFileName) + ".exif";
+}
+
+// Cache file prefix for a folder's prefetch state (".lock" while the worker runs, ".done" afterwards)
+inline string folderMarkerPath(const PrefetchSettings& settings, const string& folder)
+{
+	return settings.cacheDir + SLASH_CHAR + hashString(folder);
+}
+
+// First line of a cache file: the image it belongs to and the size and time stamp it had when extracted
+string cacheEntryHeader(const string& imageFileName)
+{
+	long long size, changed;
+	if (!fileStat(imageFileName, size, changed))
+		return string();
+	std::ostringstream header;
+	header << RTPS_METADATA_CACHE_HEADER << '\t' << size << '\t' << changed << '\t' << imageFileName;
+	return header.str();
+}
+
+// Reads an image's Exif fields from the metadata cache (empty if not cached, or if the image changed since)
+StrMap readCachedExifFields(const PrefetchSettings& settings, const string& imageFileName)
+{
+	TraceSpan traceSpan("exif cache");
+	StrMap exifFields;
+	std::ifstream file(cacheEntryPath(settings, imageFileName));
+	string line;
+	if (!std::getline(file, line) || line != cacheEntryHeader(imageFileName))
+		return exifFields;
+
+	while (std::getline(file, line))
+	{
+		StrPair keyVal;
+		if (parseExifLine(line, keyVal))
+			exifFields.insert(keyVal);
+	}
+	return exifFields;
+}
+
+// Whether the cache has a valid entry for an image, without reading it all
+bool isExifCached(const PrefetchSettings& settings, const string& imageFileName)
+{
+	std::ifstream file(cacheEntryPath(settings, imageFileName));
+	string line;
+	return std::getline(file, line) && line == cacheEntryHeader(imageFileName);
+}
+
+// Writes the "exiftool -t" output lines for an image to the metadata cache (replacing the entry at once,
+// so that readers never see a partial file)
+void writeCachedExifFields(const PrefetchSettings& settings, const string& imageFileName, const std::vector<string>& lines)
+{
+	string header = cacheEntryHeader(imageFileName);
+	if (header.empty() || lines.empty())
+		return;
+
+	string entryPath = cacheEntryPath(settings, imageFileName);
+	string tempPath = entryPath + ".tmp";
+	{
+		std::ofstream out(tempPath);
+		out << header << "\n";
+		for (const auto& line : lines)
+			out << line << "\n";
+		if (!out.good())
+		{
+			out.close();
+			remove(tempPath.c_str());
+			return;
+		}
+	}
+	if (!replaceFile(tempPath, entryPath))
+		remove(tempPath.c_str());
+}
+
+// Splits the output of a multi-file "exiftool -t" call into the lines for each file, by file name.
+// exiftool separates files with "======== <path>" lines; without those, each file starts at its 
+// "ExifTool Version Number" line and is named by its "File Name" tag
+std::map<string, std::vector<string>> splitExifBatchOutput(const string& path)
+{
+	std::vector<std::pair<string, std::vector<string>>> files;
+	bool separators = false;
+	string line;
+	std::ifstream batchFile(path);
+
+	while (std::getline(batchFile, line))
+	{
+		if (line.compare(0, 9, "======== ") == 0)
+		{
+			string fileName = line.substr(9);
+			size_t slash = fileName.find_last_of("/\\");
+			if (slash != string::npos)
+				fileName.erase(0, slash + 1);
+			files.push_back(std::make_pair(fileName, std::vector<string>()));
+			separators = true;
+			continue;
+		}
+
+		StrPair keyVal;
+		if (!parseExifLine(line, keyVal))
+			continue;
+		if (!separators && keyVal.first == "ExifTool Version Number")
+			files.push_back(std::make_pair(string(), std::vector<string>()));
+		if (files.empty())
+			continue;
+		if (files.back().first.empty() && keyVal.first == "File Name")
+			files.back().first = keyVal.second;
+		files.back().second.push_back(line);
+	}
+
+	std::map<string, std::vector<string>> byName;
+	for (auto& file : files)
+		if (!file.first.empty())
+			byName[file.first].swap(file.second);
+	return byName;
+}
+
+// Starts the prefetch worker for an image's folder, unless it's already running or the folder was 
+// prefetched after the image appeared (in which case exiftool can't read it, or it isn't a raw file)
+void startFolderPrefetch(const PrefetchSettings& settings, const string& selfPath, const string& cachePath, const string& imageFileName)
+{
+	size_t slash = imageFileName.find_last_of(SLASH_CHAR);
+	if (slash == string::npos)
+		return;
+	string marker = folderMarkerPath(settings, imageFileName.substr(0, slash));
+
+	long long size, markerTime, imageTime;
+	if (fileStat(marker + ".lock", size, markerTime) && time(nullptr) - markerTime < RTPS_PREFETCH_LOCK_TIMEOUT)
+		return;
+	if (fileStat(marker + ".done", size, markerTime) && fileStat(imageFileName, size, imageTime) && imageTime <= markerTime)
+		return;
+
+	RTPS_LOG(Info) << "Starting metadata prefetch for folder: " << imageFileName.substr(0, slash);
+	string error;
+	if (!startDetachedProcess({ selfPath, "--prefetch", imageFileName, cachePath }, error))
+		RTPS_LOG(Warning) << "Can't start the metadata prefetch worker: " << error;
+}
+
+// set by SIGINT/SIGTERM in the prefetch worker
+volatile std::sig_atomic_t prefetchStopRequested = 0;
+
+extern "C" void onPrefetchStopSignal(int)
+{
+	prefetchStopRequested = 1;
+}
+
+// Whether the prefetch worker should stop: asked to by a signal, or its lock file was deleted
+inline bool prefetchStopped(const string& lockPath)
+{
+	std::ifstream lock(lockPath);
+	return prefetchStopRequested != 0 || !lock.good();
+}
+
+// The prefetch worker: extracts the Exif fields of the raw files in the image's folder that aren't 
+// cached yet (but the image itself, which the calling instance is extracting), batchSize files per 
+// exiftool call, pausing between calls
+int prefetchFolder(const PrefetchSettings& settings, const string& imageFileName)
+{
+	size_t slash = imageFileName.find_last_of(SLASH_CHAR);
+	if (slash == string::npos || !makeDirectory(settings.cacheDir))
+		return 1;
+	string folder = imageFileName.substr(0, slash);
+	string marker = folderMarkerPath(settings, folder);
+	string lockPath = marker + ".lock";
+
+	// a single worker per folder: the lock file is created exclusively, and replaced if stale
+	FILE* lock = fopen(lockPath.c_str(), "wx");
+	long long size, lockTime;
+	if (lock == nullptr && fileStat(lockPath, size, lockTime) && time(nullptr) - lockTime >= RTPS_PREFETCH_LOCK_TIMEOUT)
+	{
+		remove(lockPath.c_str());
+		lock = fopen(lockPath.c_str(), "wx");
+	}
+	if (lock == nullptr)
+	{
+		RTPS_LOG(Debug) << "Metadata prefetch already running for folder: " << folder;
+		return 0;
+	}
+	fprintf(lock, "%s\n", folder.c_str());
+	fclose(lock);
+
+	std::signal(SIGINT, onPrefetchStopSignal);
+	std::signal(SIGTERM, onPrefetchStopSignal);
+
+	// stay out of the way of RT and of the instances serving it
+#ifdef _WIN32
+	SetPriorityClass(GetCurrentProcess(), BELOW_NORMAL_PRIORITY_CLASS);
+#else
+	nice(10);
+#endif
+
+	// sibling raw files not cached yet
+	std::vector<string> pending;
+	for (const auto& name : listDirectory(folder))
+	{
+		string path = folder + SLASH_CHAR + name;
+		if (hasExtension(name, settings.extensions) && path != imageFileName && !isExifCached(settings, path))
+			pending.push_back(path);
+		if (pending.size() >= settings.maxFiles)
+			break;
+	}
+	RTPS_LOG(Info) << "Metadata prefetch: " << pending.size() << " file(s) to extract in " << folder;
+
+	string batchOutput = marker + ".out";
+	size_t extracted = 0;
+	bool stopped = false;
+	for (size_t first = 0; first < pending.size(); first += settings.batchSize)
+	{
+		if ((stopped = prefetchStopped(lockPath)))
+			break;
+
+		size_t last = std::min(pending.size(), first + settings.batchSize);
+		string exiftoolCmd = settings.exiftool + " -t -m -q";
+		for (size_t i = first; i < last; i++)
+			exiftoolCmd += " \"" + pending[i] + "\"";
+
+		remove(batchOutput.c_str());		// redirection appends on Windows
+		if (!executeProcess(exiftoolCmd, batchOutput, true, settings.timeoutMs * static_cast<int>(last - first)))
+		{
+			// the output of the batch may be truncated anywhere: keep none of it
+			RTPS_LOG(Warning) << "Metadata prefetch: exiftool killed after " << settings.timeoutMs * (last - first) << " ms";
+			remove(batchOutput.c_str());
+			continue;
+		}
+
+		auto files = splitExifBatchOutput(batchOutput);
+		for (size_t i = first; i < last; i++)
+		{
+			auto file = files.find(pending[i].substr(slash + 1));
+			if (file != files.end())
+			{
+				writeCachedExifFields(settings, pending[i], file->second);
+				extracted++;
+			}
+		}
+		remove(batchOutput.c_str());
+
+		// rate limit: pause before the next call, waking up regularly to check for a stop request
+		if (last < pending.size())
+			for (int waited = 0; waited < settings.pauseMs && !prefetchStopped(lockPath); waited += 50)
+				std::this_thread::sleep_for(std::chrono::milliseconds(std::min(50, settings.pauseMs - waited)));
+	}
+
+	remove(lockPath.c_str());
+	if (stopped)
+		RTPS_LOG(Info) << "Metadata prefetch stopped: " << extracted << " of " << pending.size() << " file(s) extracted in " << folder;
+	else
+	{
+		std::ofstream done(marker + ".done");
+		done << folder << "\n";
+		RTPS_LOG(Info) << "Metadata prefetch done: " << extracted << " of " << pending.size() << " file(s) extracted in " << folder;
+	}
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Regular expressions for rule values ("re:" operator, see matchValue() below)
+//
+// A small regex engine for matching many patterns against short Exif values in linear time:
+// patterns are parsed into a Thompson NFA, and all patterns used with the same Exif key are 
+// combined into a single DFA, built once when the rules are loaded. Scanning a value is then
+// one table lookup per byte, and the final DFA state tells which patterns matched. Should a 
+// set of patterns explode into too many DFA states, the NFA is simulated instead (still 
+// linear in the value length).
+//
+// Supported syntax: literals, '.', [classes] (with ranges and '^' negation), \d \w \s \D \W \S, 
+// escaped characters, (groups), alternation '|', quantifiers * + ? {n} {n,} {n,m} and a 
+// leading "(?i)" for case-insensitive matching. Like plain rule values, a pattern must match 
+// the whole Exif value (use ".*" for "contains"): '^' and '$' are accepted at the ends of the 
+// pattern, but are redundant.
+//
+
+typedef std::bitset<256> ByteSet;
+
+// Regex syntax tree node (stored in a vector, children referenced by index)
+struct RegexNode
+{
+	enum Type { Bytes, Concat, Alternate, Repeat };
+
+	Type type;
+	ByteSet bytes;					// Bytes: set of matching bytes
+	std::vector<int> children;		// Concat, Alternate, Repeat (single child)
+	int min, max;					// Repeat: bounds (max < 0 => unbounded)
+
+	explicit RegexNode(Type type) : type(type), min(0), max(0) {}
+};
+
+// Recursive descent parser turning a pattern into a syntax tree
+class RegexParser
+{
+public:
+	explicit RegexParser(const string& pattern) : pattern(pattern), pos(0), ignoreCase(false) {}
+
+	// returns the root node index, or -1 if the pattern is invalid (see error)
+	int parse()
+	{
+		if (pattern.compare(0, 4, "(?i)") == 0)
+		{
+			ignoreCase = true;
+			pos = 4;
+		}
+		if (pos < pattern.size() && pattern[pos] == '^')
+			++pos;
+		int root = parseAlternate();
+		if (root >= 0 && pos < pattern.size())
+			return fail("unexpected ')'");
+		return root;
+	}
+
+	std::vector<RegexNode> nodes;
+	string error;
+
+private:
+	static const int MAX_REPEAT = 255;
+
+	int fail(const string& message)
+	{
+		if (error.empty())
+			error = message + " at position " + std::to_string(pos);
+		return -1;
+	}
+
+	int newNode(RegexNode::Type type)
+	{
+		nodes.push_back(RegexNode(type));
+		return static_cast<int>(nodes.size() - 1);
+	}
+
+	void addByte(ByteSet& bytes, unsigned char c)
+	{
+		bytes.set(c);
+		if (ignoreCase && isalpha(c))
+		{
+			bytes.set(static_cast<unsigned char>(tolower(c)));
+			bytes.set(static_cast<unsigned char>(toupper(c)));
+		}
+	}
+
+	// \d, \w, \s and their negations; returns false if 'c' is not a class escape
+	static bool classEscape(char c, ByteSet& bytes)
+	{
+		ByteSet cls;
+		switch (tolower(c))
+		{
+		case 'd':
+			for (int i = '0'; i <= '9'; ++i)
+				cls.set(i);
+			break;
+		case 'w':
+			for (int i = 0; i < 256; ++i)
+				if (isalnum(i) || i == '_')
+					cls.set(i);
+			break;
+		case 's':
+			for (const char* s = " \t\r\n\f\v"; *s; ++s)
+				cls.set(static_cast<unsigned char>(*s));
+			break;
+		default:
+			return false;
+		}
+		bytes |= isupper(c) ? ~cls : cls;
+		return true;
+	}
+
+	// escaped literal (\t, \n, or the character itself)
+	static unsigned char escapedChar(char c)
+	{
+		switch (c)
+		{
+		case 't': return '\t';
+		case 'n': return '\n';
+		case 'r': return '\r';
+		default:  return static_cast<unsigned char>(c);
+		}
+	}
+
+	int parseAlternate()
+	{
+		int first = parseConcat();
+		if (first < 0 || pos >= pattern.size() || pattern[pos] != '|')
+			return first;
+
+		int alt = newNode(RegexNode::Alternate);
+		nodes[alt].children.push_back(first);
+		while (pos < pattern.size() && pattern[pos] == '|')
+		{
+			++pos;
+			int next = parseConcat();
+			if (next < 0)
+				return -1;
+			nodes[alt].children.push_back(next);
+		}
+		return alt;
+	}
+
+	int parseConcat()
+	{
+		int concat = newNode(RegexNode::Concat);
+		while (pos < pattern.size() && pattern[pos] != '|' && pattern[pos] != ')')
+		{
+			// trailing '$' anchor (redundant with whole-value matching)
+			if (pattern[pos] == '$' && (pos + 1 == pattern.size() || pattern[pos + 1] == '|' || pattern[pos + 1] == ')'))
+			{
+				++pos;
+				continue;
+			}
+			int item = parseRepeat();
+			if (item < 0)
+				return -1;
+			nodes[concat].children.push_back(item);
+		}
+		return concat;
+	}
+
+	int parseRepeat()
+	{
+		int atom = parseAtom();
+		while (atom >= 0 && pos < pattern.size())
+		{
+			int min, max;
+			char c = pattern[pos];
+			if (c == '*')
+				min = 0, max = -1;
+			else if (c == '+')
+				min = 1, max = -1;
+			else if (c == '?')
+				min = 0, max = 1;
+			else if (c == '{')
+			{
+				if (!parseBounds(min, max))		// leaves pos after '}'
+					return -1;
+			}
+			else
+				break;
+			if (c != '{')
+				++pos;
+			// lazy/possessive suffixes make no difference when matching the whole value
+			if (pos < pattern.size() && (pattern[pos] == '?' || pattern[pos] == '+') && c != '?')
+				++pos;
+
+			int repeat = newNode(RegexNode::Repeat);
+			nodes[repeat].children.push_back(atom);
+			nodes[repeat].min = min;
+			nodes[repeat].max = max;
+			atom = repeat;
+		}
+		return atom;
+	}
+
+	// {n}, {n,} or {n,m}
+	bool parseBounds(int& min, int& max)
+	{
+		size_t close = pattern.find('}', pos);
+		if (close == string::npos)
+		{
+			fail("missing '}'");
+			return false;
+		}
+		string bounds = pattern.substr(pos + 1, close - pos - 1);
+		size_t comma = bounds.find(',');
+		string minStr = bounds.substr(0, comma);
+		string maxStr = comma == string::npos ? minStr : bounds.substr(comma + 1);
+		// at most 3 digits: longer bounds exceed MAX_REPEAT anyway, and could overflow std::stoi
+		if (minStr.empty() || minStr.size() > 3 || maxStr.size() > 3 || 
+			minStr.find_first_not_of("0123456789") != string::npos ||
+			maxStr.find_first_not_of("0123456789") != string::npos)
+		{
+			fail("invalid repeat bounds");
+			return false;
+		}
+		min = std::stoi(minStr);
+		max = maxStr.empty() ? -1 : std::stoi(maxStr);
+		if (min > MAX_REPEAT || max > MAX_REPEAT || (max >= 0 && max < min))
+		{
+			fail("invalid repeat bounds");
+			return false;
+		}
+		pos = close + 1;
+		return true;
+	}
+
+	int parseAtom()
+	{
+		char c = pattern[pos++];
+		int node;
+		switch (c)
+		{
+		case '(':
+			if (pattern.compare(pos, 2, "?:") == 0)
+				pos += 2;
+			node = parseAlternate();
+			if (node < 0)
+				return -1;
+			if (pos >= pattern.size() || pattern[pos] != ')')
+				return fail("missing ')'");
+			++pos;
+			return node;
+		case '[':
+			return parseClass();
+		case '.':
+			node = newNode(RegexNode::Bytes);
+			nodes[node].bytes.set();
+			return node;
+		case '*': case '+': case '?': case '{':
+			--pos;
+			return fail("nothing to repeat");
+		case '\\':
+			if (pos >= pattern.size())
+				return fail("trailing '\\'");
+			c = pattern[pos++];
+			node = newNode(RegexNode::Bytes);
+			if (!classEscape(c, nodes[node].bytes))
+				addByte(nodes[node].bytes, escapedChar(c));
+			return node;
+		default:
+			node = newNode(RegexNode::Bytes);
+			addByte(nodes[node].bytes, static_cast<unsigned char>(c));
+			return node;
+		}
+	}
+
+	int parseClass()
+	{
+		ByteSet bytes;
+		bool negate = pos < pattern.size() && pattern[pos] == '^';
+		if (negate)
+			++pos;
+		bool first = true;
+		while (pos < pattern.size() && (pattern[pos] != ']' || first))
+		{
+			first = false;
+			unsigned char lo = static_cast<unsigned char>(pattern[pos++]);
+			if (lo == '\\' && pos < pattern.size())
+			{
+				char c = pattern[pos++];
+				if (classEscape(c, bytes))
+					continue;
+				lo = escapedChar(c);
+			}
+			unsigned char hi = lo;
+			if (pos + 1 < pattern.size() && pattern[pos] == '-' && pattern[pos + 1] != ']')
+			{
+				hi = static_cast<unsigned char>(pattern[pos + 1]);
+				pos += 2;
+				if (hi == '\\' && pos < pattern.size())
+					hi = escapedChar(pattern[pos++]);
+				if (hi < lo)
+					return fail("invalid class range");
+			}
+			for (int i = lo; i <= hi; ++i)
+				addByte(bytes, static_cast<unsigned char>(i));
+		}
+		if (pos >= pattern.size())
+			return fail("missing ']'");
+		++pos;
+
+		int node = newNode(RegexNode::Bytes);
+		nodes[node].bytes = negate ? ~bytes : bytes;
+		return node;
+	}
+
+	const string& pattern;
+	size_t pos;
+	bool ignoreCase;
+};
+
+// Set of patterns compiled together into one automaton: a single scan of a value reports 
+// every pattern matching it
+class MultiRegex
+{
+public:
+	MultiRegex() : patternCount(0), classCount(0), useDfa(false) {}
+
+	// adds a pattern to the set, returning its id (or -1 and an error message if the pattern is invalid)
+	int add(const string& pattern, string& error)
+	{
+		RegexParser parser(pattern);
+		int root = parser.parse();
+		if (root < 0)
+		{
+			error = parser.error;
+			return -1;
+		}
+		if (nfaSize(parser.nodes, root) > MAX_NFA_STATES)
+		{	// nested bounded repeats multiply: reject before expanding them
+			error = "pattern too large";
+			return -1;
+		}
+		int id = patternCount++;
+		int match = newState(NfaState::Match);
+		states[match].pattern = id;
+		starts.push_back(compile(parser.nodes, root, match));
+		return id;
+	}
+
+	// builds the DFA, once all patterns have been added
+	void build()
+	{
+		dfaStates.clear();
+		transitions.clear();
+		accepts.clear();
+		if (patternCount == 0)
+			return;
+
+		buildByteClasses();
+
+		std::map<std::vector<int>, int> dfaIndex;
+		std::vector<int> dead;
+		dfaIndex[dead] = 0;							// state 0: no pattern can match any more
+		dfaStates.push_back(dead);
+		std::vector<int> start = closure(starts);
+		dfaIndex[start] = 1;						// state 1: start state
+		dfaStates.push_back(start);
+
+		useDfa = true;
+		for (size_t s = 0; s < dfaStates.size(); ++s)
+		{
+			if (dfaStates.size() > MAX_DFA_STATES)
+			{
+				useDfa = false;		// too many states: fall back to NFA simulation
+				dfaStates.clear();
+				transitions.clear();
+				accepts.clear();
+				return;
+			}
+			accepts.push_back(acceptedPatterns(dfaStates[s]));
+			for (int cls = 0; cls < classCount; ++cls)
+			{
+				std::vector<int> next = step(dfaStates[s], classBytes[cls]);
+				auto found = dfaIndex.find(next);
+				int target;
+				if (found != dfaIndex.end())
+					target = found->second;
+				else
+				{
+					target = static_cast<int>(dfaStates.size());
+					dfaIndex[next] = target;
+					dfaStates.push_back(next);
+				}
+				transitions.push_back(target);
+			}
+		}
+		dfaStates.clear();		// only needed while building
+	}
+
+	// appends the ids of all patterns matching the whole value to 'matches'
+	void scan(const string& value, std::vector<int>& matches) const
+	{
+		if (patternCount == 0)
+			return;
+		if (useDfa)
+		{
+			int state = 1;
+			for (unsigned char c : value)
+			{
+				state = transitions[state * classCount + byteClass[c]];
+				if (state == 0)
+					return;
+			}
+			matches.insert(matches.end(), accepts[state].begin(), accepts[state].end());
+		}
+		else
+		{
+			std::vector<int> current = closure(starts);
+			for (unsigned char c : value)
+			{
+				current = step(current, c);
+				if (current.empty())
+					return;
+			}
+			std::vector<int> accepted = acceptedPatterns(current);
+			matches.insert(matches.end(), accepted.begin(), accepted.end());
+		}
+	}
+
+	int size() const { return patternCount; }
+
+private:
+	static const size_t MAX_DFA_STATES = 4096;
+	static const size_t MAX_NFA_STATES = 65536;		// per pattern, after expanding bounded repeats
+
+	struct NfaState
+	{
+		enum Type { Byte, Split, Match };
+		Type type;
+		ByteSet bytes;		// Byte: bytes accepted to go to 'out'
+		int out, out1;		// Byte: out; Split: epsilon transitions to both
+		int pattern;		// Match: pattern id
+
+		explicit NfaState(Type type) : type(type), out(-1), out1(-1), pattern(-1) {}
+	};
+
+	int newState(NfaState::Type type)
+	{
+		states.push_back(NfaState(type));
+		return static_cast<int>(states.size() - 1);
+	}
+
+	// number of NFA states compile() creates for a syntax tree node (saturating just above MAX_NFA_STATES)
+	static size_t nfaSize(const std::vector<RegexNode>& nodes, int node)
+	{
+		const size_t limit = MAX_NFA_STATES + 1;
+		const RegexNode& n = nodes[node];
+		size_t size = 0;
+		switch (n.type)
+		{
+		case RegexNode::Bytes:
+			return 1;
+		case RegexNode::Concat:
+		case RegexNode::Alternate:
+			for (int child : n.children)
+				size = std::min(limit, size + nfaSize(nodes, child));
+			if (n.type == RegexNode::Alternate)
+				size = std::min(limit, size + n.children.size() - 1);		// split states
+			return size;
+		case RegexNode::Repeat:
+		default:
+		{
+			size_t child = nfaSize(nodes, n.children[0]);
+			size_t copies = n.max < 0 ? n.min + 1 : n.max;
+			size_t splits = n.max < 0 ? 1 : n.max - n.min;
+			if (child >= limit || copies * child >= limit)
+				return limit;
+			return std::min(limit, copies * child + splits);
+		}
+		}
+	}
+
+	// builds the NFA for a syntax tree node, continuing to 'next' when the node is matched; returns the entry state
+	int compile(const std::vector<RegexNode>& nodes, int node, int next)
+	{
+		const RegexNode& n = nodes[node];
+		switch (n.type)
+		{
+		case RegexNode::Bytes:
+		{
+			int s = newState(NfaState::Byte);
+			states[s].bytes = n.bytes;
+			states[s].out = next;
+			return s;
+		}
+		case RegexNode::Concat:
+			for (auto child = n.children.rbegin(); child != n.children.rend(); ++child)
+				next = compile(nodes, *child, next);
+			return next;
+		case RegexNode::Alternate:
+		{
+			int entry = compile(nodes, n.children.back(), next);
+			for (auto child = n.children.rbegin() + 1; child != n.children.rend(); ++child)
+			{
+				int branch = compile(nodes, *child, next);
+				int s = newState(NfaState::Split);
+				states[s].out = branch;
+				states[s].out1 = entry;
+				entry = s;
+			}
+			return entry;
+		}
+		case RegexNode::Repeat:
+		default:
+		{
+			int tail = next;
+			if (n.max < 0)
+			{	// unbounded: loop state either repeats the child or leaves
+				// (note: compile() grows 'states', so never assign its result directly into an element)
+				int loop = newState(NfaState::Split);
+				states[loop].out1 = next;
+				int body = compile(nodes, n.children[0], loop);
+				states[loop].out = body;
+				tail = loop;
+			}
+			else
+			{	// optional copies: x{0,k} = (x(x(x)?)?)?
+				for (int i = n.min; i < n.max; ++i)
+				{
+					int body = compile(nodes, n.children[0], tail);
+					int s = newState(NfaState::Split);
+					states[s].out = body;
+					states[s].out1 = next;
+					tail = s;
+				}
+			}
+			for (int i = 0; i < n.min; ++i)
+				tail = compile(nodes, n.children[0], tail);
+			return tail;
+		}
+		}
+	}
+
+	// epsilon closure: sorted list of the Byte and Match states reachable from 'from'
+	std::vector<int> closure(const std::vector<int>& from) const
+	{
+		std::vector<int> result;
+		std::vector<char> visited(states.size(), 0);
+		std::vector<int> stack(from.begin(), from.end());
+		while (!stack.empty())
+		{
+			int s = stack.back();
+			stack.pop_back();
+			if (s < 0 || visited[s])
+				continue;
+			visited[s] = 1;
+			if (states[s].type == NfaState::Split)
+			{
+				stack.push_back(states[s].out1);
+				stack.push_back(states[s].out);
+			}
+			else
+				result.push_back(s);
+		}
+		std::sort(result.begin(), result.end());
+		return result;
+	}
+
+	std::vector<int> step(const std::vector<int>& current, unsigned char c) const
+	{
+		std::vector<int> next;
+		for (int s : current)
+		{
+			if (states[s].type == NfaState::Byte && states[s].bytes.test(c))
+				next.push_back(states[s].out);
+		}
+		return closure(next);
+	}
+
+	std::vector<int> acceptedPatterns(const std::vector<int>& current) const
+	{
+		std::vector<int> result;
+		for (int s : current)
+		{
+			if (states[s].type == NfaState::Match)
+				result.push_back(states[s].pattern);
+		}
+		std::sort(result.begin(), result.end());
+		result.erase(std::unique(result.begin(), result.end()), result.end());
+		return result;
+	}
+
+	// partitions the 256 byte values into classes of bytes that no pattern tells apart, 
+	// so that DFA transition rows have one entry per class instead of one per byte
+	void buildByteClasses()
+	{
+		std::map<std::vector<bool>, int> signatures;
+		classBytes.clear();
+		for (int c = 0; c < 256; ++c)
+		{
+			std::vector<bool> signature;
+			for (const NfaState& s : states)
+			{
+				if (s.type == NfaState::Byte)
+					signature.push_back(s.bytes.test(c));
+			}
+			auto found = signatures.find(signature);
+			if (found == signatures.end())
+			{
+				found = signatures.insert(std::make_pair(signature, static_cast<int>(classBytes.size()))).first;
+				classBytes.push_back(static_cast<unsigned char>(c));	// representative byte of the class
+			}
+			byteClass[c] = found->second;
+		}
+		classCount = static_cast<int>(classBytes.size());
+	}
+
+	std::vector<NfaState> states;
+	std::vector<int> starts;					// entry state of each pattern
+	int patternCount;
+
+	int byteClass[256];
+	std::vector<unsigned char> classBytes;
+	int classCount;
+
+	bool useDfa;
+	std::vector<std::vector<int>> dfaStates;	// NFA state sets (build time only)
+	std::vector<int> transitions;				// [state * classCount + class] => next state
+	std::vector<std::vector<int>> accepts;		// patterns accepted in each state
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Interval index for numeric range rule values ("ISO=200~400", "Focal Length=12.0 mm ~ 14.0 mm")
+//
+// All ranges used with the same Exif key go into a static centered interval tree, built once
+// when the rules are loaded. A numeric Exif value is then resolved to the whole set of ranges 
+// containing it in O(log n + k), instead of testing each range separately. Open-ended ranges 
+// ("* ~ 400") simply use the lowest/highest double as their missing bound.
+//
+
+class IntervalIndex
+{
+public:
+	// adds the closed interval [low, high], returning its id
+	int add(double low, double high)
+	{
+		intervals.push_back(Interval(low, high, static_cast<int>(intervals.size())));
+		return static_cast<int>(intervals.size() - 1);
+	}
+
+	// builds the tree, once all intervals have been added
+	void build()
+	{
+		nodes.clear();
+		std::vector<Interval> valid;
+		for (const Interval& interval : intervals)
+		{
+			// ranges with NaN bounds (or inverted) can never contain a value
+			if (interval.low <= interval.high)
+				valid.push_back(interval);
+		}
+		if (!valid.empty())
+			buildNode(valid);
+	}
+
+	// appends the ids of all intervals containing 'value' to 'hits'
+	void query(double value, std::vector<int>& hits) const
+	{
+		if (value != value || nodes.empty())		// NaN is in no range
+			return;
+
+		int n = 0;
+		while (n >= 0)
+		{
+			const Node& node = nodes[n];
+			if (value < node.center)
+			{	// intervals sorted by low bound: all those starting at or before value contain it
+				for (auto iter = node.byLow.begin(); iter != node.byLow.end() && iter->first <= value; ++iter)
+					hits.push_back(iter->second);
+				n = node.left;
+			}
+			else if (value > node.center)
+			{	// intervals sorted by high bound (descending): all those ending at or after value contain it
+				for (auto iter = node.byHigh.begin(); iter != node.byHigh.end() && iter->first >= value; ++iter)
+					hits.push_back(iter->second);
+				n = node.right;
+			}
+			else
+			{	// every interval of the node contains its center
+				for (const auto& bound : node.byLow)
+					hits.push_back(bound.second);
+				break;
+			}
+		}
+	}
+
+	int size() const { return static_cast<int>(intervals.size()); }
+
+private:
+	struct Interval
+	{
+		double low, high;
+		int id;
+
+		Interval(double low, double high, int id) : low(low), high(high), id(id) {}
+	};
+
+	typedef std::pair<double, int> Bound;	// interval bound + interval id
+
+	struct Node
+	{
+		double center;
+		std::vector<Bound> byLow;		// intervals containing center, by ascending low bound
+		std::vector<Bound> byHigh;		// same intervals, by descending high bound
+		int left, right;				// subtrees with intervals entirely below/above center (-1 if none)
+	};
+
+	int buildNode(std::vector<Interval>& items)
+	{
+		// center = median of all endpoints
+		std::vector<double> endpoints;
+		for (const Interval& interval : items)
+		{
+			endpoints.push_back(interval.low);
+			endpoints.push_back(interval.high);
+		}
+		std::nth_element(endpoints.begin(), endpoints.begin() + endpoints.size() / 2, endpoints.end());
+
+		int n = static_cast<int>(nodes.size());
+		nodes.push_back(Node());
+		nodes[n].center = endpoints[endpoints.size() / 2];
+
+		std::vector<Interval> below, above;
+		for (const Interval& interval : items)
+		{
+			if (interval.high < nodes[n].center)
+				below.push_back(interval);
+			else if (interval.low > nodes[n].center)
+				above.push_back(interval);
+			else
+			{
+				nodes[n].byLow.push_back(Bound(interval.low, interval.id));
+				nodes[n].byHigh.push_back(Bound(interval.high, interval.id));
+			}
+		}
+		std::sort(nodes[n].byLow.begin(), nodes[n].byLow.end());
+		std::sort(nodes[n].byHigh.begin(), nodes[n].byHigh.end(), std::greater<Bound>());
+
+		// (note: buildNode() grows 'nodes', so never assign its result directly into an element)
+		int left = below.empty() ? -1 : buildNode(below);
+		int right = above.empty() ? -1 : buildNode(above);
+		nodes[n].left = left;
+		nodes[n].right = right;
+		return n;
+	}
+
+	std::vector<Interval> intervals;
+	std::vector<Node> nodes;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//
+// The profile matching function: 
+//
+// Searches all sections from RTProfileSelectorRules.ini for the best match for the Exif 
+// fields read from the raw file
+//
+
+// Rule values
+//
+// If complex rules are anabled:
+// - rule value preceded by '!' => negative rule (field must NOT match rule value)
+//		Example:	
+//					White Balance=!Manual
+//
+// - rule has '~' (tilde)		=> interpret as numeric range: r1 >= value >= r2
+//		Example: 
+//					ISO=200~400
+//					Focal Length=12.0 mm ~ 14.0 mm
+//
+// - rule has '|' (pipe)		=> interpret as list of values 
+//		Example:
+//					Photo Style=Dynamic (B&W)|Black & White|Monochrome
+//
+// - rule starts with "re:"		=> regular expression matching the whole value (see MultiRegex)
+//								   everything after "re:" is the pattern ('|' is regex alternation there)
+//		Example:
+//					Lens Type=re:LUMIX G (VARIO )?.*
+//					Camera Model Name=!re:DMC-G[FX]\d+
+//
+// Rule groups
+//
+// A section whose name starts with '@' is a rule group: its keys are guard conditions shared by the
+// rules (and groups) that name it in an "@Group" key. When the guard fails, none of them is evaluated.
+// A rule in a group counts as if the guards of its group and of the enclosing ones were written in
+// the rule itself (which matters for the size of full profile rules; "@Rank" stays the rule's own).
+//		Example:
+//					[@Lumix GM1]
+//					Camera Model Name=DMC-GM1
+//
+//					[Generic BW.pp3]
+//					@Group=Lumix GM1
+//					Photo Style=Monochrome
+//
+// Rule values are parsed only once, when the rules file is loaded (see RuleSet). Regular 
+// expressions for the same Exif key are all evaluated in a single scan of the Exif value, and
+// ranges are all resolved by a single interval index lookup.
+//
+
+// One alternative of a rule value ("A|B|C" has three)
+struct RuleAlternative
+{
+	enum Kind { Exact, Range, Regex, Invalid };
+
+	Kind kind;
+	bool negated;			// '!' operator
+	string value;			// Exact: value to compare to
+	double low, high;		// Range: bounds
+	int interval;			// Range: interval id within the key's IntervalIndex
+	int pattern;			// Regex: pattern id within the key's MultiRegex
+
+	RuleAlternative() : kind(Invalid), negated(false), low(0.0), high(0.0), interval(-1), pattern(-1) {}
+};
+
+// A rule condition: Exif key and its parsed rule value
+struct RuleCondition
+{
+	size_t key;									// index into RuleSet::keys
+	string value;								// raw rule value
+	bool regex;									// "re:" value
+	std::vector<RuleAlternative> alternatives;	// parsed value (complex rules only)
+};
+
+#define RTPS_RULES_NO_GROUP			static_cast<size_t>(-1)
+
+// A section from RTProfileSelectorRules.ini
+struct Rule
+{
+	IniMultiMap::const_iterator section;
+	bool partial;								// partial profile rule ("@Sections" key present)
+	std::vector<RuleCondition> conditions;		// one per non-private key
+	size_t group;								// index into RuleSet::groups (RTPS_RULES_NO_GROUP if none)
+	size_t size;								// keys, counting the guards of its groups (the largest full profile rule wins)
+	string id;									// section name, numbered if repeated (e.g. "Generic.pp3#2")
+};
+
+// A rule group ("[@name]" section, see above)
+struct RuleGroup
+{
+	string name;
+	IniMultiMap::const_iterator section;		// the rules ini's end() for groups named but not defined
+	size_t parent;								// enclosing group (RTPS_RULES_NO_GROUP if none)
+	std::vector<RuleCondition> conditions;		// guard: one per non-private key
+	size_t guardSize;							// guard conditions, counting the enclosing groups'
+	bool valid;									// false if not defined or enclosed in itself: its rules never match
+};
+
+// Exif key referenced by the rules
+struct RuleKey
+{
+	string name;
+	IntervalIndex ranges;		// all numeric ranges used with this key
+	MultiRegex patterns;		// all regular expressions used with this key
+};
+
+// Rules matched by an image's Exif fields
+struct RuleMatches
+{
+	IniMultiMap::const_iterator baseProfile;						// full profile section (the rules ini's end() if none)
+	std::vector<IniMultiMap::const_iterator> partialProfiles;		// partial profile sections, in file order
+};
+
+// Cache of the rules matched by the Exif fields seen so far, for a rule set (see matchRules()).
+// Images of the same session mostly agree on the few Exif keys the rules look at, so the cache is keyed
+// by the projection of the Exif fields onto those keys (hashed, and compared in full on a hit), and 
+// matching the rules again is a lookup. As it belongs to the rule set, new rules come with an empty cache.
+// Each matching thread has entries of its own (for the last rule set it matched), so that it never locks,
+// in slots picked by the projection's hash: a new entry only replaces the one in its slot.
+#define RTPS_MATCH_CACHE_SIZE		4096	// slots per thread (a power of 2)
+
+class MatchCache
+{
+public:
+	MatchCache() : serial(++lastSerial), hits(0), misses(0) {}
+
+	// projection of the Exif fields onto the rules' keys (in order, with missing keys told apart from empty values)
+	static string project(const std::vector<const string*>& keys, const StrMap& exifFields)
+	{
+		string projection;
+		for (const string* key : keys)
+		{
+			auto field = exifFields.find(*key);
+			if (field == exifFields.end())
+				projection += '\x01';
+			else
+			{
+				projection += '\x02';
+				projection += field->second;
+			}
+			projection += '\0';
+		}
+		return projection;
+	}
+
+	bool find(const string& projection, RuleMatches& matches)
+	{
+		size_t hash = std::hash<string>()(projection);
+		const Slot& slot = threadSlot(hash);
+		if (!slot.used || slot.hash != hash || slot.projection != projection)
+		{
+			misses++;
+			return false;
+		}
+		hits++;
+		matches = slot.matches;
+		return true;
+	}
+
+	void store(const string& projection, const RuleMatches& matches)
+	{
+		size_t hash = std::hash<string>()(projection);
+		Slot& slot = threadSlot(hash);
+		slot.used = true;
+		slot.hash = hash;
+		slot.projection = projection;
+		slot.matches = matches;
+	}
+
+	unsigned long hitCount() const { return hits; }
+	unsigned long missCount() const { return misses; }
+
+private:
+	struct Slot
+	{
+		bool used;
+		size_t hash;
+		string projection;
+		RuleMatches matches;
+	};
+
+	// the calling thread's slot for a hash, all emptied first if they are another rule set's
+	// (told apart by serial number, as a new rule set may reuse the address of a freed one)
+	Slot& threadSlot(size_t hash) const
+	{
+		static thread_local uint64_t owner = 0;
+		static thread_local std::vector<Slot> slots;
+		if (owner != serial)
+		{
+			slots.assign(RTPS_MATCH_CACHE_SIZE, Slot());
+			owner = serial;
+		}
+		return slots[hash & (RTPS_MATCH_CACHE_SIZE - 1)];
+	}
+
+	static std::atomic<uint64_t> lastSerial;
+	const uint64_t serial;
+	std::atomic<unsigned long> hits, misses;
+};
+
+std::atomic<uint64_t> MatchCache::lastSerial(0);
+
+class CompiledRules;
+
+// The rules from RTProfileSelectorRules.ini, compiled for matching
+// note: keeps iterators into the rules ini map, which must outlive it
+class RuleSet
+{
+public:
+	RuleSet(const IniMultiMap& rulesIni, bool useComplexRules) : ini(rulesIni), useComplexRules(useComplexRules)
+	{
+		// rule groups first, so that rules can name them wherever they are
+		for (auto section = rulesIni.begin(); section != rulesIni.end(); ++section)
+		{
+			if (section->first.empty() || section->first[0] != RTPS_RULES_PRIVATE_KEY_CHAR)
+				continue;
+			string name = section->first.substr(1);
+			if (groupIds.find(name) != groupIds.end())
+			{
+				RTPS_LOG(Warning) << "Rule group [" << section->first << "] defined more than once: only the first one is used";
+				continue;
+			}
+			RuleGroup group;
+			group.name = name;
+			group.section = section;
+			group.parent = RTPS_RULES_NO_GROUP;
+			group.guardSize = 0;
+			group.valid = true;
+			parseConditions(section, group.conditions);
+			groups.push_back(std::move(group));
+			groupIds[name] = groups.size() - 1;
+		}
+		for (size_t group = 0, defined = groups.size(); group < defined; group++)
+		{
+			size_t parent = groupIndex(groups[group].section);
+			groups[group].parent = parent;
+		}
+		for (RuleGroup& group : groups)
+			resolveGuard(group);
+
+		for (auto section = rulesIni.begin(); section != rulesIni.end(); ++section)
+		{
+			if (!section->first.empty() && section->first[0] == RTPS_RULES_PRIVATE_KEY_CHAR)
+				continue;
+			Rule rule;
+			rule.section = section;
+			rule.partial = section->second.find(RTPS_RULES_PP3_SECTIONS_KEY) != section->second.end();
+			parseConditions(section, rule.conditions);
+			rule.group = groupIndex(section);
+			rule.size = section->second.size();
+			if (rule.group != RTPS_RULES_NO_GROUP)
+			{
+				rule.size += groups[rule.group].guardSize - 1;		// (the guards instead of the "@Group" key)
+				if (rule.conditions.empty() && groups[rule.group].guardSize == 0)
+					rule.group = RTPS_RULES_NO_GROUP;				// no conditions at all: never matches
+			}
+			rules.push_back(std::move(rule));
+		}
+
+		// rules are identified by section name, numbered if repeated (see Rule::id)
+		std::unordered_map<string, size_t> occurrences;
+		for (Rule& rule : rules)
+		{
+			size_t occurrence = occurrences[rule.section->first]++;
+			rule.id = occurrence == 0 ? rule.section->first : rule.section->first + "#" + std::to_string(occurrence + 1);
+		}
+
+		for (auto& key : keys)
+		{
+			key.ranges.build();
+			key.patterns.build();
+			keyNames.push_back(&key.name);
+		}
+	}
+
+	const IniMultiMap& ini;
+	const bool useComplexRules;
+	std::vector<Rule> rules;		// in the same order as the rules ini map (without the groups)
+	std::vector<RuleGroup> groups;
+	std::vector<RuleKey> keys;
+	std::vector<const string*> keyNames;			// names of the keys (see MatchCache)
+	std::shared_ptr<const CompiledRules> compiled;	// compiled rules module, if any (see CompiledRules)
+	mutable MatchCache matchCache;
+
+private:
+	void parseConditions(IniMultiMap::const_iterator section, std::vector<RuleCondition>& conditions)
+	{
+		for (const auto& keyVal : section->second)
+		{
+			if (keyVal.first[0] == RTPS_RULES_PRIVATE_KEY_CHAR)		// skip private RTPS Keys
+				continue;
+			RuleCondition condition;
+			condition.key = keyIndex(keyVal.first);
+			parseValue(section->first, keyVal.second.value, condition);
+			conditions.push_back(std::move(condition));
+		}
+	}
+
+	// group named by the section's "@Group" key (groups named but not defined never match)
+	size_t groupIndex(IniMultiMap::const_iterator section)
+	{
+		auto key = section->second.find(RTPS_RULES_GROUP_KEY);
+		if (key == section->second.end())
+			return RTPS_RULES_NO_GROUP;
+		const string& name = key->second.value;
+		auto iter = groupIds.find(name);
+		if (iter != groupIds.end())
+			return iter->second;
+		RTPS_LOG(Warning) << "Rule group [" << RTPS_RULES_PRIVATE_KEY_CHAR << name << "] not found (named by ["
+			<< section->first << "]): its rules never match";
+		RuleGroup group;
+		group.name = name;
+		group.section = ini.end();
+		group.parent = RTPS_RULES_NO_GROUP;
+		group.guardSize = 0;
+		group.valid = false;
+		groups.push_back(std::move(group));
+		groupIds[name] = groups.size() - 1;
+		return groups.size() - 1;
+	}
+
+	void resolveGuard(RuleGroup& group)
+	{
+		group.guardSize = group.conditions.size();
+		size_t depth = 0;
+		for (size_t parent = group.parent; parent != RTPS_RULES_NO_GROUP; parent = groups[parent].parent)
+		{
+			if (++depth > groups.size())
+			{
+				RTPS_LOG(Warning) << "Rule group [" << group.section->first << "] is enclosed in itself: its rules never match";
+				group.valid = false;
+				return;
+			}
+			group.guardSize += groups[parent].conditions.size();
+		}
+	}
+
+	size_t keyIndex(const string& name)
+	{
+		auto iter = keyIds.find(name);
+		if (iter != keyIds.end())
+			return iter->second;
+		RuleKey key;
+		key.name = name;
+		keys.push_back(std::move(key));
+		keyIds[name] = keys.size() - 1;
+		return keys.size() - 1;
+	}
+
+	void parseValue(const string& sectionName, const string& ruleValue, RuleCondition& condition)
+	{
+		condition.value = ruleValue;
+		condition.regex = false;
+		if (!useComplexRules)
+			return;		// complex rules disabled => direct string comparison
+
+		// regular expression: the whole value after "re:" (and an optional '!') is the pattern
+		string value = trimLeft(ruleValue);
+		bool negated = !value.empty() && value[0] == '!';
+		if (value.compare(negated ? 1 : 0, strlen(RTPS_RULES_REGEX_PREFIX), RTPS_RULES_REGEX_PREFIX) == 0)
+		{
+			RuleAlternative alternative;
+			string error;
+			alternative.kind = RuleAlternative::Regex;
+			alternative.negated = negated;
+			alternative.pattern = keys[condition.key].patterns.add(value.substr((negated ? 1 : 0) + strlen(RTPS_RULES_REGEX_PREFIX)), error);
+			if (alternative.pattern < 0)
+			{
+				RTPS_LOG(Warning) << "Invalid regular expression in rule [" << sectionName << "] " 
+					<< keys[condition.key].name << "=" << ruleValue << ": " << error;
+				alternative.kind = RuleAlternative::Invalid;
+			}
+			condition.regex = true;
+			condition.alternatives.push_back(alternative);
+			return;
+		}
+
+		// list of pipe-delimited values
+		size_t start = 0;
+		for (;;)
+		{
+			size_t pipe = ruleValue.find_first_of('|', start);
+			RuleAlternative alternative = parseAlternative(ruleValue.substr(start, pipe == string::npos ? string::npos : pipe - start));
+			if (alternative.kind == RuleAlternative::Range)
+				alternative.interval = keys[condition.key].ranges.add(alternative.low, alternative.high);
+			condition.alternatives.push_back(alternative);
+			if (pipe == string::npos)
+				break;
+			start = pipe + 1;
+		}
+	}
+
+	static RuleAlternative parseAlternative(const string& ruleValue)
+	{
+		RuleAlternative alternative;
+
+		// rules can be negated by ! operator - operator MUST be first non-space char of value string
+		string value = trimLeft(ruleValue);
+		alternative.negated = !value.empty() && value[0] == '!';
+		if (alternative.negated)
+			value = value.substr(1);
+
+		// might be a range expression: two numeric values (optionally followed by unit, as in "40mm") separated by a tilde
+		size_t tilde = value.find_first_of('~');
+		if (tilde != string::npos)
+		{
+			// I should really reserve characters for minus/plus infinity, but I'll consider a range as legal 
+			// if AT LEAST ONE SIDE of a range expression is convertible to a number. 
+			// This is so that we can have such ranges as: 
+			//	"* ~ 400" meaning anything <= 400 or
+			//	"400 ~ *" meaning anything >= 400
+			// Anything that is not convertible will be ignored (not just "*") 
+			alternative.low = eval(value.substr(0, tilde), std::numeric_limits<double>::lowest());
+			alternative.high = eval(value.substr(tilde + 1), std::numeric_limits<double>::max());
+			if (alternative.low != std::numeric_limits<double>::lowest() || alternative.high != std::numeric_limits<double>::max())
+				alternative.kind = RuleAlternative::Range;
+		}
+		else
+		{	// must be a single value
+			alternative.kind = RuleAlternative::Exact;
+			alternative.value = value;
+		}
+		return alternative;
+	}
+
+	std::map<string, size_t> keyIds;
+	std::map<string, size_t> groupIds;
+};
+
+// Outcome of matching a rule when some Exif keys may still be unknown
+enum class RuleMatch { No, Yes, Unknown };
+
+// Evaluates rule conditions against the Exif fields of one image 
+// Exif values are looked up, converted and resolved against ranges and regular expressions only once per key
+class RuleEvaluator
+{
+public:
+	RuleEvaluator(const RuleSet& ruleSet, const StrMap& exifFields) : 
+		ruleSet(ruleSet), exifFields(exifFields), fields(ruleSet.keys.size()), guards(ruleSet.groups.size(), GuardUnknown) {}
+
+	// Matches the Exif value against the rule condition
+	bool matches(const RuleCondition& condition)
+	{
+		const Field& field = getField(condition.key);
+		if (field.value == nullptr)
+			return false;		// key not found in Exif
+
+		// complex rules disabled (or Exif value has reserved chars) => direct string comparison
+		if (!field.complex && !(condition.regex && ruleSet.useComplexRules))
+			return *field.value == condition.value;
+
+		for (const RuleAlternative& alternative : condition.alternatives)
+		{
+			bool matched;
+			switch (alternative.kind)
+			{
+			case RuleAlternative::Exact:
+				matched = *field.value == alternative.value;
+				break;
+			case RuleAlternative::Range:
+				matched = field.rangeHits[alternative.interval] != 0;
+				break;
+			case RuleAlternative::Regex:
+				matched = field.regexHits[alternative.pattern] != 0;
+				break;
+			default:
+				continue;		// invalid alternatives never match, not even when negated
+			}
+			if (matched ^ alternative.negated)
+				return true;
+		}
+		return false;
+	}
+
+	// Matches the guard of a rule group (and of the enclosing ones), once per image
+	bool guardPasses(size_t group)
+	{
+		char& guard = guards[group];
+		if (guard == GuardUnknown)
+		{
+			const RuleGroup& ruleGroup = ruleSet.groups[group];
+			bool passed = ruleGroup.valid && (ruleGroup.parent == RTPS_RULES_NO_GROUP || guardPasses(ruleGroup.parent));
+			for (size_t condition = 0; passed && condition < ruleGroup.conditions.size(); condition++)
+				passed = matches(ruleGroup.conditions[condition]);
+			guard = passed ? GuardPassed : GuardFailed;
+		}
+		return guard == GuardPassed;
+	}
+
+	// Matches the rule, considering keys missing from the Exif fields as unknown (rather than not matching):
+	// the outcome is Unknown if the rule could still match, depending on the values of the missing keys
+	RuleMatch matchesKnown(const Rule& rule)
+	{
+		if (rule.conditions.empty() && rule.group == RTPS_RULES_NO_GROUP)
+			return RuleMatch::No;
+		bool unknown = false;
+		for (size_t group = rule.group; group != RTPS_RULES_NO_GROUP; group = ruleSet.groups[group].parent)
+		{
+			if (!ruleSet.groups[group].valid || !matchesKnown(ruleSet.groups[group].conditions, unknown))
+				return RuleMatch::No;
+		}
+		if (!matchesKnown(rule.conditions, unknown))
+			return RuleMatch::No;
+		return unknown ? RuleMatch::Unknown : RuleMatch::Yes;
+	}
+
+private:
+	enum { GuardUnknown, GuardPassed, GuardFailed };
+
+	// false if a condition doesn't match; 'unknown' is set if a condition's key is missing
+	bool matchesKnown(const std::vector<RuleCondition>& conditions, bool& unknown)
+	{
+		for (const RuleCondition& condition : conditions)
+		{
+			if (getField(condition.key).value == nullptr)
+				unknown = true;
+			else if (!matches(condition))
+				return false;
+		}
+		return true;
+	}
+
+	struct Field
+	{
+		bool loaded;
+		const string* value;			// Exif value (null if not found)
+		bool complex;					// complex rules apply to this value
+		std::vector<char> rangeHits;	// ranges containing the (numeric) value
+		std::vector<char> regexHits;	// patterns matching the value
+
+		Field() : loaded(false), value(nullptr), complex(false) {}
+	};
+
+	const Field& getField(size_t key)
+	{
+		Field& field = fields[key];
+		if (field.loaded)
+			return field;
+
+		field.loaded = true;
+		const RuleKey& ruleKey = ruleSet.keys[key];
+		auto iter = exifFields.find(ruleKey.name);
+		if (iter == exifFields.end())
+			return field;
+
+		field.value = &iter->second;
+		// if exif value has any reserved char, disable complex rule evaluation
+		field.complex = ruleSet.useComplexRules && field.value->find_first_of("!~|") == string::npos;
+		if (field.complex && ruleKey.ranges.size() != 0)
+		{
+			// single index lookup for all ranges used with this key
+			std::vector<int> hits;
+			ruleKey.ranges.query(eval(*field.value, 0.0), hits);
+			field.rangeHits.assign(ruleKey.ranges.size(), 0);
+			for (int interval : hits)
+				field.rangeHits[interval] = 1;
+		}
+		if (ruleSet.useComplexRules && ruleKey.patterns.size() != 0)
+		{
+			// single scan of the value for all patterns used with this key
+			std::vector<int> matched;
+			ruleKey.patterns.scan(*field.value, matched);
+			field.regexHits.assign(ruleKey.patterns.size(), 0);
+			for (int pattern : matched)
+				field.regexHits[pattern] = 1;
+		}
+		return field;
+	}
+
+	const RuleSet& ruleSet;
+	const StrMap& exifFields;
+	std::vector<Field> fields;
+	std::vector<char> guards;		// per rule group (see guardPasses())
+};
+
+// Opt-in profile of the rules ("RuleProfile"): for each rule section, how many times it was evaluated and 
+// matched, the time spent evaluating it (and, for partial profile rules, resolving the profile sections to
+// apply) and which of its conditions failed most often.  The report is rewritten sorted by time spent, so
+// that expensive and dead rules stand out, and is read back when loading the rules, so that the counts add
+// up across runs (as with RuleStats, with several instances running at the same time some may be lost).
+// While profiling, every image is matched by the interpreter, rule by rule: no compiled rules module, no
+// match cache.
+class RuleProfile
+{
+public:
+	RuleProfile(const RuleSet& ruleSet, const string& path) : ruleSet(ruleSet), path(path), counts(ruleSet.rules.size())
+	{
+		for (size_t rule = 0; rule < counts.size(); rule++)
+		{
+			counts[rule].failed = std::vector<Counter>(ruleSet.rules[rule].conditions.size());
+			ruleIndexes[&*ruleSet.rules[rule].section] = rule;
+		}
+		load();
+	}
+
+	void recordImage() { images.value.fetch_add(1, std::memory_order_relaxed); }
+
+	// a rule evaluated since 'start' (failedCondition: the one that failed, if any)
+	void recordRule(size_t rule, bool matched, size_t failedCondition, std::chrono::steady_clock::time_point start)
+	{
+		RuleCounts& rc = counts[rule];
+		rc.evaluating.value.fetch_add(elapsed(start), std::memory_order_relaxed);
+		rc.evaluated.value.fetch_add(1, std::memory_order_relaxed);
+		if (matched)
+			rc.matched.value.fetch_add(1, std::memory_order_relaxed);
+		if (failedCondition < rc.failed.size())
+			rc.failed[failedCondition].value.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// the profile sections of a matched partial profile rule resolved since 'start' (see getPartialProfilesMatches())
+	void recordResolve(IniMultiMap::const_iterator section, std::chrono::steady_clock::time_point start)
+	{
+		auto rule = ruleIndexes.find(&*section);
+		if (rule != ruleIndexes.end())
+			counts[rule->second].resolving.value.fetch_add(elapsed(start), std::memory_order_relaxed);
+	}
+
+	// Writes the report (to a temporary file, renamed over the previous one)
+	void save() const
+	{
+		std::vector<size_t> order(counts.size());
+		for (size_t rule = 0; rule < order.size(); rule++)
+			order[rule] = rule;
+		std::stable_sort(order.begin(), order.end(), 
+			[this](size_t rule1, size_t rule2) { return counts[rule1].time() > counts[rule2].time(); });
+
+		std::ostringstream tempPath;
+		tempPath << path << "." << Logger::processId() << ".tmp";
+		{
+			std::ofstream out(tempPath.str());
+			out << "# " << images.get() << " image(s) profiled, rules sorted by time spent evaluating them and resolving their profile sections\n"
+				<< "# section\tkind\tevaluations\tmatches\tmatch %\tevaluating (ms)\tresolving (ms)\tus/evaluation\tmost failed condition\tfailures\n"
+				<< std::setiosflags(std::ios::fixed);
+			for (size_t rule : order)
+			{
+				const RuleCounts& rc = counts[rule];
+				const std::vector<RuleCondition>& conditions = ruleSet.rules[rule].conditions;
+				size_t mostFailed = conditions.size();
+				for (size_t condition = 0; condition < conditions.size(); condition++)
+				{
+					if (rc.failed[condition].get() != 0 && (mostFailed == conditions.size() || rc.failed[condition].get() > rc.failed[mostFailed].get()))
+						mostFailed = condition;
+				}
+				unsigned long long evaluated = rc.evaluated.get();
+				out << ruleSet.rules[rule].id << '\t' << (ruleSet.rules[rule].partial ? "partial" : "full") << '\t' 
+					<< evaluated << '\t' << rc.matched.get() << '\t'
+					<< std::setprecision(1) << (evaluated != 0 ? 100.0 * rc.matched.get() / evaluated : 0.0) << '\t'
+					<< std::setprecision(3) << rc.evaluating.get() / 1e6 << '\t' << rc.resolving.get() / 1e6 << '\t'
+					<< (evaluated != 0 ? rc.evaluating.get() / 1e3 / evaluated : 0.0) << '\t'
+					<< (mostFailed != conditions.size() ? ruleSet.keys[conditions[mostFailed].key].name : "") << '\t'
+					<< (mostFailed != conditions.size() ? rc.failed[mostFailed].get() : 0) << "\n";
+				// failures of each condition (read back by load())
+				for (size_t condition = 0; condition < conditions.size(); condition++)
+					out << '\t' << ruleSet.keys[conditions[condition].key].name << '\t' << rc.failed[condition].get() << "\n";
+			}
+		}
+		if (!replaceFile(tempPath.str(), path))
+			remove(tempPath.str().c_str());
+	}
+
+private:
+	struct Counter
+	{
+		std::atomic<unsigned long long> value;
+
+		Counter() : value(0) {}
+		Counter(const Counter& other) : value(other.get()) {}
+		unsigned long long get() const { return value.load(std::memory_order_relaxed); }
+	};
+
+	struct RuleCounts
+	{
+		Counter evaluated, matched;
+		Counter evaluating, resolving;		// nanoseconds
+		std::vector<Counter> failed;		// by condition
+
+		unsigned long long time() const { return evaluating.get() + resolving.get(); }
+	};
+
+	static unsigned long long elapsed(std::chrono::steady_clock::time_point start)
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	// Reads the counts of the previous runs from the report (counts for rules or keys not found are ignored)
+	void load()
+	{
+		std::map<string, size_t> rules;
+		for (size_t rule = 0; rule < counts.size(); rule++)
+			rules[ruleSet.rules[rule].id] = rule;
+
+		std::ifstream file(path);
+		string line;
+		RuleCounts* rc = nullptr;
+		size_t rule = 0;
+		while (std::getline(file, line))
+		{
+			std::vector<string> fields;
+			std::istringstream ss(line);
+			string field;
+			while (std::getline(ss, field, '\t'))
+				fields.push_back(field);
+			if (line.compare(0, 2, "# ") == 0 && images.get() == 0)
+				images.value.store(strtoull(line.c_str() + 2, nullptr, 10));
+			else if (!line.empty() && line[0] != '#' && line[0] != '\t' && fields.size() >= 7)
+			{
+				auto found = rules.find(fields[0]);
+				rc = found != rules.end() ? &counts[found->second] : nullptr;
+				if (rc != nullptr)
+				{
+					rule = found->second;
+					rc->evaluated.value.store(strtoull(fields[2].c_str(), nullptr, 10));
+					rc->matched.value.store(strtoull(fields[3].c_str(), nullptr, 10));
+					rc->evaluating.value.store(static_cast<unsigned long long>(atof(fields[5].c_str()) * 1e6));
+					rc->resolving.value.store(static_cast<unsigned long long>(atof(fields[6].c_str()) * 1e6));
+				}
+			}
+			else if (rc != nullptr && fields.size() == 3 && fields[0].empty())
+			{
+				const std::vector<RuleCondition>& conditions = ruleSet.rules[rule].conditions;
+				for (size_t condition = 0; condition < conditions.size(); condition++)
+				{
+					if (ruleSet.keys[conditions[condition].key].name == fields[1])
+						rc->failed[condition].value.store(strtoull(fields[2].c_str(), nullptr, 10));
+				}
+			}
+		}
+	}
+
+	const RuleSet& ruleSet;
+	string path;
+	std::vector<RuleCounts> counts;							// by rule
+	std::unordered_map<const void*, size_t> ruleIndexes;	// by rule section
+	Counter images;
+};
+
+// Evaluation statistics for the rules, persisted in "RTProfileSelectorRules.stats" to pick the order
+// in which rules and conditions are evaluated: the conditions of a rule most likely to fail first 
+// (so that a rule is rejected after as few tests as possible) and, among full profile rules of the 
+// same size, the ones most often matched first.  Only the order depends on the statistics, never 
+// the outcome.  A one-shot run (one image per instance, with several instances running at the same 
+// time) only appends the counts it added, which are summed when loading; the file is rewritten whole
+// once it holds many such lines, and at the end of library and live snapshot runs (so some counts may 
+// be lost, which is harmless).  It may be deleted at any time.
+// Counts are updated atomically, so that threads evaluating rules at the same time can share them.
+class RuleStats
+{
+public:
+	explicit RuleStats(const RuleSet& ruleSet) : ruleSet(ruleSet), ruleCounts(ruleSet.rules.size()), 
+		conditionOrders(ruleSet.rules.size()), loadedRuleCounts(ruleSet.rules.size()), compactionDue(false), dirty(false)
+	{
+		conditionCounts.reserve(ruleSet.rules.size());
+		loadedConditionCounts.reserve(ruleSet.rules.size());
+		for (size_t rule = 0; rule < ruleSet.rules.size(); rule++)
+		{
+			conditionCounts.emplace_back(ruleSet.rules[rule].conditions.size());
+			loadedConditionCounts.emplace_back(ruleSet.rules[rule].conditions.size());
+		}
+		sortOrders();
+	}
+
+	// Reads the counts saved by previous runs, summing those appended (counts for rules or keys not found are ignored)
+	void load(const string& path)
+	{
+		// by "<section id>\t<key>" (the beginning of the lines)
+		std::unordered_map<string, CountValues> saved;
+		std::ifstream file(path, std::ios::in | std::ios::binary);
+		std::ostringstream contents;
+		contents << file.rdbuf();
+		const string text = contents.str();
+		size_t lines = 0;
+		for (size_t start = 0; start < text.size(); )
+		{
+			size_t end = text.find('\n', start);
+			if (end == string::npos)
+				end = text.size();
+			size_t keyTab = text.find('\t', start);
+			size_t countsTab = keyTab < end ? text.find('\t', keyTab + 1) : string::npos;
+			if (countsTab < end)
+			{
+				CountValues& counts = saved[text.substr(start, countsTab - start)];
+				char* failed;
+				counts.first += strtoul(text.c_str() + countsTab + 1, &failed, 10);
+				counts.second += strtoul(failed, nullptr, 10);
+				lines++;
+			}
+			start = end + 1;
+		}
+		if (saved.empty())
+			return;
+		compactionDue = lines > MAX_LINES_PER_COUNT * saved.size();
+
+		for (size_t rule = 0; rule < ruleSet.rules.size(); rule++)
+		{
+			const string& id = ruleSet.rules[rule].id;
+			auto counts = saved.find(id + '\t' + RTPS_RULES_PRIVATE_KEY_CHAR);
+			if (counts != saved.end())
+				ruleCounts[rule].set(counts->second.first, counts->second.second);
+			for (size_t condition = 0; condition < conditionCounts[rule].size(); condition++)
+			{
+				counts = saved.find(id + '\t' + ruleSet.keys[ruleSet.rules[rule].conditions[condition].key].name);
+				if (counts != saved.end())
+					conditionCounts[rule][condition].set(counts->second.first, counts->second.second);
+			}
+			// (aged as in recordRule())
+			while (ruleCounts[rule].evaluated.load(std::memory_order_relaxed) >= MAX_EVALUATED)
+			{
+				ruleCounts[rule].halve();
+				for (Counts& counts : conditionCounts[rule])
+					counts.halve();
+			}
+			loadedRuleCounts[rule] = ruleCounts[rule].get();
+			for (size_t condition = 0; condition < conditionCounts[rule].size(); condition++)
+				loadedConditionCounts[rule][condition] = conditionCounts[rule][condition].get();
+		}
+		sortOrders();
+	}
+
+	// Profiles the rules into "RuleProfile" (relative to RTPS's folder unless a full path), if set
+	void loadProfile(const IniMap& rtSelectorIni, const string& basePath)
+	{
+		string path = getIniValue(rtSelectorIni, RTPS_INI_SECTION_GENERAL, "RuleProfile");
+		if (path.empty())
+			return;
+		if (!isFullPath(path))
+			path = basePath + path;
+		profile.reset(new RuleProfile(ruleSet, path));
+		RTPS_LOG(Info) << "Profiling the rules into " << path;
+	}
+
+	// Writes the counts, if any changed (to a temporary file, renamed over the previous one), and the profile
+	void save(const string& path) const
+	{
+		if (profile)
+			profile->save();
+		if (dirty.load(std::memory_order_relaxed))
+			rewrite(path);
+	}
+
+	// Appends the counts added since loading, if any (in a single write), and writes the profile; 
+	// cheaper than save() for a run evaluating the rules once, unless the file is due to be rewritten whole
+	void append(const string& path) const
+	{
+		if (profile)
+			profile->save();
+		if (!dirty.load(std::memory_order_relaxed))
+			return;
+		if (compactionDue)
+		{
+			rewrite(path);
+			return;
+		}
+
+		std::ostringstream lines;
+		for (size_t rule = 0; rule < ruleSet.rules.size(); rule++)
+		{
+			const string& id = ruleSet.rules[rule].id;
+			appendDelta(lines, id, string(1, RTPS_RULES_PRIVATE_KEY_CHAR), ruleCounts[rule], loadedRuleCounts[rule]);
+			for (size_t condition = 0; condition < conditionCounts[rule].size(); condition++)
+				appendDelta(lines, id, ruleSet.keys[ruleSet.rules[rule].conditions[condition].key].name, 
+					conditionCounts[rule][condition], loadedConditionCounts[rule][condition]);
+		}
+		string text = lines.str();
+		if (text.empty())
+			return;
+		FILE* file = fopen(path.c_str(), "ab");
+		if (file == nullptr)
+			return;
+		fwrite(text.data(), 1, text.size(), file);
+		fclose(file);
+	}
+
+	// Order in which to evaluate the conditions of a rule: most likely to fail first
+	const std::vector<size_t>& conditionOrder(size_t rule) const { return conditionOrders[rule]; }
+
+	// Full profile rules, by decreasing section size and, for the same size, most often matched first
+	const std::vector<size_t>& fullRuleOrder() const { return fullRules; }
+
+	void recordCondition(size_t rule, size_t condition, bool passed)
+	{
+		conditionCounts[rule][condition].add(passed);
+		dirty.store(true, std::memory_order_relaxed);
+	}
+
+	std::unique_ptr<RuleProfile> profile;		// null unless profiling (see loadProfile())
+
+	void recordRule(size_t rule, bool matched)
+	{
+		ruleCounts[rule].add(matched);
+		// ages the counts, so that the order follows what's being matched lately
+		if (ruleCounts[rule].evaluated.load(std::memory_order_relaxed) >= MAX_EVALUATED)
+		{
+			ruleCounts[rule].halve();
+			for (Counts& counts : conditionCounts[rule])
+				counts.halve();
+		}
+		dirty.store(true, std::memory_order_relaxed);
+	}
+
+private:
+	typedef std::pair<unsigned long, unsigned long> CountValues;	// evaluated, failed
+
+	static const unsigned long MAX_EVALUATED = 4096;	// counts are halved from then on
+	static const size_t MAX_LINES_PER_COUNT = 4;		// appended lines tolerated before rewriting the file
+
+	void rewrite(const string& path) const
+	{
+		std::ostringstream tempPath;
+		tempPath << path << "." << Logger::processId() << ".tmp";
+		{
+			std::ofstream out(tempPath.str());
+			for (size_t rule = 0; rule < ruleSet.rules.size(); rule++)
+			{
+				const string& id = ruleSet.rules[rule].id;
+				out << id << '\t' << RTPS_RULES_PRIVATE_KEY_CHAR << '\t' << ruleCounts[rule].evaluated << '\t' << ruleCounts[rule].failed << "\n";
+				for (size_t condition = 0; condition < conditionCounts[rule].size(); condition++)
+				{
+					const Counts& counts = conditionCounts[rule][condition];
+					out << id << '\t' << ruleSet.keys[ruleSet.rules[rule].conditions[condition].key].name << '\t' 
+						<< counts.evaluated << '\t' << counts.failed << "\n";
+				}
+			}
+		}
+		if (!replaceFile(tempPath.str(), path))
+			remove(tempPath.str().c_str());
+	}
+
+	struct Counts
+	{
+		std::atomic<unsigned long> evaluated;
+		std::atomic<unsigned long> failed;
+
+		Counts() : evaluated(0), failed(0) {}
+		CountValues get() const { return CountValues(evaluated.load(std::memory_order_relaxed), failed.load(std::memory_order_relaxed)); }
+		void set(unsigned long evaluatedCount, unsigned long failedCount)
+		{
+			evaluated.store(evaluatedCount, std::memory_order_relaxed);
+			failed.store(std::min(failedCount, evaluatedCount), std::memory_order_relaxed);
+		}
+		void add(bool passed)
+		{
+			evaluated.fetch_add(1, std::memory_order_relaxed);
+			if (!passed)
+				failed.fetch_add(1, std::memory_order_relaxed);
+		}
+		// (not atomic as a whole: a count added meanwhile may be lost)
+		void halve() { set(evaluated.load(std::memory_order_relaxed) / 2, failed.load(std::memory_order_relaxed) / 2); }
+		// estimated probability of failing (2 virtual evaluations, one failed, for unknown rules)
+		double failRate() const { return (failed.load(std::memory_order_relaxed) + 1.0) / (evaluated.load(std::memory_order_relaxed) + 2.0); }
+	};
+
+	// a line with the counts added since loading, if any (none if halved meanwhile)
+	static void appendDelta(std::ostream& out, const string& id, const string& key, const Counts& counts, const CountValues& loaded)
+	{
+		CountValues current = counts.get();
+		if (current.first <= loaded.first)
+			return;
+		out << id << '\t' << key << '\t' << current.first - loaded.first << '\t' 
+			<< (current.second > loaded.second ? current.second - loaded.second : 0) << "\n";
+	}
+
+	void sortOrders()
+	{
+		fullRules.clear();
+		for (size_t rule = 0; rule < ruleSet.rules.size(); rule++)
+		{
+			std::vector<size_t>& order = conditionOrders[rule];
+			const std::vector<Counts>& counts = conditionCounts[rule];
+			order.resize(counts.size());
+			for (size_t condition = 0; condition < order.size(); condition++)
+				order[condition] = condition;
+			std::stable_sort(order.begin(), order.end(), 
+				[&counts](size_t condition1, size_t condition2) { return counts[condition1].failRate() > counts[condition2].failRate(); });
+
+			if (!ruleSet.rules[rule].partial)
+				fullRules.push_back(rule);
+		}
+
+		std::stable_sort(fullRules.begin(), fullRules.end(), 
+			[this](size_t rule1, size_t rule2) -> bool
+			{
+				size_t size1 = ruleSet.rules[rule1].size;
+				size_t size2 = ruleSet.rules[rule2].size;
+				if (size1 != size2)
+					return size1 > size2;
+				return ruleCounts[rule1].failRate() < ruleCounts[rule2].failRate();
+			}
+		);
+	}
+
+	const RuleSet& ruleSet;
+	std::vector<Counts> ruleCounts;
+	std::vector<std::vector<Counts>> conditionCounts;
+	std::vector<std::vector<size_t>> conditionOrders;
+	std::vector<size_t> fullRules;
+	std::vector<CountValues> loadedRuleCounts;					// as loaded, to append only what was added
+	std::vector<std::vector<CountValues>> loadedConditionCounts;
+	bool compactionDue;											// too many lines appended: rewrite the file
+	std::atomic<bool> dirty;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Compiled rules
+//
+// For a rule set that rarely changes, "RTProfileSelector --compile-rules <file.cpp>" turns the rules
+// into C++ source for a matcher specialized for them: each Exif value used by the rules is
+// interned through a perfect hash table of the values the rules compare it to, and each rule 
+// becomes a single boolean expression over the interned values, constant range tables and
+// regular expression hits (still resolved by the MultiRegex of each key). Once built into a 
+// shared library (see the generated file) and declared as "CompiledRules" in RTProfileSelector.ini,
+// it's loaded at start and used instead of evaluating the rules, with the same outcome. The module
+// records the fingerprint of the rules it was generated from: if the rules changed since, it's
+// ignored (with a warning) and the rules are evaluated as usual.
+//
+
+#define RTPS_COMPILED_RULES_ABI		1
+#define RTPS_COMPILED_RULES_SYMBOL	"rtpsCompiledRules"
+
+// Interface with a compiled rules module (also written into the generated source, see below)
+#define RTPS_COMPILED_RULES_INTERFACE \
+"// What the host passes for each Exif key used by the rules (in order of first use in the rules file)\n" \
+"struct RtpsCompiledField\n" \
+"{\n" \
+"	const char* value;				// null if not among the image's Exif fields\n" \
+"	size_t size;\n" \
+"	double number;					// numeric value (for keys used with ranges)\n" \
+"	const unsigned char* regexHits;	// per regular expression used with the key: matched or not\n" \
+"};\n" \
+"\n" \
+"struct RtpsCompiledRules\n" \
+"{\n" \
+"	unsigned abi;\n" \
+"	const char* fingerprint;		// of the rules the module was generated from\n" \
+"	size_t keyCount;\n" \
+"	size_t ruleCount;\n" \
+"	void (*match)(const RtpsCompiledField* fields, unsigned char* matches);	// per rule: matched or not\n" \
+"};\n"
+
+struct RtpsCompiledField
+{
+	const char* value;
+	size_t size;
+	double number;
+	const unsigned char* regexHits;
+};
+
+struct RtpsCompiledRules
+{
+	unsigned abi;
+	const char* fingerprint;
+	size_t keyCount;
+	size_t ruleCount;
+	void (*match)(const RtpsCompiledField* fields, unsigned char* matches);
+};
+
+// Fingerprint of a rule set: everything the outcome of matching depends on
+string rulesFingerprint(const RuleSet& rules)
+{
+	std::ostringstream text;
+	text << RTPS_COMPILED_RULES_ABI << (rules.useComplexRules ? " complex\n" : " simple\n");
+	for (const Rule& rule : rules.rules)
+	{
+		text << "[" << rule.section->first << "]\n";
+		for (const auto& entry : rule.section->second)
+			text << entry.first << "=" << entry.second.value << "\n";
+	}
+	for (const RuleGroup& group : rules.groups)
+	{
+		if (group.section == rules.ini.end())
+			continue;
+		text << "[" << group.section->first << "]\n";
+		for (const auto& entry : group.section->second)
+			text << entry.first << "=" << entry.second.value << "\n";
+	}
+	return hashString(text.str());
+}
+
+// A loaded compiled rules module
+class CompiledRules
+{
+public:
+	// loads the module, if it was generated from these rules (null otherwise)
+	static std::shared_ptr<const CompiledRules> load(const string& path, const RuleSet& rules)
+	{
+		std::shared_ptr<CompiledRules> compiled(new CompiledRules());
+#ifdef _WIN32
+		compiled->module = LoadLibraryA(path.c_str());
+		typedef const RtpsCompiledRules* (*EntryPoint)();
+		EntryPoint entryPoint = compiled->module == nullptr ? nullptr :
+			reinterpret_cast<EntryPoint>(GetProcAddress(static_cast<HMODULE>(compiled->module), RTPS_COMPILED_RULES_SYMBOL));
+#else
+		compiled->module = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+		typedef const RtpsCompiledRules* (*EntryPoint)();
+		EntryPoint entryPoint = compiled->module == nullptr ? nullptr :
+			reinterpret_cast<EntryPoint>(dlsym(compiled->module, RTPS_COMPILED_RULES_SYMBOL));
+#endif
+		if (entryPoint == nullptr)
+		{
+			RTPS_LOG(Warning) << "Can't load compiled rules module " << path << ": rules evaluated as usual";
+			return nullptr;
+		}
+		compiled->entry = entryPoint();
+		if (compiled->entry->abi != RTPS_COMPILED_RULES_ABI || rulesFingerprint(rules) != compiled->entry->fingerprint ||
+			compiled->entry->keyCount != rules.keys.size() || compiled->entry->ruleCount != rules.rules.size())
+		{
+			RTPS_LOG(Warning) << "Compiled rules module " << path << " was generated from other rules (run --compile-rules again): "
+				"rules evaluated as usual";
+			return nullptr;
+		}
+		RTPS_LOG(Info) << "Using compiled rules module " << path;
+		return compiled;
+	}
+
+	~CompiledRules()
+	{
+		if (module == nullptr)
+			return;
+#ifdef _WIN32
+		FreeLibrary(static_cast<HMODULE>(module));
+#else
+		dlclose(module);
+#endif
+	}
+
+	// matches all the rules at once: 'matches' gets one flag per rule
+	// (false if the module can't be used for these Exif fields: a NaN numeric value, see IntervalIndex::query())
+	bool match(const RuleSet& rules, const StrMap& exifFields, std::vector<unsigned char>& matches) const
+	{
+		std::vector<RtpsCompiledField> fields(rules.keys.size());
+		std::vector<std::vector<unsigned char>> regexHits(rules.keys.size());
+		for (size_t key = 0; key < rules.keys.size(); key++)
+		{
+			const RuleKey& ruleKey = rules.keys[key];
+			RtpsCompiledField& field = fields[key];
+			field.value = nullptr;
+			field.size = 0;
+			field.number = 0.0;
+			field.regexHits = nullptr;
+			auto value = exifFields.find(ruleKey.name);
+			if (value == exifFields.end())
+				continue;
+			field.value = value->second.c_str();
+			field.size = value->second.size();
+			if (ruleKey.ranges.size() != 0)
+			{
+				field.number = eval(value->second, 0.0);
+				if (field.number != field.number)
+					return false;
+			}
+			if (rules.useComplexRules && ruleKey.patterns.size() != 0)
+			{
+				std::vector<int> matched;
+				ruleKey.patterns.scan(value->second, matched);
+				regexHits[key].assign(ruleKey.patterns.size(), 0);
+				for (int pattern : matched)
+					regexHits[key][pattern] = 1;
+				field.regexHits = regexHits[key].data();
+			}
+		}
+		matches.assign(rules.rules.size(), 0);
+		if (!matches.empty())
+			entry->match(fields.data(), matches.data());
+		return true;
+	}
+
+private:
+	CompiledRules() : module(nullptr), entry(nullptr) {}
+
+	void* module;
+	const RtpsCompiledRules* entry;
+};
+
+// Uses the compiled rules module declared in RTProfileSelector.ini ("CompiledRules"), if any and up to date
+void loadCompiledRules(RuleSet& rules, const IniMap& rtSelectorIni, const string& basePath)
+{
+	string path = getIniValue(rtSelectorIni, RTPS_INI_SECTION_GENERAL, "CompiledRules");
+	if (path.empty())
+		return;
+	if (!isFullPath(path))
+		path = basePath + path;
+	recordDependency(path);
+	rules.compiled = CompiledRules::load(path, rules);
+}
+
+// C++ string literal
+string cppString(const string& text)
+{
+	std::ostringstream literal;
+	literal << '"';
+	for (char c : text)
+	{
+		unsigned char byte = static_cast<unsigned char>(c);
+		if (c == '"' || c == '\\')
+			literal << '\\' << c;
+		else if (byte < 0x20 || byte >= 0x7F || c == '?')		// (no trigraphs)
+			literal << '\\' << std::oct << std::setw(3) << std::setfill('0') << static_cast<int>(byte) << std::dec;
+		else
+			literal << c;
+	}
+	literal << '"';
+	return literal.str();
+}
+
+// C++ double literal (exact)
+string cppDouble(double value)
+{
+	if (value != value)
+		return "std::numeric_limits<double>::quiet_NaN()";
+	if (value == std::numeric_limits<double>::infinity())
+		return "std::numeric_limits<double>::infinity()";
+	if (value == -std::numeric_limits<double>::infinity())
+		return "-std::numeric_limits<double>::infinity()";
+	std::ostringstream literal;
+	literal << std::setprecision(17) << value;
+	string text = literal.str();
+	if (text.find_first_of(".e") == string::npos)
+		text += ".0";
+	return text;
+}
+
+// Same hash as the generated modules' (FNV-1a with a seed), for building their perfect hash tables
+inline uint64_t seededHash(const string& value, uint64_t seed)
+{
+	return hashBytes(value.data(), value.size(), 14695981039346656037ULL ^ (seed * 1099511628211ULL));
+}
+
+// Generates the source of a compiled rules module (see above)
+bool writeCompiledRules(const RuleSet& rules, const string& rulesPath, const string& outputPath)
+{
+	std::ostringstream out;
+	out << "// Compiled rules module generated by \"RTProfileSelector --compile-rules\" from\n"
+		<< "// " << rulesPath << " (" << rules.rules.size() << " rules) - do not edit, generate it again when the rules change.\n"
+		<< "//\n"
+		<< "// Build it into a shared library, then set CompiledRules to its path in RTProfileSelector.ini:\n"
+		<< "//   g++ -O2 -std=c++11 -shared -fPIC -fvisibility=hidden <this file> -o RTProfileSelectorRules.so\n"
+		<< "//   cl /O2 /LD <this file> /Fe:RTProfileSelectorRules.dll\n"
+		<< "\n#include <cstddef>\n#include <cstdint>\n#include <cstring>\n#include <limits>\n\n"
+		<< RTPS_COMPILED_RULES_INTERFACE
+		<< "\n#ifdef _WIN32\n#define RTPS_EXPORT extern \"C\" __declspec(dllexport)\n#else\n"
+		<< "#define RTPS_EXPORT extern \"C\" __attribute__((visibility(\"default\")))\n#endif\n\n"
+		<< "namespace\n{\n\n"
+		<< "inline uint64_t hashValue(const char* data, size_t size, uint64_t seed)\n{\n"
+		<< "	uint64_t hash = 14695981039346656037ULL ^ (seed * 1099511628211ULL);\n"
+		<< "	for (size_t i = 0; i < size; i++)\n"
+		<< "	{\n		hash ^= static_cast<unsigned char>(data[i]);\n		hash *= 1099511628211ULL;\n	}\n"
+		<< "	return hash;\n}\n\n"
+		<< "// complex rule values (alternatives, ranges, negation) don't apply to Exif values with reserved chars\n"
+		<< "inline bool isComplex(const RtpsCompiledField& field)\n{\n"
+		<< "	for (size_t i = 0; i < field.size; i++)\n"
+		<< "		if (field.value[i] == '!' || field.value[i] == '~' || field.value[i] == '|')\n"
+		<< "			return false;\n"
+		<< "	return true;\n}\n";
+
+	// the conditions of the rules and of the group guards
+	std::vector<const std::vector<RuleCondition>*> conditionLists;
+	for (const Rule& rule : rules.rules)
+		conditionLists.push_back(&rule.conditions);
+	for (const RuleGroup& group : rules.groups)
+		conditionLists.push_back(&group.conditions);
+
+	// per key: the values the rules compare it to, interned through a perfect hash table
+	std::vector<std::map<string, int>> valueIds(rules.keys.size());
+	for (const auto* conditions : conditionLists)
+	{
+		for (const RuleCondition& condition : *conditions)
+		{
+			std::map<string, int>& ids = valueIds[condition.key];
+			ids.insert(std::make_pair(condition.value, static_cast<int>(ids.size())));
+			for (const RuleAlternative& alternative : condition.alternatives)
+				if (alternative.kind == RuleAlternative::Exact)
+					ids.insert(std::make_pair(alternative.value, static_cast<int>(ids.size())));
+		}
+	}
+	for (size_t key = 0; key < rules.keys.size(); key++)
+	{
+		std::vector<string> values(valueIds[key].size());
+		for (const auto& id : valueIds[key])
+			values[id.second] = id.first;
+
+		// smallest table (and seed) with no collisions
+		size_t tableSize = 1;
+		while (tableSize < 2 * values.size())
+			tableSize *= 2;
+		uint64_t seed = 0;
+		std::vector<int> slots;
+		for (bool found = false; !found; )
+		{
+			for (seed = 1; seed <= 1000 && !found; seed++)
+			{
+				slots.assign(tableSize, -1);
+				found = true;
+				for (size_t id = 0; id < values.size() && found; id++)
+				{
+					int& slot = slots[seededHash(values[id], seed) & (tableSize - 1)];
+					found = slot < 0;
+					slot = static_cast<int>(id);
+				}
+			}
+			if (!found)
+				tableSize *= 2;
+		}
+		--seed;
+
+		out << "\n// Exif key " << cppString(rules.keys[key].name) << "\n";
+		out << "const char* const values" << key << "[] = {";
+		for (size_t id = 0; id < values.size(); id++)
+			out << (id % 4 == 0 ? "\n\t" : " ") << cppString(values[id]) << ",";
+		out << "\n};\n";
+		out << "const size_t sizes" << key << "[] = {";
+		for (size_t id = 0; id < values.size(); id++)
+			out << (id % 16 == 0 ? "\n\t" : " ") << values[id].size() << ",";
+		out << "\n};\n";
+		// (smallest type holding every value id)
+		const char* slotType = values.size() <= 127 ? "signed char" : values.size() <= 32767 ? "short" : "int";
+		out << "const " << slotType << " slots" << key << "[" << tableSize << "] = {";
+		for (size_t slot = 0; slot < slots.size(); slot++)
+			out << (slot % 16 == 0 ? "\n\t" : " ") << slots[slot] << ",";
+		out << "\n};\n";
+		out << "inline int lookup" << key << "(const RtpsCompiledField& field)\n{\n"
+			<< "	if (field.value == nullptr)\n		return -1;\n"
+			<< "	int id = slots" << key << "[hashValue(field.value, field.size, " << seed << "ULL) & " << tableSize - 1 << "];\n"
+			<< "	return id >= 0 && sizes" << key << "[id] == field.size && memcmp(values" << key << "[id], field.value, field.size) == 0 ? id : -1;\n"
+			<< "}\n";
+
+		const IntervalIndex& ranges = rules.keys[key].ranges;
+		if (ranges.size() != 0)
+		{
+			out << "constexpr double ranges" << key << "[][2] = {";
+			std::vector<std::pair<double, double>> bounds(ranges.size());
+			for (const auto* conditions : conditionLists)
+				for (const RuleCondition& condition : *conditions)
+					if (condition.key == key)
+						for (const RuleAlternative& alternative : condition.alternatives)
+							if (alternative.kind == RuleAlternative::Range)
+								bounds[alternative.interval] = std::make_pair(alternative.low, alternative.high);
+			for (const auto& bound : bounds)
+				out << "\n\t{ " << cppDouble(bound.first) << ", " << cppDouble(bound.second) << " },";
+			out << "\n};\n";
+		}
+	}
+
+	// the rules (interned values and complexity flags are only computed for the keys that need them)
+	std::vector<bool> usesId(rules.keys.size(), false), usesComplex(rules.keys.size(), false);
+	auto writeConditions = [&](std::ostream& body, const std::vector<RuleCondition>& conditions)
+	{
+		for (size_t i = 0; i < conditions.size(); i++)
+		{
+			const RuleCondition& condition = conditions[i];
+			size_t key = condition.key;
+			string rawMatch = "v" + std::to_string(key) + " == " + std::to_string(valueIds[key].at(condition.value));
+			body << (i == 0 ? "" : "\n		&& ") << "(f[" << key << "].value != nullptr && ";
+			if (!rules.useComplexRules)
+			{
+				usesId[key] = true;
+				body << rawMatch;
+			}
+			else
+			{
+				// see RuleEvaluator::matches()
+				string anyAlternative;
+				for (const RuleAlternative& alternative : condition.alternatives)
+				{
+					std::ostringstream term;
+					switch (alternative.kind)
+					{
+					case RuleAlternative::Exact:
+						usesId[key] = true;
+						term << "v" << key << (alternative.negated ? " != " : " == ") << valueIds[key].at(alternative.value);
+						break;
+					case RuleAlternative::Range:
+						term << (alternative.negated ? "!" : "") << "(f[" << key << "].number >= ranges" << key << "[" << alternative.interval 
+							<< "][0] && f[" << key << "].number <= ranges" << key << "[" << alternative.interval << "][1])";
+						break;
+					case RuleAlternative::Regex:
+						term << "f[" << key << "].regexHits[" << alternative.pattern << "]" << (alternative.negated ? " == 0" : " != 0");
+						break;
+					default:
+						continue;		// invalid alternatives never match, not even when negated
+					}
+					anyAlternative += (anyAlternative.empty() ? "" : " || ") + term.str();
+				}
+				if (anyAlternative.empty())
+					anyAlternative = "false";
+				if (condition.regex)
+					body << "(" << anyAlternative << ")";
+				else
+				{
+					usesId[key] = usesComplex[key] = true;
+					body << "(c" << key << " ? (" << anyAlternative << ") : " << rawMatch << ")";
+				}
+			}
+			body << ")";
+		}
+	};
+
+	// group guards, enclosing groups first (see RuleEvaluator::guardPasses())
+	std::ostringstream body;
+	std::vector<size_t> groupOrder, depths(rules.groups.size(), 0);
+	for (size_t group = 0; group < rules.groups.size(); group++)
+	{
+		groupOrder.push_back(group);
+		if (rules.groups[group].valid)
+			for (size_t parent = rules.groups[group].parent; parent != RTPS_RULES_NO_GROUP; parent = rules.groups[parent].parent)
+				depths[group]++;
+	}
+	std::stable_sort(groupOrder.begin(), groupOrder.end(), [&depths](size_t group1, size_t group2) { return depths[group1] < depths[group2]; });
+	for (size_t group : groupOrder)
+	{
+		const RuleGroup& ruleGroup = rules.groups[group];
+		body << "\n	// [" << RTPS_RULES_PRIVATE_KEY_CHAR << ruleGroup.name << "]\n	const bool g" << group << " = ";
+		if (!ruleGroup.valid)
+			body << "false";
+		else
+		{
+			if (ruleGroup.parent != RTPS_RULES_NO_GROUP)
+				body << "g" << ruleGroup.parent << (ruleGroup.conditions.empty() ? "" : "\n		&& ");
+			else if (ruleGroup.conditions.empty())
+				body << "true";
+			writeConditions(body, ruleGroup.conditions);
+		}
+		body << ";\n";
+	}
+
+	for (size_t index = 0; index < rules.rules.size(); index++)
+	{
+		const Rule& rule = rules.rules[index];
+		body << "\n	// [" << rule.section->first << "]\n	m[" << index << "] = ";
+		if (rule.group != RTPS_RULES_NO_GROUP)
+			body << "g" << rule.group << (rule.conditions.empty() ? "" : "\n		&& ");
+		else if (rule.conditions.empty())
+			body << "false";		// rules without conditions never match
+		writeConditions(body, rule.conditions);
+		body << ";\n";
+	}
+
+	out << "\nvoid match(const RtpsCompiledField* f, unsigned char* m)\n{\n";
+	for (size_t key = 0; key < rules.keys.size(); key++)
+	{
+		if (usesId[key])
+			out << "	const int v" << key << " = lookup" << key << "(f[" << key << "]);\n";
+		if (usesComplex[key])
+			out << "	const bool c" << key << " = f[" << key << "].value != nullptr && isComplex(f[" << key << "]);\n";
+	}
+	out << body.str();
+	out << "}\n\n";
+
+	out << "const RtpsCompiledRules rules = { " << RTPS_COMPILED_RULES_ABI << ", \"" << rulesFingerprint(rules) << "\", "
+		<< rules.keys.size() << ", " << rules.rules.size() << ", match };\n\n}\n\n"
+		<< "RTPS_EXPORT const RtpsCompiledRules* " << RTPS_COMPILED_RULES_SYMBOL << "()\n{\n	return &rules;\n}\n";
+
+	std::ofstream file(outputPath);
+	file << out.str();
+	file.close();
+	return !file.fail();
+}
+
+// "RTProfileSelector --compile-rules <file.cpp>": generates the compiled rules module source for the current rules
+int compileRules(const string& basePath, IniMap& rtSelectorIni, const string& outputPath)
+{
+	bool useComplexRules = rtSelectorIni[RTPS_INI_SECTION_GENERAL]["ComplexRulesEnabled"] != "0";
+	string rulesPath = basePath + "RTProfileSelectorRules.ini";
+	IniMultiMap rtSelectorRulesIni = readMultiIni(rulesPath);
+	RuleSet rules(rtSelectorRulesIni, useComplexRules);
+	if (!writeCompiledRules(rules, rulesPath, outputPath))
+	{
+		RTPS_LOG(Error) << "Can't write compiled rules to " << outputPath;
+		std::cerr << "Can't write " << outputPath << "\n";
+		return 1;
+	}
+	RTPS_LOG(Info) << "Compiled " << rules.rules.size() << " rules to " << outputPath;
+	std::cout << "Compiled " << rules.rules.size() << " rules to " << outputPath << "\n";
+	return 0;
+}
+
+// Matches all the conditions of a rule, in the order given by the statistics, stopping at the first that fails
+// Rules of a group whose guard fails are not evaluated (nor counted in the statistics)
+bool matchRule(RuleEvaluator& evaluator, const RuleSet& rules, size_t ruleIndex, RuleStats& stats)
+{
+	const Rule& rule = rules.rules[ruleIndex];
+	if (rule.group != RTPS_RULES_NO_GROUP && !evaluator.guardPasses(rule.group))
+		return false;
+	auto start = stats.profile ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+	bool matched = !rule.conditions.empty() || rule.group != RTPS_RULES_NO_GROUP;		// rules without conditions never match
+	size_t failedCondition = rule.conditions.size();
+	for (size_t condition : stats.conditionOrder(ruleIndex))
+	{
+		bool passed = evaluator.matches(rule.conditions[condition]);
+		stats.recordCondition(ruleIndex, condition, passed);
+		if (!passed)
+		{
+			matched = false;
+			failedCondition = condition;
+			break;
+		}
+	}
+	stats.recordRule(ruleIndex, matched);
+	if (stats.profile)
+		stats.profile->recordRule(ruleIndex, matched, failedCondition, start);
+	return matched;
+}
+
+// Matches full profiles parameter definition sections from RTProfileSelectorRules.ini against the Exif fields from the raw file
+// The section with most keys wins; among sections of the same size, the first one in the file. So sections are
+// tried by decreasing size, and once one matches only the ones of the same size preceding it still need to be tried
+IniMultiMap::const_iterator matchExifFields(const RuleSet& rules, const StrMap &exifFields, RuleStats& stats)
+{
+	TraceSpan traceSpan("match");
+	std::vector<unsigned char> matched;
+	if (rules.compiled != nullptr && !stats.profile && rules.compiled->match(rules, exifFields, matched))
+	{
+		size_t winner = rules.rules.size();
+		for (size_t rule = 0; rule < rules.rules.size(); rule++)
+		{
+			if (matched[rule] && !rules.rules[rule].partial && 
+				(winner == rules.rules.size() || rules.rules[rule].size > rules.rules[winner].size))
+				winner = rule;
+		}
+		return winner == rules.rules.size() ? rules.ini.cend() : rules.rules[winner].section;
+	}
+
+	RuleEvaluator evaluator(rules, exifFields);
+	const std::vector<size_t>& order = stats.fullRuleOrder();
+
+	for (size_t first = 0; first < order.size(); )
+	{
+		// rules of the same size as order[first]
+		size_t size = rules.rules[order[first]].size;
+		size_t last = first;
+		while (last < order.size() && rules.rules[order[last]].size == size)
+			++last;
+
+		size_t winner = rules.rules.size();
+		for (size_t i = first; i < last; i++)
+		{
+			if (order[i] < winner && matchRule(evaluator, rules, order[i], stats))
+				winner = order[i];
+		}
+		if (winner != rules.rules.size())
+			return rules.rules[winner].section;
+		first = last;
+	}
+
+	return rules.ini.cend();
+}
+
+// Matches partial profiles parameter definition sections from RTProfileSelectorRules.ini against the Exif fields from the raw file
+std::vector<IniMultiMap::const_iterator> matchPartialProfiles(const RuleSet& rules, const StrMap &exifFields, RuleStats& stats)
+{
+	TraceSpan traceSpan("partial rules");
+	std::vector<IniMultiMap::const_iterator> matches;						// full-matches found
+	RuleEvaluator evaluator(rules, exifFields);
+	std::vector<unsigned char> matched;
+	bool compiled = rules.compiled != nullptr && !stats.profile && rules.compiled->match(rules, exifFields, matched);
+
+	// let's check all parttial profile sections for matches
+	for (size_t rule = 0; rule < rules.rules.size(); rule++)
+	{
+		if (!rules.rules[rule].partial)				// allow only partial profiles
+			continue;
+
+		// only save the ones that had all keys matched
+		if (compiled ? matched[rule] != 0 : matchRule(evaluator, rules, rule, stats))
+			matches.push_back(rules.rules[rule].section);
+	}
+	return matches;
+}
+
+// Matches all the rules against the Exif fields from the raw file, unless already done for the same values (see MatchCache)
+RuleMatches matchRules(const RuleSet& rules, const StrMap &exifFields, RuleStats& stats)
+{
+	RuleMatches matches;
+	if (stats.profile)
+	{
+		stats.profile->recordImage();
+		matches.baseProfile = matchExifFields(rules, exifFields, stats);
+		matches.partialProfiles = matchPartialProfiles(rules, exifFields, stats);
+		return matches;
+	}
+	string projection = MatchCache::project(rules.keyNames, exifFields);
+	if (rules.matchCache.find(projection, matches))
+		return matches;
+	matches.baseProfile = matchExifFields(rules, exifFields, stats);
+	matches.partialProfiles = matchPartialProfiles(rules, exifFields, stats);
+	rules.matchCache.store(projection, matches);
+	return matches;
+}
+
+// Partial profiles to apply (with their sections), from the matching partial profile sections 
+StrSetVector getPartialProfilesMatches(const IniMap& rtSelectorIni, std::vector<IniMultiMap::const_iterator> matches, RuleProfile* profile)
+{
+	StrSetVector partialProfiles;
+	if (!matches.empty())
+	{
+		// sorts matching profiles according to rank
+		std::sort(begin(matches), end(matches),
+			[](const IniMultiMap::const_iterator& prof1, const IniMultiMap::const_iterator& prof2) -> bool
+			{
+				auto rankIter1 = prof1->second.find(RTPS_RULES_PROFILE_RANK);
+				auto rankIter2 = prof2->second.find(RTPS_RULES_PROFILE_RANK);
+				
+				int rank1 = atoi(rankIter1 == prof1->second.end() ? "0" : rankIter1->second.value.c_str());
+				int rank2 = atoi(rankIter2 == prof2->second.end() ? "0" : rankIter2->second.value.c_str());
+
+				return rank1 < rank2;	// highest rank profile must be applied last
+			}
+		);
+
+		// get pp3 sections to be applied for each matching profile
+		for (auto &matchIter : matches)
+		{
+			auto start = profile != nullptr ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+			string pp3Name = matchIter->first;
+
+			// get profile section set
+			auto profileIter = std::find_if(partialProfiles.begin(), partialProfiles.end(), 
+				[&pp3Name](const StrSetPair& item)
+				{
+					return item.first == pp3Name;
+				}
+			);
+			if (profileIter == partialProfiles.end())
+			{
+				partialProfiles.push_back(StrSetPair(pp3Name, StrSet()));
+				profileIter = std::prev(partialProfiles.end());
+			}
+
+			StrSet& pp3Sections = profileIter->second;
+			auto sectionsValue = matchIter->second.find(RTPS_RULES_PP3_SECTIONS_KEY);
+			string section;
+			std::stringstream ss(sectionsValue->second.value);
+			while (std::getline(ss, section, ','))
+			{
+				// wildcard: use any sections found in the partial profile
+				if (section == RTPS_RULES_SECT_WILDCARD)			
+				{
+					pp3Sections.clear();
+					pp3Sections.insert(section);
+					break;
+				}
+				// an expansion list section: retrieve actual list from RTProfileSelector.ini
+				else if (section[0] == '[' && section[section.length()-1] == ']')	
+				{
+					IniMap::const_iterator sectionsIter = rtSelectorIni.find(section.substr(1, section.length()-2));
+					if (sectionsIter != rtSelectorIni.cend())
+					{
+						for (auto &entry : sectionsIter->second)
+						{
+							if (entry.second.value == "1")			// section is enabled?
+								pp3Sections.insert(entry.first);	// add to profile
+						}
+					}
+				}
+				else
+				{											
+					pp3Sections.insert(section);			// it's a simple section name => just insert it
+				}
+			}
+			if (profile != nullptr)
+				profile->recordResolve(matchIter, start);
+		}	
+	}
+
+	return partialProfiles;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Batch matching
+//
+// When the Exif fields of many images are known at once (as in library mode's manifest), the rules
+// are matched against all of them together. The values of each key used by the rules are laid out
+// in columns, one entry per image: value ids (interned through the values the rules compare the key
+// to, as in the compiled rules), numbers (for ranges) and regular expression hits. Each distinct
+// condition is then evaluated over a whole column at a time, in plain loops the compiler vectorizes,
+// into a bitmap (one bit per image), and the bitmaps of a rule's conditions and guards are ANDed 64
+// images at a time. The full profile rule (the largest matching one) and the partial profile rules
+// of each image are picked from the rules' bitmaps, with the same outcome as matchRules().
+//
+
+#define RTPS_BATCH_IMAGES			1024	// images matched together (multiple of 64)
+#define RTPS_BATCH_MISSING			-1		// value id: key not among the image's Exif fields
+#define RTPS_BATCH_OTHER			-2		// value id: a value no rule compares the key to
+
+class RuleBatch
+{
+public:
+	explicit RuleBatch(const RuleSet& rules) : rules(rules), valueIds(rules.keys.size())
+	{
+		// distinct conditions (the same key and value mean the same outcome), and the values compared to
+		for (const Rule& rule : rules.rules)
+			ruleConditions.push_back(internConditions(rule.conditions));
+		for (const RuleGroup& group : rules.groups)
+			groupConditions.push_back(internConditions(group.conditions));
+
+		// full profile rules by decreasing size, the first one in the file first among the same size
+		for (size_t rule = 0; rule < rules.rules.size(); rule++)
+			if (!rules.rules[rule].partial)
+				fullRules.push_back(rule);
+		std::stable_sort(fullRules.begin(), fullRules.end(), 
+			[&rules](size_t rule1, size_t rule2) { return rules.rules[rule1].size > rules.rules[rule2].size; });
+	}
+
+	// Matches the rules against the images' Exif fields: 'matches' gets one entry per image, and 'matched'
+	// tells which ones were (the others must be matched one by one: a NaN numeric value, see IntervalIndex)
+	void match(const std::vector<const StrMap*>& images, std::vector<RuleMatches>& matches, std::vector<unsigned char>& matched) const
+	{
+		RuleMatches none;
+		none.baseProfile = rules.ini.cend();
+		matches.assign(images.size(), none);
+		matched.assign(images.size(), 1);
+		for (size_t first = 0; first < images.size(); first += RTPS_BATCH_IMAGES)
+			matchChunk(images, first, std::min(images.size(), first + RTPS_BATCH_IMAGES), matches, matched);
+	}
+
+private:
+	typedef std::vector<uint64_t> Bitmap;
+
+	// one key's values for the images of a chunk
+	struct Column
+	{
+		std::vector<int> ids;								// value ids (see RTPS_BATCH_MISSING and RTPS_BATCH_OTHER)
+		std::vector<unsigned char> complex;					// complex rules apply to the value
+		std::vector<double> numbers;						// numeric values (keys used with ranges)
+		std::vector<std::vector<unsigned char>> regexHits;	// per regular expression used with the key
+	};
+
+	std::vector<size_t> internConditions(const std::vector<RuleCondition>& conditions)
+	{
+		std::vector<size_t> ids;
+		for (const RuleCondition& condition : conditions)
+		{
+			auto key = std::make_pair(condition.key, condition.value);
+			auto iter = conditionIds.find(key);
+			if (iter == conditionIds.end())
+			{
+				iter = conditionIds.insert(std::make_pair(key, distinctConditions.size())).first;
+				distinctConditions.push_back(&condition);
+				std::map<string, int>& values = valueIds[condition.key];
+				values.insert(std::make_pair(condition.value, static_cast<int>(values.size())));
+				for (const RuleAlternative& alternative : condition.alternatives)
+					if (alternative.kind == RuleAlternative::Exact)
+						values.insert(std::make_pair(alternative.value, static_cast<int>(values.size())));
+			}
+			ids.push_back(iter->second);
+		}
+		return ids;
+	}
+
+	void matchChunk(const std::vector<const StrMap*>& images, size_t first, size_t last, 
+		std::vector<RuleMatches>& matches, std::vector<unsigned char>& matched) const
+	{
+		size_t count = last - first;
+		size_t words = (count + 63) / 64;
+
+		// the columns
+		std::vector<Column> columns(rules.keys.size());
+		for (size_t key = 0; key < rules.keys.size(); key++)
+		{
+			const RuleKey& ruleKey = rules.keys[key];
+			Column& column = columns[key];
+			column.ids.assign(count, RTPS_BATCH_MISSING);
+			column.complex.assign(count, 0);
+			if (ruleKey.ranges.size() != 0)
+				column.numbers.assign(count, 0.0);
+			if (rules.useComplexRules)
+				column.regexHits.assign(ruleKey.patterns.size(), std::vector<unsigned char>(count, 0));
+			for (size_t image = 0; image < count; image++)
+			{
+				auto value = images[first + image]->find(ruleKey.name);
+				if (value == images[first + image]->end())
+					continue;
+				auto id = valueIds[key].find(value->second);
+				column.ids[image] = id == valueIds[key].end() ? RTPS_BATCH_OTHER : id->second;
+				column.complex[image] = rules.useComplexRules && value->second.find_first_of("!~|") == string::npos;
+				if (ruleKey.ranges.size() != 0)
+				{
+					column.numbers[image] = eval(value->second, 0.0);
+					if (column.numbers[image] != column.numbers[image])
+						matched[first + image] = 0;
+				}
+				if (!column.regexHits.empty())
+				{
+					std::vector<int> hits;
+					ruleKey.patterns.scan(value->second, hits);
+					for (int pattern : hits)
+						column.regexHits[pattern][image] = 1;
+				}
+			}
+		}
+
+		// all the images of the chunk
+		Bitmap all(words, ~static_cast<uint64_t>(0));
+		if (count % 64 != 0)
+			all.back() = (static_cast<uint64_t>(1) << (count % 64)) - 1;
+
+		// conditions, evaluated when first needed
+		std::vector<Bitmap> conditions(distinctConditions.size());
+		std::vector<unsigned char> values(count), terms(count);
+		auto apply = [&](size_t condition, Bitmap& bitmap) -> bool
+		{
+			Bitmap& outcome = conditions[condition];
+			if (outcome.empty())
+			{
+				evaluate(*distinctConditions[condition], columns[distinctConditions[condition]->key], values, terms);
+				outcome.assign(words, 0);
+				for (size_t image = 0; image < count; image++)
+					outcome[image / 64] |= static_cast<uint64_t>(values[image]) << (image % 64);
+			}
+			bool any = false;
+			for (size_t word = 0; word < words; word++)
+				any |= (bitmap[word] &= outcome[word]) != 0;
+			return any;
+		};
+
+		// group guards (see RuleEvaluator::guardPasses())
+		std::vector<Bitmap> guards(rules.groups.size());
+		std::function<const Bitmap&(size_t)> guard = [&](size_t group) -> const Bitmap&
+		{
+			Bitmap& bitmap = guards[group];
+			if (bitmap.empty())
+			{
+				const RuleGroup& ruleGroup = rules.groups[group];
+				bitmap = !ruleGroup.valid ? Bitmap(words, 0) : ruleGroup.parent == RTPS_RULES_NO_GROUP ? all : guard(ruleGroup.parent);
+				bool any = ruleGroup.valid;
+				for (size_t i = 0; any && i < groupConditions[group].size(); i++)
+					any = apply(groupConditions[group][i], bitmap);
+			}
+			return bitmap;
+		};
+
+		// rules
+		std::vector<Bitmap> ruleBitmaps(rules.rules.size());
+		for (size_t index = 0; index < rules.rules.size(); index++)
+		{
+			const Rule& rule = rules.rules[index];
+			Bitmap& bitmap = ruleBitmaps[index];
+			if (rule.conditions.empty() && rule.group == RTPS_RULES_NO_GROUP)
+				continue;		// rules without conditions never match
+			bitmap = rule.group == RTPS_RULES_NO_GROUP ? all : guard(rule.group);
+			bool any = true;
+			for (size_t i = 0; any && i < ruleConditions[index].size(); i++)
+				any = apply(ruleConditions[index][i], bitmap);
+		}
+
+		// per image: the largest full profile rule matched, and the partial profile rules matched (in file order)
+		Bitmap undecided = all;
+		for (size_t rule : fullRules)
+		{
+			const Bitmap& bitmap = ruleBitmaps[rule];
+			for (size_t word = 0; word < bitmap.size(); word++)
+			{
+				uint64_t won = bitmap[word] & undecided[word];
+				undecided[word] &= ~won;
+				for (size_t bit = 0; won != 0; bit++, won >>= 1)
+					if (won & 1)
+						matches[first + word * 64 + bit].baseProfile = rules.rules[rule].section;
+			}
+		}
+		for (size_t rule = 0; rule < rules.rules.size(); rule++)
+		{
+			if (!rules.rules[rule].partial)
+				continue;
+			const Bitmap& bitmap = ruleBitmaps[rule];
+			for (size_t word = 0; word < bitmap.size(); word++)
+				for (size_t bit = 0, bits = bitmap[word]; bits != 0; bit++, bits >>= 1)
+					if (bits & 1)
+						matches[first + word * 64 + bit].partialProfiles.push_back(rules.rules[rule].section);
+		}
+	}
+
+	// Evaluates a condition for all the images of a column, into 'result' (see RuleEvaluator::matches())
+	// 'any' is used for the alternatives
+	void evaluate(const RuleCondition& condition, const Column& column, std::vector<unsigned char>& result, std::vector<unsigned char>& any) const
+	{
+		size_t count = result.size();
+		const int* ids = column.ids.data();
+		unsigned char* out = result.data();
+
+		// direct string comparison (what's left when complex rules are disabled or don't apply to the value)
+		const int rawId = valueIds[condition.key].at(condition.value);
+		for (size_t i = 0; i < count; i++)
+			out[i] = ids[i] == rawId;
+		if (!rules.useComplexRules)
+			return;
+
+		// any alternative matches
+		unsigned char* alternatives = any.data();
+		std::fill(any.begin(), any.end(), 0);
+		for (const RuleAlternative& alternative : condition.alternatives)
+		{
+			const unsigned char negated = alternative.negated ? 1 : 0;
+			switch (alternative.kind)
+			{
+			case RuleAlternative::Exact:
+			{
+				const int id = valueIds[condition.key].at(alternative.value);
+				for (size_t i = 0; i < count; i++)
+					alternatives[i] |= (ids[i] == id) ^ negated;
+				break;
+			}
+			case RuleAlternative::Range:
+			{
+				const double* numbers = column.numbers.data();
+				const double low = alternative.low, high = alternative.high;
+				for (size_t i = 0; i < count; i++)
+					alternatives[i] |= (numbers[i] >= low && numbers[i] <= high) ^ negated;
+				break;
+			}
+			case RuleAlternative::Regex:
+			{
+				const unsigned char* hits = column.regexHits[alternative.pattern].data();
+				for (size_t i = 0; i < count; i++)
+					alternatives[i] |= hits[i] ^ negated;
+				break;
+			}
+			default:
+				break;		// invalid alternatives never match, not even when negated
+			}
+		}
+
+		// regular expressions apply to any value, the other alternatives only where complex rules do;
+		// and nothing matches a missing key
+		const unsigned char* complex = column.complex.data();
+		for (size_t i = 0; i < count; i++)
+		{
+			unsigned char complexMatch = condition.regex ? alternatives[i] : (complex[i] & alternatives[i]) | ((complex[i] ^ 1) & out[i]);
+			out[i] = (ids[i] != RTPS_BATCH_MISSING) & complexMatch;
+		}
+	}
+
+	const RuleSet& rules;
+	std::vector<std::map<string, int>> valueIds;				// per key: ids of the values the rules compare it to
+	std::map<std::pair<size_t, string>, size_t> conditionIds;	// distinct conditions by key and value
+	std::vector<const RuleCondition*> distinctConditions;
+	std::vector<std::vector<size_t>> ruleConditions;			// per rule: its distinct conditions
+	std::vector<std::vector<size_t>> groupConditions;			// per group: its distinct conditions
+	std::vector<size_t> fullRules;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Matcher equivalence check
+//
+// The rules are matched in several ways that must all have the same outcome: evaluated in file
+// order, in the order picked from the statistics (see RuleStats), through the match cache, by the
+// compiled rules module and in batches (see RuleBatch). "RTProfileSelector --check-matchers <folder>"
+// matches them in all these ways against each file of "exiftool -t" output in a folder, and reports
+// the images they disagree on. LatencyHarness' --check-matchers mode generates random rule sets, 
+// statistics and Exif fields, and builds their compiled modules, to run it against.
+//
+
+// Matched rule sections, for reports: "<full profile> | <partial profiles>"
+string describeMatches(const RuleSet& rules, const RuleMatches& matches)
+{
+	std::ostringstream text;
+	text << (matches.baseProfile == rules.ini.cend() ? string("(none)") : matches.baseProfile->first) << " |";
+	for (const auto& partialProfile : matches.partialProfiles)
+		text << " " << partialProfile->first;
+	return text.str();
+}
+
+// "RTProfileSelector --check-matchers <folder>": matches the rules in every way against the Exif fields in the folder
+int checkMatchers(const string& basePath, IniMap& rtSelectorIni, const string& folder)
+{
+	bool useComplexRules = rtSelectorIni[RTPS_INI_SECTION_GENERAL]["ComplexRulesEnabled"] != "0";
+	IniMultiMap rtSelectorRulesIni = readMultiIni(basePath + "RTProfileSelectorRules.ini");
+	RuleSet rules(rtSelectorRulesIni, useComplexRules);
+	RuleSet compiledRules(rtSelectorRulesIni, useComplexRules);		// (same sections: matches compare equal)
+	loadCompiledRules(compiledRules, rtSelectorIni, basePath);
+
+	RuleStats fileOrder(rules);				// no statistics: rules and conditions in file order
+	RuleStats statsOrder(rules);
+	statsOrder.load(basePath + "RTProfileSelectorRules.stats");
+	RuleStats compiledStats(compiledRules);
+
+	std::vector<string> names = listDirectory(folder);
+	std::vector<StrMap> images;
+	for (const string& name : names)
+		images.push_back(readExifOutput(folder + SLASH_CHAR + name));
+	std::vector<const StrMap*> batchImages;
+	for (const StrMap& image : images)
+		batchImages.push_back(&image);
+	std::vector<RuleMatches> batchMatches;
+	std::vector<unsigned char> batched;
+	RuleBatch(rules).match(batchImages, batchMatches, batched);
+
+	size_t mismatches = 0, fullMatches = 0, partialMatches = 0;
+	for (size_t i = 0; i < images.size(); i++)
+	{
+		RuleMatches reference;
+		reference.baseProfile = matchExifFields(rules, images[i], fileOrder);
+		reference.partialProfiles = matchPartialProfiles(rules, images[i], fileOrder);
+		fullMatches += reference.baseProfile != rules.ini.cend() ? 1 : 0;
+		partialMatches += reference.partialProfiles.size();
+
+		std::vector<std::pair<string, RuleMatches>> others;
+		RuleMatches ordered;
+		ordered.baseProfile = matchExifFields(rules, images[i], statsOrder);
+		ordered.partialProfiles = matchPartialProfiles(rules, images[i], statsOrder);
+		others.push_back(std::make_pair("statistics order", ordered));
+		others.push_back(std::make_pair("match cache", matchRules(rules, images[i], statsOrder)));
+		others.push_back(std::make_pair("match cache (hit)", matchRules(rules, images[i], statsOrder)));
+		if (compiledRules.compiled)
+		{
+			RuleMatches compiled;
+			compiled.baseProfile = matchExifFields(compiledRules, images[i], compiledStats);
+			compiled.partialProfiles = matchPartialProfiles(compiledRules, images[i], compiledStats);
+			others.push_back(std::make_pair("compiled rules", compiled));
+		}
+		if (batched[i])
+			others.push_back(std::make_pair("batch", batchMatches[i]));
+
+		for (const auto& other : others)
+		{
+			if (other.second.baseProfile == reference.baseProfile && other.second.partialProfiles == reference.partialProfiles)
+				continue;
+			mismatches++;
+			std::cout << names[i] << ": " << other.first << " matched " << describeMatches(rules, other.second) 
+				<< " instead of " << describeMatches(rules, reference) << "\n";
+		}
+	}
+
+	std::cout << images.size() << " image(s) (" << fullMatches << " with a full profile, " << partialMatches << " partial profiles), " 
+		<< rules.rules.size() << " rule(s), compiled rules " << (compiledRules.compiled ? "checked" : "not checked") << ", " 
+		<< std::count(batched.begin(), batched.end(), 1) << " image(s) batched: " << mismatches << " mismatch(es)\n";
+	return mismatches == 0 ? 0 : 1;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Lazy Exif acquisition ("UseExifTool=lazy")
+//
+// RT's keyfile already carries some of the Exif data ([Common Data] and [EXIF] sections), 
+// which is enough for many rule sets (camera model, ISO...). In lazy mode, matching starts 
+// from the keyfile data, and exiftool is only called when a key missing from it could 
+// change the outcome: a rule that might still match (depending on the missing keys) and
+// could win over the current selection or add a partial profile, or an ISO/lens lookup 
+// that can't be resolved with the keyfile data alone.
+//
+
+// Keyfile fields that have the same value (and format) as exiftool's output, so that rules 
+// written for exiftool can be matched against the keyfile data (not the make and model: RT normalizes
+// them for some makers, e.g. "Nikon" for exiftool's "NIKON CORPORATION")
+static const struct { const char* exiftoolKey; const char* keyfileKey; } keyfileExifKeys[] = {
+	{ EXIF_ISO,				"CommonData.ISO" },
+	{ "Exposure Time",		"8769.829a" },
+	{ "F Number",			"8769.829d" },
+	{ "Orientation",		"0112" },
+};
+
+// Reads Exif fields from RT's keyfile, adding the exiftool names for the keys it provides
+StrMap getKeyfileExifFields(const StrMap& paramsExifFields, const string& basePath)
+{
+	StrMap exifFields = paramsExifFields;
+	for (const auto& key : keyfileExifKeys)
+	{
+		auto iter = exifFields.find(key.keyfileKey);
+		if (iter != exifFields.end() && !iter->second.empty())
+			exifFields[key.exiftoolKey] = iter->second;
+	}
+
+	// exiftool: "Focal Length=12.0 mm"
+	auto focalLength = exifFields.find(EXIF_KEYFILE_FOCAL_LENGTH);
+	if (focalLength != exifFields.end() && eval(focalLength->second, 0.0) != 0.0)
+	{
+		std::stringstream ss;
+		ss << std::setiosflags(std::ios::fixed) << std::setprecision(1) << eval(focalLength->second, 0.0) << " mm";
+		exifFields[EXIF_FOCAL_LENGTH] = ss.str();
+	}
+
+	// RT's model name is exiftool's when there's an ISO or lens profile for it
+	auto model = exifFields.find(EXIF_KEYFILE_MODEL);
+	if (model != exifFields.end() && hasCameraProfile(basePath, model->second))
+		exifFields[EXIF_CAMERA_MODEL] = model->second;
+
+	// RT's lens name is not always the same as exiftool's "Lens ID", so only use it when there's 
+	// a lens profile for that name 
+	auto lens = exifFields.find(EXIF_KEYFILE_LENS);
+	if (lens != exifFields.end() && hasLensProfile(basePath, lens->second))
+		exifFields[EXIF_LENS_ID] = lens->second;
+
+	return exifFields;
+}
+
+// Checks whether exiftool must be called because the fields known (from the keyfile or a sidecar) are not enough
+// to select the profiles
+// 'reason' tells why, for the log
+bool exifToolNeeded(const RuleSet& rules, const StrMap& knownFields, const string& basePath, string& reason)
+{
+	RuleEvaluator evaluator(rules, knownFields);
+
+	// full profiles: the current winner (largest matching section) can only change if some 
+	// undecided section is at least as large
+	size_t winnerSize = 0;
+	std::vector<const Rule*> undecided;
+	for (const Rule& rule : rules.rules)
+	{
+		RuleMatch match = evaluator.matchesKnown(rule);
+		if (match == RuleMatch::Unknown)
+			undecided.push_back(&rule);
+		else if (match == RuleMatch::Yes && !rule.partial)
+			winnerSize = std::max(winnerSize, rule.size);
+	}
+	for (const Rule* rule : undecided)
+	{
+		if (rule->partial || rule->size >= winnerSize)
+		{
+			reason = "rule [" + rule->section->first + "] depends on keys not found";
+			return true;
+		}
+	}
+
+	// ISO profile: needs camera model and ISO (if there are ISO profiles at all)
+	auto model = knownFields.find(EXIF_CAMERA_MODEL);
+	if ((model == knownFields.end() || knownFields.find(EXIF_ISO) == knownFields.end()) && 
+		hasProfiles(basePath + ISO_PROFILE_DIR, "iso.", string()))
+	{
+		reason = "camera model or ISO not found (ISO profiles)";
+		return true;
+	}
+
+	// lens profile: without the lens ID, the lookup falls back to the camera model profile, 
+	// which is only fine if there are no other lens profiles it could have found
+	if (knownFields.find(EXIF_LENS_ID) == knownFields.end() && 
+		hasProfiles(basePath + LENS_PROFILE_DIR, "lens.", model == knownFields.end() ? string() : "lens." + safeFileName(model->second) + ".ini"))
+	{
+		reason = "lens not identified (lens profiles)";
+		return true;
+	}
+
+	return false;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Functions for applying partial profiles after the default profile has been selected
+//
+
+// ISO profile associations file for an image's camera ("ISO Profiles/iso.<camera model>.ini"), and its ISO
+// (false if either is unknown)
+bool getISOProfileIni(const string& basePath, const StrMap& exifFields, string& iniPath, int& iso)
+{
+	// let's find camera model and ISO setting 
+	auto cameraModelIter = exifFields.find(EXIF_CAMERA_MODEL);
+	if (cameraModelIter == exifFields.cend())
+		return false;
+
+	auto isoIter = exifFields.find(EXIF_ISO);
+	if (isoIter == exifFields.cend())
+		return false;
+
+	string isoStr = isoIter->second;
+	iso = std::stoi(isoStr);
+	if (iso <= 0)					// ISO must be a valid non-zero value
+		return false;
+
+	iniPath = basePath + ISO_PROFILE_DIR + SLASH_CHAR + "iso." + safeFileName(cameraModelIter->second) + ".ini";
+	return true;
+}
+
+// ISO profile (.pp3 name) for an ISO, from a camera's ISO profile associations (empty if none)
+string selectISOProfile(const IniMap& isoProfileIni, int iso)
+{
+	// ISO-pp3 association section within camera ini file
+	auto isoProfileSection = isoProfileIni.find("Profiles");
+	if (isoProfileSection == isoProfileIni.cend() || isoProfileSection->second.empty())
+		return string();
+
+	// make map of ISO as int values vs. .pp3 name
+	std::map<int, string> isoProfiles;
+	for (const auto& i : isoProfileSection->second)
+		isoProfiles[std::stoi(i.first)] = i.second.value;
+
+	// look up for ISO match
+	auto isoSearch = isoProfiles.lower_bound(iso);
+	if (isoSearch == isoProfiles.begin() && isoSearch->first != iso)	// image ISO is lesser than first entry -> no partial .pp3 to select
+		return string();
+
+	// ISO is either a match or above an existing entry => proceed
+	string isoProfileName;
+	if (isoSearch == isoProfiles.end() || isoSearch->first != iso)
+		isoProfileName = (--isoSearch)->second;		// pick up .pp3 from lesser ISO entry
+	else
+		isoProfileName = isoSearch->second;			// exact match for ISO
+
+	// makes sure any reverse slash is converted to current OS slash
+	return convertoToCurrentOSPath(isoProfileName);
+}
+
+// Lens profile files to try for an image, in order: for its lens ("Lens ID", or else "Lens Type"), then for its
+// camera model
+std::vector<string> lensProfileCandidates(const string& basePath, const StrMap& exifFields)
+{
+	std::vector<string> candidates;
+	// I noticed there's also a "Lens Type" field, don't know which is best or standard
+	auto lensIdIter = exifFields.find(EXIF_LENS_ID);
+	if (lensIdIter == exifFields.cend())		
+		lensIdIter = exifFields.find(EXIF_LENS_TYPE);
+	// look for lens' INI file: ./Lens Profiles/lens.<Lens ID>.ini (or else, "camera model" instead)
+	for (auto iter : { lensIdIter, exifFields.find(EXIF_CAMERA_MODEL) })
+	{
+		if (iter != exifFields.cend())
+			candidates.push_back(basePath + LENS_PROFILE_DIR + SLASH_CHAR + "lens." + safeFileName(iter->second) + ".ini");
+	}
+	return candidates;
+}
+
+// With "ConcurrentReads=1", all the files a profile is built from (partial, ISO and lens profiles, and the base
+// profile) are requested at once while alive, each read by a thread of its own, instead of one after the other:
+// on a network drive, building a profile then takes about the time of the slowest read, not of all of them. The
+// files are still applied one after the other, in the same order and exactly as if read then (readIni() takes the
+// ones read ahead); files read ahead in vain (e.g. an ISO profile found in RT's folder, so not needed from ours)
+// are just dropped. The ISO profile, which depends on the ISO profile associations file, is requested as soon as
+// that one is read.
+class ProfileReadAhead
+{
+public:
+	ProfileReadAhead(bool enabled, const string& basePath, const string& rtCustomProfilesPath, const StrMap& exifFields, 
+					 const StrSetVector& partialProfilesList, const string& baseProfileFileName) : previous(current)
+	{
+		if (!enabled)
+			return;
+		current = this;
+		try
+		{
+			start(basePath, rtCustomProfilesPath, exifFields, partialProfilesList, baseProfileFileName);
+		}
+		catch (...)
+		{	// (e.g. a malformed ISO value) the destructor won't run: undo what it would
+			current = previous;
+			waitForReads();
+			throw;
+		}
+	}
+
+	~ProfileReadAhead() 
+	{ 
+		current = previous;
+		waitForReads();
+	}
+
+	// the contents of a file read ahead by the current thread's read-ahead, if any (once)
+	static bool takeIni(const string& path, IniMap& ini)
+	{
+		if (current == nullptr)
+			return false;
+		std::future<IniMap> read;
+		{
+			std::lock_guard<std::mutex> lock(current->mutex);
+			auto found = current->inis.find(path);
+			if (found == current->inis.end())
+				return false;
+			read = std::move(found->second);
+			current->inis.erase(found);
+		}
+		ini = read.get();
+		return true;
+	}
+
+	// the base profile, if read ahead by the current thread's read-ahead (false if not found)
+	static bool takeBaseProfile(string& text, bool& found)
+	{
+		if (current == nullptr || !current->baseProfile.valid())
+			return false;
+		std::pair<bool, string> read = current->baseProfile.get();
+		found = read.first;
+		text = std::move(read.second);
+		return true;
+	}
+
+private:
+	ProfileReadAhead(const ProfileReadAhead&);
+	ProfileReadAhead& operator=(const ProfileReadAhead&);
+
+	void start(const string& basePath, const string& rtCustomProfilesPath, const StrMap& exifFields, 
+			   const StrSetVector& partialProfilesList, const string& baseProfileFileName)
+	{
+		for (auto& profileItem : partialProfilesList)
+			readAhead(rtCustomProfilesPath + SLASH_CHAR + profileItem.first);
+
+		string isoIniPath;
+		int iso = 0;
+		if (getISOProfileIni(basePath, exifFields, isoIniPath, iso))
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			const TextEncoding* encoding = textEncoding;
+			inis[isoIniPath] = std::async(std::launch::async, [=]() -> IniMap {
+				EncodingScope encodingScope(encoding);
+				IniMap isoProfileIni = readIni(isoIniPath);
+				string isoProfileName = selectISOProfile(isoProfileIni, iso);
+				if (!isoProfileName.empty())
+				{
+					readAhead(rtCustomProfilesPath + SLASH_CHAR + isoProfileName);
+					readAhead(basePath + ISO_PROFILE_DIR + SLASH_CHAR + isoProfileName);
+				}
+				return isoProfileIni;
+			});
+		}
+
+		for (const string& lensFileName : lensProfileCandidates(basePath, exifFields))
+			readAhead(lensFileName);
+
+		baseProfile = std::async(std::launch::async, [baseProfileFileName]() -> std::pair<bool, string> {
+			std::ifstream file(baseProfileFileName, std::ios::binary);
+			bool found = file.good();
+			std::ostringstream contents;
+			if (found)
+				contents << file.rdbuf();
+			return std::make_pair(found, contents.str());
+		});
+	}
+
+	// waits for the reads not taken (one may still request another)
+	void waitForReads()
+	{
+		for (;;)
+		{
+			std::future<IniMap> read;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (inis.empty())
+					break;
+				read = std::move(inis.begin()->second);
+				inis.erase(inis.begin());
+			}
+			read.wait();
+		}
+	}
+
+	void readAhead(const string& path)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		const TextEncoding* encoding = textEncoding;
+		if (inis.count(path) == 0)
+			inis[path] = std::async(std::launch::async, [path, encoding]() {
+				EncodingScope encodingScope(encoding);
+				return readIni(path);
+			});
+	}
+
+	static thread_local ProfileReadAhead* current;	// (readers' threads only read their own files)
+	ProfileReadAhead* previous;
+	std::mutex mutex;
+	std::map<string, std::future<IniMap>> inis;		// not taken yet
+	std::future<std::pair<bool, string>> baseProfile;
+};
+
+thread_local ProfileReadAhead* ProfileReadAhead::current = nullptr;
+
+bool takeReadAhead(const string& path, IniMap& ini)
+{
+	return ProfileReadAhead::takeIni(path, ini);
+}
+
+// Fills profile sections from rules-based partial profiles
+bool getRulesPartialProfiles(const string& rtCustomProfilesPath, const StrSetVector& partialProfilesList, IniMap& partialProfile)
+{
+	TraceSpan traceSpan("partial profiles");
+	// for each partial profile, read sections and values
+	for (auto &profileItem : partialProfilesList)
+	{
+		// read pp3 file
+		string fileName = rtCustomProfilesPath + SLASH_CHAR + profileItem.first;
+		IniMap pp3Ini = readIni(fileName);
+		if (pp3Ini.empty())
+			continue;
+
+		RTPS_LOG(Info) << "Including partial profile: " << fileName;
+
+		// filter for which sections are to be copied
+		const StrSet& filterSections = profileItem.second;
+		bool copyAllSections = filterSections.find(RTPS_RULES_SECT_WILDCARD) != filterSections.end();
+
+		// copy sections from .pp3 profile to partial profile map
+		for (auto& section : pp3Ini)
+		{
+			if (copyAllSections ||											// all sections are to be copied
+				filterSections.find(section.first) != filterSections.end())	// filter => copy only enabled sections
+			{
+				// new behaviour (issue #2): only existing values from correspending keys will be overwriten
+				auto& sectionMap = partialProfile[section.first];
+				for (auto entry : section.second)
+					sectionMap[entry.first] = entry.second;
+			}
+		}
+	}
+
+	return true;
+}
+
+// Fills profile sections from ISO-based profiles
+bool getISOPartialProfile(const string& basePath, const string& rtCustomProfilesPath, const IniMap& rtSelectorIni, const StrMap& exifFields, IniMap& partialProfile)
+{
+	TraceSpan traceSpan("iso profile");
+	// ini with ISO-pp3 profile associations for current camera
+	string isoIniPath;
+	int iso = 0;
+	if (!getISOProfileIni(basePath, exifFields, isoIniPath, iso))
+		return false;
+	IniMap isoProfileIni = readIni(isoIniPath);
+	if (isoProfileIni.empty())
+		return false;
+
+	// check that there's a non-empty .pp3 name
+	string isoProfileName = selectISOProfile(isoProfileIni, iso);
+	if (isoProfileName.empty())
+		return false;
+
+	// first look for .pp3 file in RT's custom profiles folder
+	IniMap partialIsoIni = readIni(rtCustomProfilesPath + SLASH_CHAR + isoProfileName);
+	// if not found, look in RTPS's "ISO Profiles" folder 
+	if (partialIsoIni.empty())
+		partialIsoIni = readIni(basePath + ISO_PROFILE_DIR + SLASH_CHAR + isoProfileName);
+	// partial profile empty => nothing to do
+	if (partialIsoIni.empty())
+		return false;
+
+	// user may also have declared filter for which sections are to be copied
+	const EntryMap* isoSections = nullptr;
+	auto isoSectionsIter = rtSelectorIni.find(RTPS_INI_SECTION_ISO);
+	if (isoSectionsIter != rtSelectorIni.cend())
+		isoSections = &isoSectionsIter->second;
+		
+	RTPS_LOG(Info) << "ISO = " << iso;
+	RTPS_LOG(Info) << "Including ISO profile: " << isoProfileName;
+
+	// copy sections from .pp3 profile to partial profile map
+	for (auto& section : partialIsoIni)
+	{
+		EntryMap::const_iterator filterSection;
+		if ((isoSections == nullptr) ||									// no filter => all sections are copied
+			((filterSection = isoSections->find(section.first)) != isoSections->end()
+			&& filterSection->second.value == "1"))							// filter => copy only enabled sections
+		{
+			partialProfile[section.first] = std::move(section.second);	// transfer whole section to destination profile
+		}
+	}
+
+	return true;
+}
+
+
+// Attempts to calculate a distortion amount for the current lens and focal length, based on our simple 
+// "lens profile" INI file
+bool getLensPartialProfile(const string& basePath, const StrMap& exifFields, IniMap& partialProfile)
+{
+	TraceSpan traceSpan("lens profile");
+	// map with lens profile entries
+	IniMap lensProfileIni;
+
+	// try to read lens INI file (or else, the "camera model" one)
+	string lensFileName;
+	for (const string& candidate : lensProfileCandidates(basePath, exifFields))
+	{
+		lensFileName = candidate;
+		lensProfileIni = readIni(lensFileName);
+		if (!lensProfileIni.empty())
+			break;
+	}
+	if (lensProfileIni.empty())
+		return false;
+
+	RTPS_LOG(Info) << "Checking lens ini file: " << lensFileName << "...";
+
+	// look for RT's [LensProfile] section
+	auto lensProfileSection = lensProfileIni.find(PP3_LENS_PROFILE_SECTION);
+	if (lensProfileSection != lensProfileIni.cend() && !lensProfileSection->second.empty())
+	{
+		auto lcpfile = lensProfileSection->second.find(PP3_LENS_PROFILE_KEY);
+		if (lcpfile != lensProfileSection->second.end())
+			lcpfile->second = adjustRTOutputSlashes(lcpfile->second);
+		partialProfile[PP3_LENS_PROFILE_SECTION] = lensProfileSection->second;
+		RTPS_LOG(Info) << "Lens file using [" << PP3_LENS_PROFILE_SECTION << "] section";
+		return true;
+	}
+
+	// locate [Distortion] section
+	auto lensDistortionSection = lensProfileIni.find(PP3_DISTORTION_SECTION);
+	if (lensDistortionSection == lensProfileIni.cend() || lensDistortionSection->second.empty())
+	{
+		RTPS_LOG(Error) << "File does not contain [" << PP3_DISTORTION_SECTION << "] section";
+		return false;
+	}
+
+	// now looks for focal length
+	// note: for Panasonic GM1 raw file I noticed exiftool outputs two lines as "Focal Length" 
+	// but since we're using a std::map, only the first occurrence will be preserved
+	auto focalLengthIter = exifFields.find(EXIF_FOCAL_LENGTH);
+	if (focalLengthIter == exifFields.cend())
+	{
+		RTPS_LOG(Error) << "EXIF does not contain \"" << EXIF_FOCAL_LENGTH << "\" field";
+		return false;
+	}
+
+	string focalLengthStr = focalLengthIter->second;
+	size_t mmPos = focalLengthStr.find("mm");			// not sure unit will always be "mm", let's hope it will
+	if (mmPos == string::npos)
+	{
+		RTPS_LOG(Error) << "Invalid unit for EXIF field \"" << EXIF_FOCAL_LENGTH << "\" (" <<  focalLengthStr << ")";
+		return false;
+	}
+
+	focalLengthStr = focalLengthStr.substr(0, mmPos);
+	double focalLength = std::stod(focalLengthStr);		// finally the focal length as a double
+	if (focalLength == 0.0)
+	{
+		RTPS_LOG(Error) << "Invalid EXIF field \"" << EXIF_FOCAL_LENGTH << "\" value (" <<  focalLengthStr << ")";
+		return false;
+	}
+
+	// convert all values to double for proper sorting and maths
+	std::map<double, double> flDistortionValues;
+	for (const auto& i : lensDistortionSection->second)
+		flDistortionValues[std::stod(i.first)] = std::stod(i.second);
+
+	double amount = 0;
+	auto bestMatchIter = flDistortionValues.find(focalLength);
+	if (bestMatchIter != flDistortionValues.end())	
+	{
+		amount = bestMatchIter->second;			// lens profile has the exact fl key, so we're done
+	}
+	else
+	{
+		// can't find exact fl key, so we try to get as close a value as possible
+		bestMatchIter = flDistortionValues.lower_bound(focalLength);
+		if (bestMatchIter == flDistortionValues.begin())		// fl lesser than min => simply use its amount
+			amount = bestMatchIter->second;
+		else if (bestMatchIter == flDistortionValues.end())		// fh greater than max => simply use its amount
+			amount = (--flDistortionValues.end())->second;
+		else
+		{
+			// if we got here, current fl is in-between two values from our lens profile
+			auto previousEntry = bestMatchIter;
+			--previousEntry;
+			double fl1 = previousEntry->first;
+			double amt1 = previousEntry->second;
+			double fl2 = bestMatchIter->first;
+			double amt2 = bestMatchIter->second;
+			// interpolate amount between the two closest focal lengths
+			amount = amt1 + ((focalLength - fl1) / (fl2 - fl1)) * (amt2 - amt1);	
+		}
+	}
+
+	// last sanity check
+	if (amount == 0.0)
+		return false;
+
+	// convert to string and sets partial profile with distortion amount
+	std::stringstream ss;
+	ss << std::setiosflags(std::ios::fixed) << std::setprecision(3) << amount;
+	IniValue& distortion = partialProfile[PP3_DISTORTION_SECTION][PP3_DISTORTION_AMOUNT];
+	distortion = ss.str();
+	distortion.source = SourceTable::intern("calculated from " + lensFileName);
+	distortion.line = 0;
+	RTPS_LOG(Info) << "Processed lens distortion info file : " << lensFileName;
+	RTPS_LOG(Info) << "Calculated distortion value = " << ss.str();
+
+	return true;
+}
+
+// Applies partial profiles to the base profile, building the resulting profile (and a copy of it with
+// the source of each entry) in memory
+// Currently partial information can be filled in from partial rules, lens-based distortion profile, or Camera/ISO based partial profiles
+bool buildProfile(	const string& basePath, const string& rtCustomProfilesPath, const IniMap& rtSelectorIni, 
+					const StrMap& exifFields, const StrSetVector& partialProfilesList, 
+					const string& baseProfileFileName, string& profile, string& debugProfile)
+{
+	TraceSpan traceSpan("merge");
+	ProfileReadAhead readAhead(getIniValue(rtSelectorIni, RTPS_INI_SECTION_GENERAL, "ConcurrentReads") == "1", 
+		basePath, rtCustomProfilesPath, exifFields, partialProfilesList, baseProfileFileName);
+
+	// map of partial settings 
+	IniMap partialProfile;
+
+	// first: cascadingly apply partial profiles matched directly from rules
+	getRulesPartialProfiles(rtCustomProfilesPath, partialProfilesList, partialProfile);
+
+	// second: ISO-specific partial profile (selected based on nearest ISO sensitivity value)
+	// note: if matched, ovewrites any corresponding entries and sections obtained from rule-bases profiles (above)
+	getISOPartialProfile(basePath, rtCustomProfilesPath, rtSelectorIni, exifFields, partialProfile);
+	
+	// third: distortion amount for current lens and focal length (crudely calculated by interpolating values from user-defined INI-format lens profile)
+	// note: if matched, ovewrites any corresponding entries and sections obtained from rule-bases profiles (above)	
+	getLensPartialProfile(basePath, exifFields, partialProfile);
+
+	// erase any version info from partial profiles: will copy [Version] section later from main profile
+	partialProfile.erase(PP3_VERSION_SECTION);
+
+	// sections merged from partial profile
+	std::set<string> mergedPP3Sections;
+	
+	// input & output files
+	recordDependency(baseProfileFileName);
+	string baseProfileText;
+	bool baseProfileFound = false;
+	if (!ProfileReadAhead::takeBaseProfile(baseProfileText, baseProfileFound))
+	{
+		std::ifstream baseProfileFile(baseProfileFileName, std::ios::binary);
+		baseProfileFound = baseProfileFile.good();
+		std::ostringstream contents;
+		if (baseProfileFound)
+			contents << baseProfileFile.rdbuf();
+		baseProfileText = contents.str();
+	}
+	if (!baseProfileFound)
+	{
+		RTPS_LOG(Error) << "Error opening base profile file: " << baseProfileFileName;
+		return false;
+	}
+	std::istringstream profileFile(baseProfileText);
+	
+	// output streams for profile generation and debugging
+	std::ostringstream tempStream;
+	std::ostringstream debugStream;
+	
+	// lambda for writing entry to destination & debug files
+	std::map<uint32_t, string> sourceNames;		// (resolved once per file)
+	auto writeEntry = [&](const IniEntry& entry)
+	{
+		tempStream << entry.first << "=" << entry.second.value << "\n";		// key=value
+		auto sourceName = sourceNames.find(entry.second.source);
+		if (sourceName == sourceNames.end())
+			sourceName = sourceNames.insert(std::make_pair(entry.second.source, SourceTable::name(entry.second.source))).first;
+		debugStream << "; source: " << sourceName->second;					// print source PP3 file (and line) for each entry
+		if (entry.second.line != 0)
+			debugStream << ", line " << entry.second.line;
+		debugStream << "\n" << entry.first << "=" << entry.second.value << "\n";	// key=value
+	};
+
+	// lambda for writing non-entry line to destination & debug files
+	auto writeLine = [&](const string& line = "")
+	{
+		tempStream << line << "\n";
+		debugStream << line<< "\n";
+	};
+
+	// parse sections & entries from "full" profile file
+	EntryMap partialSection;
+	string line, sectionName;
+	uint32_t baseProfileSource = SourceTable::intern(baseProfileFileName);
+	uint32_t lineNumber = 0;
+	while (std::getline(profileFile, line))
+	{
+		lineNumber++;
+		removeReturnChar(line);
+		// check if line is the start of a new section
+		if (parseSection(line, sectionName))
+		{
+			// new section detected => dumps entries (if any) from previous section 
+			for (auto& entry : partialSection)
+				writeEntry(entry);
+			partialSection.clear();
+
+			// looks for a section of the same name in the partial profile
+			auto sectionFromPartial = partialProfile.find(sectionName);
+			if (sectionFromPartial != partialProfile.end())
+			{	// new behaviour (issue #2): "partial" section from partial profile will be merged into existing section (see below)
+				partialSection = sectionFromPartial->second;
+				partialProfile.erase(sectionFromPartial);
+			}
+		}
+		// there's a valid section name
+		if (!sectionName.empty())
+		{
+			// parse line as KEY=VALUE 
+			IniEntry entry;
+			if (parseEntry(line, entry))
+			{	
+				entry.second.source = baseProfileSource;
+				entry.second.line = lineNumber;
+				// current line is a valid entry: check if current partial section contains the key
+				auto iter = partialSection.find(entry.first);
+				if (iter != partialSection.end())
+				{	// new behaviour (issue #2): current key found in partial section => use its value instead
+					writeEntry(*iter);
+					partialSection.erase(iter);
+				}
+				else
+				{	// copy original entry to output
+					writeEntry(entry);
+				}
+			}
+			else
+			{	// not valid entry (comment, blank line...) => copy original line to output 
+				writeLine(line);
+			}
+		}
+	}
+	// dumps entries (if any) remaining from current "partial section" 
+	for (auto& entry : partialSection)
+		writeEntry(entry);
+	writeLine();
+
+	// insert remaining sections not found in the "full" profile
+	for (auto& section : partialProfile)
+	{
+		// [section name]
+		writeLine("[" + section.first + "]");
+		for (auto& entry : section.second)
+			writeEntry(entry);
+		writeLine();
+	}
+
+	profile = tempStream.str();
+	debugProfile = debugStream.str();
+	return true;
+}
+
+// Saves a generated profile, replacing the destination file (if any) only once it's complete
+bool writeProfileFile(const string& outputProfileFileName, const string& profile)
+{
+	TraceSpan traceSpan("write");
+	// save generated profile to temp file
+	string tempFileName = outputProfileFileName + ".tmp";
+	std::ofstream tempFile(tempFileName);
+	if (!tempFile.good())
+	{
+		RTPS_LOG(Error) << "Error creating temporary output profile file: " << tempFileName;
+		return false;
+	}
+	tempFile << profile;	
+	tempFile.close();
+
+	// replace destination file (if any) with generated profile
+	remove(outputProfileFileName.c_str());	
+	if (rename(tempFileName.c_str(), outputProfileFileName.c_str()) != 0)
+	{
+		RTPS_LOG(Error) << "Error renaming temp file to destination file: " << tempFileName << " -> " << outputProfileFileName;
+		return false;
+	}
+	return true;
+}
+
+// Saves copies of the last generated profile (and its debug version) in RTPS's folder
+void saveLastProfileFiles(const string& basePath, const string& baseProfileFileName, const string& outputProfileFileName, 
+						  const string& profile, const string& debugProfile)
+{
+	// we don't really care if the debug file was succesfuly saved or not 
+	// there might be problems with non-exclusive access to the file in case multiple 
+	// instances of RTPS are executed simultaneously, but the debug file is really only 
+	// meant to be used for profiles & rules tuning and debugging, which only makes sense 
+	// for a single image at a time...  
+	std::ofstream debugFile(basePath + "LastProfileDebug.txt");
+	debugFile << "; Base profile file: " << baseProfileFileName << "\n";
+	debugFile << "; Output profile file: " << outputProfileFileName << "\n\n";	
+	debugFile << debugProfile;
+	
+	std::ofstream profileCopyFile(basePath + "LastProfile.txt");
+	profileCopyFile << profile;	
+}
+
+// Applies partial profiles to the selected destination profile and saves it
+bool applyPartialProfiles(  const string& basePath, const string& rtCustomProfilesPath, const IniMap& rtSelectorIni, 
+							const StrMap& exifFields, const StrSetVector& partialProfilesList, 
+							const string& baseProfileFileName, const string& outputProfileFileName, bool saveDebugFiles = true)
+{
+	string profile, debugProfile;
+	if (!buildProfile(basePath, rtCustomProfilesPath, rtSelectorIni, exifFields, partialProfilesList, baseProfileFileName, profile, debugProfile)
+		|| !writeProfileFile(outputProfileFileName, profile))
+		return false;
+
+	if (saveDebugFiles)
+		saveLastProfileFiles(basePath, baseProfileFileName, outputProfileFileName, profile, debugProfile);
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Bulk profile output (library mode)
+//
+// Generated profiles are queued and written in batches: each is written to "<profile>.tmp", 
+// optionally synced to disk ("LibrarySync=1"), and renamed into place (the rename replaces the 
+// previous profile). On Linux, io_uring (5.11 or later) runs each step for a whole batch with a
+// single system call; elsewhere, or if the kernel doesn't support it, the files are written one
+// by one with plain system calls (still fewer than through std::ofstream). "LibraryOutput" forces 
+// a backend: "uring" or "portable" (default: "auto"). With a profile store, profiles are
+// written from it instead (see ProfileStore).
+//
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+// IORING_OP_RENAMEAT and IORING_FEAT_NATIVE_WORKERS came with Linux 5.11/5.12 headers
+#ifdef IORING_FEAT_NATIVE_WORKERS
+#define RTPS_HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+#endif
+
+#define RTPS_OUTPUT_BATCH			64
+
+// A profile file to write
+struct OutputFile
+{
+	string path;
+	string contents;
+	bool ok;
+
+	OutputFile(const string& path, string contents) : path(path), contents(std::move(contents)), ok(false) {}
+};
+
+// Writes batches of profile files (an instance per thread)
+class ProfileWriter
+{
+public:
+	explicit ProfileWriter(bool sync) : sync(sync), syscalls(0), files(0), seconds(0) {}
+	virtual ~ProfileWriter() {}
+
+	virtual const char* name() const = 0;
+
+	// writes the files, setting their 'ok' flag
+	void write(std::vector<OutputFile>& batch)
+	{
+		auto start = std::chrono::steady_clock::now();
+		writeBatch(batch);
+		seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		files += batch.size();
+	}
+
+	unsigned long syscallCount() const { return syscalls; }
+	unsigned long fileCount() const { return files; }
+	double elapsed() const { return seconds; }
+
+protected:
+	virtual void writeBatch(std::vector<OutputFile>& batch) = 0;
+
+	bool sync;
+	unsigned long syscalls;
+
+private:
+	unsigned long files;
+	double seconds;
+};
+
+// One file at a time, with plain system calls
+// Writes a file through a temporary file renamed into place (which replaces the previous file, if any),
+// optionally synced to disk; the system calls made are added to 'syscalls'
+bool writeOutputFile(const string& path, const string& tempPath, const string& contents, bool sync, unsigned long& syscalls)
+{
+#ifdef _WIN32
+	FILE* out = fopen(tempPath.c_str(), "wb");
+	syscalls++;
+	if (out == nullptr)
+		return false;
+	bool ok = fwrite(contents.data(), 1, contents.size(), out) == contents.size() && fflush(out) == 0;
+	syscalls++;
+	if (ok && sync)
+	{
+		ok = FlushFileBuffers(reinterpret_cast<HANDLE>(_get_osfhandle(_fileno(out)))) != 0;
+		syscalls++;
+	}
+	ok = fclose(out) == 0 && ok;
+	syscalls++;
+	ok = ok && MoveFileExA(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+	syscalls++;
+#else
+	int fd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	syscalls++;
+	if (fd < 0)
+		return false;
+	bool ok = true;
+	for (size_t written = 0; ok && written < contents.size(); )
+	{
+		ssize_t count = ::write(fd, contents.data() + written, contents.size() - written);
+		syscalls++;
+		ok = count > 0;
+		written += ok ? static_cast<size_t>(count) : 0;
+	}
+	if (ok && sync)
+	{
+		ok = fsync(fd) == 0;
+		syscalls++;
+	}
+	ok = close(fd) == 0 && ok;
+	syscalls++;
+	ok = ok && rename(tempPath.c_str(), path.c_str()) == 0;
+	syscalls++;
+#endif
+	if (!ok)
+		remove(tempPath.c_str());
+	return ok;
+}
+
+class PortableProfileWriter : public ProfileWriter
+{
+public:
+	explicit PortableProfileWriter(bool sync) : ProfileWriter(sync) {}
+
+	const char* name() const { return "portable"; }
+
+protected:
+	void writeBatch(std::vector<OutputFile>& batch)
+	{
+		for (auto& file : batch)
+			file.ok = writeOutputFile(file.path, file.path + ".tmp", file.contents, sync, syscalls);
+	}
+};
+
+#ifdef RTPS_HAVE_IO_URING
+// Whole batches per system call, through io_uring: all the opens, then all the writes (each 
+// linked to its fsync, if any, and close), then all the renames
+class UringProfileWriter : public ProfileWriter
+{
+public:
+	explicit UringProfileWriter(bool sync) : ProfileWriter(sync), ringFd(-1), sqRing(MAP_FAILED), cqRing(MAP_FAILED), sqes(MAP_FAILED) {}
+
+	~UringProfileWriter()
+	{
+		if (sqes != MAP_FAILED)
+			munmap(sqes, sqesSize);
+		if (cqRing != MAP_FAILED && cqRing != sqRing)
+			munmap(cqRing, cqRingSize);
+		if (sqRing != MAP_FAILED)
+			munmap(sqRing, sqRingSize);
+		if (ringFd >= 0)
+			close(ringFd);
+	}
+
+	const char* name() const { return "io_uring"; }
+
+	// sets up the ring, if the kernel supports all the operations needed
+	bool open()
+	{
+		struct io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		ringFd = static_cast<int>(syscall(__NR_io_uring_setup, 4 * RTPS_OUTPUT_BATCH, &params));
+		if (ringFd < 0)
+			return false;
+
+		sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+		if (params.features & IORING_FEAT_SINGLE_MMAP)
+			sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+		sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+		if (sqRing == MAP_FAILED)
+			return false;
+		cqRing = (params.features & IORING_FEAT_SINGLE_MMAP) ? sqRing :
+			mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+		sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+		sqes = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+		if (cqRing == MAP_FAILED || sqes == MAP_FAILED)
+			return false;
+
+		char* sq = static_cast<char*>(sqRing);
+		char* cq = static_cast<char*>(cqRing);
+		sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+		sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+		sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+		cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+		cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+		cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+		cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+
+		// all the operations used must be supported
+		std::vector<char> probeBuffer(sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op), 0);
+		auto probe = reinterpret_cast<struct io_uring_probe*>(&probeBuffer[0]);
+		if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PROBE, probe, 256) < 0)
+			return false;
+		for (int op : { IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_FSYNC, IORING_OP_CLOSE, IORING_OP_RENAMEAT })
+			if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+				return false;
+		return true;
+	}
+
+protected:
+	void writeBatch(std::vector<OutputFile>& batch)
+	{
+		for (size_t first = 0; first < batch.size(); first += RTPS_OUTPUT_BATCH)
+			writeChunk(batch, first, std::min(batch.size(), first + RTPS_OUTPUT_BATCH));
+	}
+
+private:
+	void writeChunk(std::vector<OutputFile>& batch, size_t first, size_t last)
+	{
+		size_t count = last - first;
+		std::vector<string> tempFileNames(count);
+		std::vector<int> fds(count, -1);
+
+		// temp files
+		for (size_t i = 0; i < count; i++)
+		{
+			tempFileNames[i] = batch[first + i].path + ".tmp";
+			struct io_uring_sqe* sqe = nextSqe(i);
+			sqe->opcode = IORING_OP_OPENAT;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = reinterpret_cast<uint64_t>(tempFileNames[i].c_str());
+			sqe->len = 0644;
+			sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+		}
+		submitAndWait(count, [&](uint64_t i, int result) { fds[i] = result; });
+
+		// writes (+ fsync) + close, linked per file
+		std::vector<int> written(count, -1);
+		size_t submitted = 0;
+		for (size_t i = 0; i < count; i++)
+		{
+			if (fds[i] < 0)
+				continue;
+			const string& contents = batch[first + i].contents;
+			struct io_uring_sqe* sqe = nextSqe(i);
+			sqe->opcode = IORING_OP_WRITE;
+			sqe->flags = IOSQE_IO_LINK;
+			sqe->fd = fds[i];
+			sqe->addr = reinterpret_cast<uint64_t>(contents.data());
+			sqe->len = static_cast<unsigned>(contents.size());
+			if (sync)
+			{
+				sqe = nextSqe(count + i);
+				sqe->opcode = IORING_OP_FSYNC;
+				sqe->flags = IOSQE_IO_LINK;
+				sqe->fd = fds[i];
+				submitted++;
+			}
+			sqe = nextSqe(2 * count + i);
+			sqe->opcode = IORING_OP_CLOSE;
+			sqe->fd = fds[i];
+			submitted += 2;
+		}
+		std::vector<bool> synced(count, !sync), closed(count, false);
+		submitAndWait(submitted, [&](uint64_t id, int result)
+		{
+			size_t i = id % count;
+			if (id < count)
+				written[i] = result;
+			else if (id < 2 * count)
+				synced[i] = result == 0;
+			else
+				closed[i] = result == 0;
+		});
+
+		// renames into place (short writes or failed links finished by hand)
+		submitted = 0;
+		for (size_t i = 0; i < count; i++)
+		{
+			if (fds[i] < 0)
+				continue;
+			OutputFile& file = batch[first + i];
+			if (!closed[i])
+			{
+				bool ok = written[i] >= 0;
+				for (size_t done = ok ? written[i] : 0; ok && done < file.contents.size(); )
+				{
+					ssize_t more = pwrite(fds[i], file.contents.data() + done, file.contents.size() - done, static_cast<off_t>(done));
+					syscalls++;
+					ok = more > 0;
+					done += ok ? static_cast<size_t>(more) : 0;
+				}
+				if (ok && sync)
+				{
+					synced[i] = fsync(fds[i]) == 0;
+					syscalls++;
+				}
+				closed[i] = close(fds[i]) == 0 && ok;
+				syscalls++;
+			}
+			if (!closed[i] || !synced[i])
+			{
+				remove(tempFileNames[i].c_str());
+				continue;
+			}
+			struct io_uring_sqe* sqe = nextSqe(i);
+			sqe->opcode = IORING_OP_RENAMEAT;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = reinterpret_cast<uint64_t>(tempFileNames[i].c_str());
+			sqe->len = static_cast<unsigned>(AT_FDCWD);
+			sqe->off = reinterpret_cast<uint64_t>(file.path.c_str());
+			submitted++;
+		}
+		submitAndWait(submitted, [&](uint64_t i, int result)
+		{
+			batch[first + i].ok = result == 0;
+			if (result != 0)
+				remove(tempFileNames[i].c_str());
+		});
+	}
+
+	// next submission queue entry (cleared), identified by 'id' in its completion
+	struct io_uring_sqe* nextSqe(uint64_t id)
+	{
+		unsigned index = pendingTail++ & sqMask;
+		struct io_uring_sqe* sqe = static_cast<struct io_uring_sqe*>(sqes) + index;
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->user_data = id;
+		sqArray[index] = index;
+		return sqe;
+	}
+
+	// submits the entries queued (in as few calls as the ring allows) and handles their completions
+	template<typename Handler>
+	void submitAndWait(size_t count, Handler handle)
+	{
+		if (count == 0)
+			return;
+		__atomic_store_n(sqTail, pendingTail, __ATOMIC_RELEASE);
+		size_t completed = 0;
+		size_t toSubmit = count;
+		while (completed < count)
+		{
+			int result = static_cast<int>(syscall(__NR_io_uring_enter, ringFd, static_cast<unsigned>(toSubmit), 
+				static_cast<unsigned>(count - completed), IORING_ENTER_GETEVENTS, nullptr, 0));
+			syscalls++;
+			if (result < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+				break;
+			if (result > 0)
+				toSubmit -= std::min(toSubmit, static_cast<size_t>(result));
+
+			unsigned head = *cqHead;
+			for (; head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE); head++, completed++)
+			{
+				const struct io_uring_cqe& cqe = cqes[head & cqMask];
+				handle(cqe.user_data, cqe.res);
+			}
+			__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+		}
+	}
+
+	int ringFd;
+	void* sqRing;
+	void* cqRing;
+	void* sqes;
+	size_t sqRingSize, cqRingSize, sqesSize;
+	unsigned* sqTail;
+	unsigned* sqArray;
+	unsigned sqMask;
+	unsigned pendingTail = 0;
+	unsigned* cqHead;
+	unsigned* cqTail;
+	unsigned cqMask;
+	struct io_uring_cqe* cqes;
+};
+#endif
+
+// Profile writer for a library worker, as configured ("LibraryOutput": auto, uring or portable)
+std::unique_ptr<ProfileWriter> makeProfileWriter(const string& backend, bool sync)
+{
+#ifdef RTPS_HAVE_IO_URING
+	if (backend != "portable")
+	{
+		std::unique_ptr<UringProfileWriter> writer(new UringProfileWriter(sync));
+		if (writer->open())
+			return std::unique_ptr<ProfileWriter>(writer.release());
+		if (backend == "uring")
+			RTPS_LOG(Warning) << "Library: io_uring not available, writing profiles one by one";
+	}
+#else
+	if (backend == "uring")
+		RTPS_LOG(Warning) << "Library: io_uring not supported here, writing profiles one by one";
+#endif
+	return std::unique_ptr<ProfileWriter>(new PortableProfileWriter(sync));
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Deduplicated profile store ("ProfileStore")
+//
+// Most profiles generated for a shoot are byte-identical (same base and partial profiles). With
+// a store folder configured, each distinct profile is written there once, as "<content hash>.pp3",
+// and the profile file RT reads is made a reflink to it (copy-on-write clone: Btrfs, XFS, ...) or, 
+// with "ProfileStoreLinks=hardlink" in library mode, a hard link: a profile already in the store
+// costs no data written. Where that's not possible (e.g. store on another file system), the profile
+// is written as usual. A hard linked profile *is* the stored copy, shared with every profile of the
+// same contents: RT saves an edited profile in place, so editing one image's profile edits them all.
+// Hard links are therefore never made for the profile RT asks for when opening an image (reflinks
+// are still tried), only by library mode, which reports such edits. Profile files made from the 
+// store are recorded in its "references.txt"; running "RTProfileSelector --gc-store [--dry-run]"
+// removes the blobs no profile file has the contents of anymore (profile files never depend on 
+// their blob still being there).
+//
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/fs.h>)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#ifdef FICLONE
+#define RTPS_HAVE_REFLINK
+#endif
+#endif
+#endif
+
+#define RTPS_STORE_EXTENSION		".pp3"
+#define RTPS_STORE_REFERENCES		"references.txt"
+#define RTPS_STORE_TEMP_TIMEOUT		600		// seconds after which a store temp file is considered stale
+
+class ProfileStore
+{
+public:
+	ProfileStore(const string& folder, bool hardlinks) : folder(folder), hardlinks(hardlinks), reflinks(!hardlinks), stored(0), linked(0), copied(0) {}
+
+	// The store configured in RTProfileSelector.ini, if any (relative to RTPS's folder unless a full path);
+	// hard links (if configured) are only made for library mode's output
+	static std::unique_ptr<ProfileStore> open(IniMap& rtSelectorIni, const string& basePath, bool libraryOutput)
+	{
+		string folder = rtSelectorIni[RTPS_INI_SECTION_GENERAL]["ProfileStore"];
+		if (folder.empty())
+			return nullptr;
+		if (!isFullPath(folder))
+			folder = basePath + folder;
+		if (!makeDirectory(folder))
+		{
+			RTPS_LOG(Warning) << "Can't create profile store " << folder << ": profiles written as usual";
+			return nullptr;
+		}
+		bool hardlinks = rtSelectorIni[RTPS_INI_SECTION_GENERAL]["ProfileStoreLinks"] == "hardlink";
+		return std::unique_ptr<ProfileStore>(new ProfileStore(folder, hardlinks && libraryOutput));
+	}
+
+	// Content hash of a profile (128 bits: two FNV-1a hashes with different offsets)
+	static string contentKey(const string& contents)
+	{
+		return hashToString(hashBytes(contents.data(), contents.size())) 
+			+ hashToString(hashBytes(contents.data(), contents.size(), 0x9E3779B97F4A7C15ULL));
+	}
+
+	// Writes the files of a batch from the store (setting their 'ok' flag), adding the blobs that are new
+	void write(std::vector<OutputFile>& batch, bool sync, unsigned long& syscalls)
+	{
+		std::vector<string> keys;
+		string references;
+		for (const auto& file : batch)
+		{
+			keys.push_back(contentKey(file.contents));
+			references += keys.back() + "\t" + file.path + "\n";
+		}
+		record(references, syscalls);
+
+		for (size_t i = 0; i < batch.size(); i++)
+		{
+			OutputFile& file = batch[i];
+			string blob = blobPath(keys[i]);
+			Link outcome = link(blob, file.contents.size(), file.path, syscalls);
+			if (outcome == Link::Missing && storeBlob(blob, file.contents, sync, syscalls))
+				outcome = link(blob, file.contents.size(), file.path, syscalls);
+			if (outcome == Link::Done)
+			{
+				linked++;
+				file.ok = true;
+			}
+			else
+			{
+				copied++;
+				file.ok = writeOutputFile(file.path, file.path + ".tmp", file.contents, sync, syscalls);
+			}
+		}
+	}
+
+	// Writes a single profile file from the store
+	bool writeProfile(const string& path, const string& contents)
+	{
+		TraceSpan traceSpan("write");
+		std::vector<OutputFile> batch(1, OutputFile(path, contents));
+		unsigned long syscalls = 0;
+		write(batch, false, syscalls);
+		if (!batch[0].ok)
+			RTPS_LOG(Error) << "Error writing output profile file: " << path;
+		return batch[0].ok;
+	}
+
+	// Removes the blobs no recorded profile file has the contents of anymore (see --gc-store)
+	void collect(bool dryRun, size_t& removed, size_t& kept, long long& bytes)
+	{
+		removed = kept = 0;
+		bytes = 0;
+
+		// references recorded while collecting go to a new "references.txt"
+		string references = folder + SLASH_CHAR + RTPS_STORE_REFERENCES;
+		string collecting = references + ".gc";
+		if (!dryRun)
+			rename(references.c_str(), collecting.c_str());		// (a previous collection may have left it behind)
+
+		// last blob recorded for each profile file, if the file still has its contents
+		StrMap recorded;
+		readReferences(collecting, recorded);
+		if (dryRun)
+			readReferences(references, recorded);
+		StrMap live;
+		StrSet liveKeys;
+		for (const auto& reference : recorded)
+		{
+			std::ifstream file(reference.first, std::ios::binary);
+			std::ostringstream contents;
+			contents << file.rdbuf();
+			if (file.good() && contentKey(contents.str()) == reference.second)
+			{
+				live.insert(reference);
+				liveKeys.insert(reference.second);
+			}
+		}
+		if (!dryRun)
+		{
+			StrMap added;
+			readReferences(references, added);
+			for (const auto& reference : added)
+				liveKeys.insert(reference.second);
+		}
+
+		time_t now = time(nullptr);
+		for (const string& name : listDirectory(folder))
+		{
+			string path = folder + SLASH_CHAR + name;
+			long long size, changed;
+			if (!fileStat(path, size, changed))
+				continue;
+			bool blob = name.size() > strlen(RTPS_STORE_EXTENSION) && name.compare(name.size() - strlen(RTPS_STORE_EXTENSION), 
+				string::npos, RTPS_STORE_EXTENSION) == 0;
+			bool staleTemp = name.size() > 4 && name.compare(name.size() - 4, string::npos, ".tmp") == 0 && now - changed > RTPS_STORE_TEMP_TIMEOUT;
+			if (blob && liveKeys.count(name.substr(0, name.size() - strlen(RTPS_STORE_EXTENSION))) != 0)
+				kept++;
+			else if (blob || staleTemp)
+			{
+				if (dryRun || remove(path.c_str()) == 0)
+				{
+					removed += blob ? 1 : 0;
+					bytes += size;
+				}
+			}
+		}
+
+		if (!dryRun)
+		{
+			string lines;
+			for (const auto& reference : live)
+				lines += reference.second + "\t" + reference.first + "\n";
+			unsigned long syscalls = 0;
+			if (record(lines, syscalls))
+				remove(collecting.c_str());
+		}
+	}
+
+	const string& path() const { return folder; }
+
+	// profile files made from a blob (new or not) and written as usual
+	unsigned long linkedCount() const { return linked; }
+	unsigned long copiedCount() const { return copied; }
+	unsigned long storedCount() const { return stored; }
+
+private:
+	enum class Link { Done, Missing, Failed };
+
+	string blobPath(const string& key) const
+	{
+		return folder + SLASH_CHAR + key + RTPS_STORE_EXTENSION;
+	}
+
+	bool storeBlob(const string& blob, const string& contents, bool sync, unsigned long& syscalls)
+	{
+		// unique temp file: other threads and processes may be storing the same blob
+		static std::atomic<unsigned> temps(0);
+		std::ostringstream tempPath;
+		tempPath << blob << "." << Logger::processId() << "." << temps++ << ".tmp";
+		if (!writeOutputFile(blob, tempPath.str(), contents, sync, syscalls))
+		{
+			RTPS_LOG(Warning) << "Can't store profile in " << blob;
+			return false;
+		}
+		stored++;
+		return true;
+	}
+
+	// Makes 'path' a link to the blob (of the given size), if already stored
+	Link link(const string& blob, size_t size, const string& path, unsigned long& syscalls)
+	{
+		if (!hardlinks && !reflinks)
+			return Link::Failed;
+		string tempPath = path + ".tmp";
+#ifdef _WIN32
+		long long blobSize, changed;
+		syscalls++;
+		if (!fileStat(blob, blobSize, changed) || blobSize != static_cast<long long>(size))
+			return Link::Missing;
+		if (!hardlinks)
+			return Link::Failed;
+		remove(tempPath.c_str());
+		syscalls += 2;
+		if (!CreateHardLinkA(tempPath.c_str(), blob.c_str(), NULL))
+			return Link::Failed;
+		syscalls++;
+		if (!MoveFileExA(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING))
+		{
+			remove(tempPath.c_str());
+			return Link::Failed;
+		}
+		return Link::Done;
+#else
+		struct stat blobStat;
+		syscalls++;
+		if (stat(blob.c_str(), &blobStat) != 0 || blobStat.st_size != static_cast<off_t>(size))
+			return Link::Missing;
+		if (hardlinks)
+		{
+			// already linked to the blob (e.g. generated again with the same contents)
+			struct stat pathStat;
+			syscalls++;
+			if (stat(path.c_str(), &pathStat) == 0 && pathStat.st_dev == blobStat.st_dev && pathStat.st_ino == blobStat.st_ino)
+				return Link::Done;
+
+			syscalls++;
+			bool linked = ::link(blob.c_str(), tempPath.c_str()) == 0;
+			if (!linked && errno == EEXIST)
+			{	// stale temp file
+				unlink(tempPath.c_str());
+				linked = ::link(blob.c_str(), tempPath.c_str()) == 0;
+				syscalls += 2;
+			}
+			if (!linked)
+				return errno == ENOENT ? Link::Missing : Link::Failed;		// (blob just removed by --gc-store)
+		}
+		else
+		{
+#ifdef RTPS_HAVE_REFLINK
+			int source = ::open(blob.c_str(), O_RDONLY | O_CLOEXEC);
+			syscalls++;
+			if (source < 0)
+				return errno == ENOENT ? Link::Missing : Link::Failed;
+			int target = ::open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+			bool cloned = target >= 0 && ioctl(target, FICLONE, source) == 0;
+			if (!cloned && target >= 0 && (errno == EOPNOTSUPP || errno == ENOTTY || errno == EXDEV || errno == EINVAL))
+			{
+				RTPS_LOG(Info) << "Profile store: reflinks not supported from " << folder << " to " << path << ", writing copies";
+				reflinks = false;		// (same for the other files)
+			}
+			syscalls += 4;
+			close(source);
+			if (target >= 0)
+				close(target);
+			if (!cloned)
+			{
+				unlink(tempPath.c_str());
+				return Link::Failed;
+			}
+#else
+			return Link::Failed;
+#endif
+		}
+		syscalls++;
+		if (rename(tempPath.c_str(), path.c_str()) != 0)
+		{
+			unlink(tempPath.c_str());
+			return Link::Failed;
+		}
+		return Link::Done;
+#endif
+	}
+
+	// Appends lines to "references.txt" (in a single write, so that several processes can append at the same time)
+	bool record(const string& lines, unsigned long& syscalls)
+	{
+		if (lines.empty())
+			return true;
+		std::lock_guard<std::mutex> lock(mutex);
+		FILE* references = fopen((folder + SLASH_CHAR + RTPS_STORE_REFERENCES).c_str(), "ab");
+		if (references == nullptr)
+			return false;
+		setvbuf(references, nullptr, _IONBF, 0);
+		bool ok = fwrite(lines.data(), 1, lines.size(), references) == lines.size();
+		ok = fclose(references) == 0 && ok;
+		syscalls += 3;
+		return ok;
+	}
+
+	static void readReferences(const string& path, StrMap& references)
+	{
+		std::ifstream file(path, std::ios::binary);
+		string line;
+		while (std::getline(file, line))
+		{
+			size_t tab = line.find('\t');
+			if (tab != string::npos)
+				references[line.substr(tab + 1)] = line.substr(0, tab);
+		}
+	}
+
+	const string folder;
+	const bool hardlinks;
+	std::atomic<bool> reflinks;		// (until they turn out not to be supported)
+	std::mutex mutex;
+	std::atomic<unsigned long> stored, linked, copied;
+};
+
+// Writes library profiles from the store
+class StoreProfileWriter : public ProfileWriter
+{
+public:
+	StoreProfileWriter(ProfileStore& store, bool sync) : ProfileWriter(sync), store(store) {}
+
+	const char* name() const { return "the profile store"; }
+
+protected:
+	void writeBatch(std::vector<OutputFile>& batch)
+	{
+		store.write(batch, sync, syscalls);
+	}
+
+private:
+	ProfileStore& store;
+};
+
+// "RTProfileSelector --gc-store [--dry-run]": removes unreferenced blobs from the profile store
+int collectProfileStore(const string& basePath, IniMap& rtSelectorIni, const std::vector<string>& args)
+{
+	std::unique_ptr<ProfileStore> store = ProfileStore::open(rtSelectorIni, basePath, false);
+	if (!store)
+	{
+		std::cerr << "No profile store (ProfileStore in RTProfileSelector.ini)\n";
+		return 1;
+	}
+	bool dryRun = std::find(args.begin(), args.end(), "--dry-run") != args.end();
+	size_t removed, kept;
+	long long bytes;
+	store->collect(dryRun, removed, kept, bytes);
+
+	std::ostringstream summary;
+	summary << store->path() << ": " << removed << (dryRun ? " unreferenced profile(s) to remove (" : " unreferenced profile(s) removed (") 
+		<< bytes << " bytes), " << kept << " kept";
+	RTPS_LOG(Info) << "Profile store: " << summary.str();
+	std::cout << summary.str() << std::endl;
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Hot reload
+//
+// Long runs (library mode, hosts with an RtpsLiveSnapshot) pick up changes to RTProfileSelector.ini
+// and the rules without stopping: everything built from them is loaded aside into a new snapshot, 
+// which is then published with an atomic pointer swap. Threads matching images never lock nor wait
+// for a reload: while using a snapshot, a thread announces it in a hazard slot of its own, and a 
+// replaced snapshot is freed by the reloading thread once no slot holds it anymore. A reload is 
+// triggered by a change to the files the snapshot was built from (checked every "ReloadInterval" 
+// seconds) and, in library mode on Linux/macOS, by SIGHUP.
+//
+
+#define RTPS_HAZARD_SLOTS			64		// threads using snapshots at the same time (others wait for a free slot)
+#define RTPS_RELOAD_INTERVAL		2		// seconds between checks for changed files (default "ReloadInterval")
+#define RTPS_RELOAD_TICK			200		// milliseconds between checks for a reload signal
+
+// State of the files something was built from, to tell whether any of them changed since
+class FileWatch
+{
+public:
+	void add(const std::vector<string>& paths)
+	{
+		for (const string& path : paths)
+		{
+			if (std::find_if(files.begin(), files.end(), [&path](const File& file) { return file.path == path; }) == files.end())
+				files.push_back(state(path));
+		}
+	}
+
+	bool changed() const
+	{
+		for (const File& file : files)
+		{
+			File now = state(file.path);
+			if (now.found != file.found || now.size != file.size || now.changed != file.changed)
+				return true;
+		}
+		return false;
+	}
+
+private:
+	struct File
+	{
+		string path;
+		bool found;
+		long long size, changed;
+	};
+
+	static File state(const string& path)
+	{
+		File file;
+		file.path = path;
+		file.size = file.changed = 0;
+		file.found = fileStat(path, file.size, file.changed);
+		return file;
+	}
+
+	std::vector<File> files;
+};
+
+// A value published to reading threads, and replaced without them ever locking (see above)
+template <class T>
+class Published
+{
+public:
+	explicit Published(std::unique_ptr<T> value) : current(value.release())
+	{
+		for (size_t slot = 0; slot < RTPS_HAZARD_SLOTS; slot++)
+		{
+			hazards[slot] = nullptr;
+			claims[slot] = false;
+		}
+	}
+
+	~Published()
+	{
+		delete current.load();
+		for (T* value : retired)
+			delete value;
+	}
+
+	// The value published when created, kept for the reader's lifetime
+	class Reader
+	{
+	public:
+		explicit Reader(const Published& published) : published(published), slot(published.claimSlot())
+		{
+			// announced, then checked to be still the published one (otherwise it may have been freed already)
+			do
+			{
+				value = published.current.load();
+				published.hazards[slot].store(value);
+			} while (value != published.current.load());
+		}
+
+		~Reader()
+		{
+			published.hazards[slot].store(nullptr);
+			published.claims[slot].store(false);
+		}
+
+		const T& operator*() const { return *value; }
+		const T* operator->() const { return value; }
+
+	private:
+		Reader(const Reader&);
+		Reader& operator=(const Reader&);
+
+		const Published& published;
+		size_t slot;
+		T* value;
+	};
+
+	// publishes a new value: the one it replaces is freed as soon as no reader uses it
+	void publish(std::unique_ptr<T> value)
+	{
+		std::lock_guard<std::mutex> lock(mutex);		// (publishers only)
+		retired.push_back(current.exchange(value.release()));
+		reclaim();
+	}
+
+	// frees the replaced values no reader uses anymore
+	void collect()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		reclaim();
+	}
+
+private:
+	size_t claimSlot() const
+	{
+		static thread_local size_t hint = std::hash<std::thread::id>()(std::this_thread::get_id()) % RTPS_HAZARD_SLOTS;
+		for (;;)
+		{
+			for (size_t i = 0; i < RTPS_HAZARD_SLOTS; i++)
+			{
+				size_t slot = (hint + i) % RTPS_HAZARD_SLOTS;
+				bool free = false;
+				if (!claims[slot].load() && claims[slot].compare_exchange_strong(free, true))
+				{
+					hint = slot;
+					return slot;
+				}
+			}
+			std::this_thread::yield();
+		}
+	}
+
+	void reclaim()
+	{
+		std::vector<T*> used;
+		for (T* value : retired)
+		{
+			bool hazard = false;
+			for (size_t slot = 0; slot < RTPS_HAZARD_SLOTS && !hazard; slot++)
+				hazard = hazards[slot].load() == value;
+			if (hazard)
+				used.push_back(value);
+			else
+				delete value;
+		}
+		retired.swap(used);
+	}
+
+	std::atomic<T*> current;
+	mutable std::atomic<T*> hazards[RTPS_HAZARD_SLOTS];		// values in use, by slot
+	mutable std::atomic<bool> claims[RTPS_HAZARD_SLOTS];	// slots in use
+	std::mutex mutex;
+	std::vector<T*> retired;								// replaced values still in use
+};
+
+// SIGHUP: reload now (library mode)
+volatile std::sig_atomic_t reloadRequested = 0;
+
+extern "C" void onReloadSignal(int)
+{
+	reloadRequested = 1;
+}
+
+// Reloads a published value (with a 'files' FileWatch member) in the background when the files it was
+// built from change, and on request (see reload()), until destroyed
+template <class T>
+class Reloader
+{
+public:
+	typedef std::function<std::unique_ptr<T>()> Loader;
+
+	Reloader(Published<T>& published, Loader load, int intervalSeconds, bool onSignal) 
+		: published(published), load(load), interval(intervalSeconds), onSignal(onSignal), stopped(false)
+	{
+#ifndef _WIN32
+		if (onSignal)
+			std::signal(SIGHUP, onReloadSignal);
+#endif
+		thread = std::thread(&Reloader::run, this);
+	}
+
+	~Reloader()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopped = true;
+		}
+		wakeUp.notify_all();
+		thread.join();
+	}
+
+	// loads and publishes a new value now
+	void reload()
+	{
+		std::lock_guard<std::mutex> lock(loading);
+		std::unique_ptr<T> value = load();
+		published.publish(std::move(value));
+		RTPS_LOG(Info) << "Reloaded RTProfileSelector.ini and the rules";
+	}
+
+private:
+	void run()
+	{
+		auto lastCheck = std::chrono::steady_clock::now();
+		std::unique_lock<std::mutex> lock(mutex);
+		while (!wakeUp.wait_for(lock, std::chrono::milliseconds(RTPS_RELOAD_TICK), [this]() { return stopped; }))
+		{
+			lock.unlock();
+			bool signaled = onSignal && reloadRequested != 0;
+			bool check = interval > 0 && std::chrono::steady_clock::now() - lastCheck >= std::chrono::seconds(interval);
+			if (check)
+				lastCheck = std::chrono::steady_clock::now();
+			if (signaled || (check && typename Published<T>::Reader(published)->files.changed()))
+			{
+				reloadRequested = 0;
+				std::lock_guard<std::mutex> reloading(loading);
+				std::unique_ptr<T> value = load();
+				if (value->files.changed())
+					lastCheck = std::chrono::steady_clock::time_point();		// being written: again at the next tick
+				else
+				{
+					published.publish(std::move(value));
+					RTPS_LOG(Info) << "Reloaded RTProfileSelector.ini and the rules (" << (signaled ? "signal" : "files changed") << ")";
+				}
+			}
+			published.collect();
+			lock.lock();
+		}
+	}
+
+	Published<T>& published;
+	Loader load;
+	int interval;
+	bool onSignal;
+	bool stopped;
+	std::mutex mutex;
+	std::mutex loading;
+	std::condition_variable wakeUp;
+	std::thread thread;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Library mode: (re)generates the profiles of all raw files in a folder
+//
+// Usage: RTProfileSelector --library <folder> [--jobs <n>] [--force] [--dry-run]
+//
+// Writes "<image>.pp3" next to each raw file (as RT does), using "LibraryDefaultProfile" as the
+// default profile, and records in "RTProfileSelector.manifest" (in the same folder), for each 
+// generated profile: the image's projected Exif fields (the values of the keys used by the rules 
+// and by the ISO and lens lookups), the signature of the profiles selected for it (base profile 
+// and partial profiles with their sections), the files read to build it (found or not, with their
+// fingerprints), and the fingerprint of the profile itself.
+//
+// When run again, say after editing the rules, each image's selection is re-evaluated from its 
+// projected Exif fields, and its profile is only generated again when the selection changed, one 
+// of its files changed or appeared, or the rules now use Exif keys not projected (in which case 
+// exiftool reads the image again). New images are added; profiles changed since they were 
+// generated (edited in RT) and profiles not generated by RTProfileSelector are left alone, unless
+// "--force" is given. Images are processed in parallel by "--jobs" threads (default: one per core).
+//
+
+#define RTPS_MANIFEST_FILE			"RTProfileSelector.manifest"
+#define RTPS_MANIFEST_HEADER		"RTPS-MANIFEST\t1"
+
+// What a library image's profile was built from (a manifest entry)
+struct LibraryEntry
+{
+	long long size, changed;	// image size and time stamp
+	string output;				// fingerprint of the generated profile
+	string selection;			// signature of the selected profiles
+	StrSet files;				// files read to build the profile
+	StrMap exif;				// projected Exif fields (keys not found in the image have no entry)
+	StrSet keys;				// projected Exif keys
+
+	LibraryEntry() : size(0), changed(0) {}
+};
+
+typedef std::map<string, LibraryEntry> LibraryManifest;	// by image file name
+
+// Reads a library manifest (with the fingerprints of the files as they were when the profiles were built)
+bool readManifest(const string& path, LibraryManifest& manifest, StrMap& fingerprints)
+{
+	std::ifstream file(path);
+	string line;
+	if (!std::getline(file, line) || line != RTPS_MANIFEST_HEADER)
+		return false;
+
+	std::vector<string> files;
+	LibraryEntry* entry = nullptr;
+	while (std::getline(file, line))
+	{
+		std::vector<string> fields;
+		std::istringstream ss(line);
+		string field;
+		while (std::getline(ss, field, '\t'))
+			fields.push_back(field);
+		if (fields.empty())
+			continue;
+
+		if (fields[0] == "F" && fields.size() == 3)			// F <path> <fingerprint>
+		{
+			files.push_back(fields[1]);
+			fingerprints[fields[1]] = fields[2];
+		}
+		else if (fields[0] == "I" && fields.size() >= 6)		// I <image> <size> <time> <output> <selection> [<file ids>]
+		{
+			entry = &manifest[fields[1]];
+			entry->size = atoll(fields[2].c_str());
+			entry->changed = atoll(fields[3].c_str());
+			entry->output = fields[4];
+			entry->selection = fields[5];
+			std::istringstream ids(fields.size() > 6 ? fields[6] : "");
+			string id;
+			while (std::getline(ids, id, ','))
+			{
+				size_t index = static_cast<size_t>(atol(id.c_str()));
+				if (index < files.size())
+					entry->files.insert(files[index]);
+			}
+		}
+		else if (fields[0] == "E" && entry != nullptr && fields.size() >= 2)	// E <key> [<value>]
+		{
+			entry->keys.insert(fields[1]);
+			if (fields.size() >= 3)
+				entry->exif[fields[1]] = line.substr(3 + fields[1].size());
+		}
+	}
+	return true;
+}
+
+// Writes a library manifest (to a temporary file, renamed over the previous one)
+bool writeManifest(const string& path, const LibraryManifest& manifest, const StrMap& fingerprints)
+{
+	// files table, shared by all entries
+	std::map<string, size_t> fileIds;
+	for (const auto& image : manifest)
+		for (const auto& file : image.second.files)
+			fileIds.insert(std::make_pair(file, fileIds.size()));
+	std::vector<string> files(fileIds.size());
+	for (const auto& file : fileIds)
+		files[file.second] = file.first;
+
+	string tempPath = path + ".tmp";
+	{
+		std::ofstream out(tempPath);
+		out << RTPS_MANIFEST_HEADER << "\n";
+		for (const auto& file : files)
+		{
+			auto fingerprint = fingerprints.find(file);
+			out << "F\t" << file << "\t" << (fingerprint != fingerprints.end() ? fingerprint->second : "-") << "\n";
+		}
+		for (const auto& image : manifest)
+		{
+			const LibraryEntry& entry = image.second;
+			out << "I\t" << image.first << "\t" << entry.size << "\t" << entry.changed << "\t" << entry.output << "\t" << entry.selection << "\t";
+			const char* separator = "";
+			for (const auto& file : entry.files)
+			{
+				out << separator << fileIds[file];
+				separator = ",";
+			}
+			out << "\n";
+			for (const auto& key : entry.keys)
+			{
+				auto value = entry.exif.find(key);
+				out << "E\t" << key;
+				if (value != entry.exif.end())
+					out << "\t" << value->second;
+				out << "\n";
+			}
+		}
+		if (!out.good())
+			return false;
+	}
+	return replaceFile(tempPath, path);
+}
+
+// Current fingerprints of the files read by library images, computed once per run and shared by the workers
+class FingerprintCache
+{
+public:
+	string get(const string& path)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			auto iter = fingerprints.find(path);
+			if (iter != fingerprints.end())
+				return iter->second;
+		}
+		string fingerprint = hashFile(path);
+		std::lock_guard<std::mutex> lock(mutex);
+		fingerprints[path] = fingerprint;
+		return fingerprint;
+	}
+
+private:
+	std::mutex mutex;
+	StrMap fingerprints;
+};
+
+// Settings and data shared by the library workers
+struct LibraryContext
+{
+	string basePath;
+	string folder;
+	string rtCustomProfilesPath;
+	string defaultProfile;
+	string exiftool;
+	int exifToolTimeout;
+	bool xmpSidecars;			// "UseXmpSidecars"
+	string tempPath;			// for exiftool's output (a subfolder per worker)
+	bool force;
+	bool dryRun;
+	string outputBackend;		// "LibraryOutput"
+	bool outputSync;			// "LibrarySync"
+	ProfileStore* store;		// "ProfileStore" (null if none)
+	IniMap rtSelectorIni;		// as read at start (for the settings above)
+	LibraryManifest manifest;	// as read at start
+	StrMap savedFingerprints;	// files' fingerprints when the manifest was written
+	FingerprintCache fingerprints;
+};
+
+// What library mode reloads when RTProfileSelector.ini or the rules change (see Reloader): never modified
+// once published, but for the rule statistics' (atomic) counters
+struct LibraryTables
+{
+	IniMap rtSelectorIni;
+	IniMultiMap rtSelectorRulesIni;
+	std::unique_ptr<RuleSet> rules;
+	std::unique_ptr<RuleStats> ruleStats;	// shared by the workers
+	StrSet projectedKeys;					// Exif keys used by the rules and lookups
+	FileWatch files;						// the files read
+	TextEncoding encoding;					// of the INI files read (see utf8ToString())
+};
+
+std::unique_ptr<LibraryTables> loadLibraryTables(const string& basePath)
+{
+	std::unique_ptr<LibraryTables> tables(new LibraryTables());
+	std::vector<string> files;
+	{
+		DependencyScope scope(files);
+		tables->rtSelectorIni = readIni(basePath + "RTProfileSelector.ini");
+		tables->encoding = readTextEncoding(tables->rtSelectorIni);
+		EncodingScope encodingScope(&tables->encoding);
+		tables->rtSelectorRulesIni = readMultiIni(basePath + "RTProfileSelectorRules.ini");
+		bool useComplexRules = getIniValue(tables->rtSelectorIni, RTPS_INI_SECTION_GENERAL, "ComplexRulesEnabled") != "0";
+		tables->rules.reset(new RuleSet(tables->rtSelectorRulesIni, useComplexRules));
+		loadCompiledRules(*tables->rules, tables->rtSelectorIni, basePath);
+	}
+	tables->files.add(files);
+	tables->ruleStats.reset(new RuleStats(*tables->rules));
+	tables->ruleStats->load(basePath + "RTProfileSelectorRules.stats");
+	tables->ruleStats->loadProfile(tables->rtSelectorIni, basePath);
+	for (const RuleKey& key : tables->rules->keys)
+		tables->projectedKeys.insert(key.name);
+	for (const char* key : { EXIF_CAMERA_MODEL, EXIF_ISO, EXIF_LENS_ID, EXIF_LENS_TYPE, EXIF_FOCAL_LENGTH })
+		tables->projectedKeys.insert(key);
+	return tables;
+}
+
+// What happened to a library image
+enum class LibraryResult { Unchanged, Generated, Edited, Foreign, Failed };
+
+// Profiles selected for the Exif fields: base profile file and partial profiles (with the sections to apply) 
+// ('batched': the rules already matched for these Exif fields, if not null, see RuleBatch)
+string selectProfiles(const LibraryContext& context, const LibraryTables& tables, const StrMap& exifFields, StrSetVector& partialProfilesList,
+					  const RuleMatches* batched)
+{
+	string sourceProfile = context.defaultProfile;
+	RuleMatches matches = batched != nullptr ? *batched : matchRules(*tables.rules, exifFields, *tables.ruleStats);
+	if (matches.baseProfile != tables.rules->ini.cend())
+		sourceProfile = context.rtCustomProfilesPath + SLASH_CHAR + matches.baseProfile->first;
+	partialProfilesList = getPartialProfilesMatches(tables.rtSelectorIni, matches.partialProfiles, tables.ruleStats->profile.get());
+	return sourceProfile;
+}
+
+// Signature of a selection: what the rules decided for an image
+string selectionSignature(const string& sourceProfile, const StrSetVector& partialProfilesList)
+{
+	string signature = sourceProfile;
+	for (const auto& partialProfile : partialProfilesList)
+	{
+		signature += "\n" + partialProfile.first + ":";
+		for (const auto& section : partialProfile.second)
+			signature += section + ",";
+	}
+	return hashString(signature);
+}
+
+// Brings one library image's profile up to date, updating its manifest entry
+// (generated profiles are queued into 'output', see ProfileWriter; 'batched': the rules matched for the Exif fields in
+// the manifest, if not null)
+LibraryResult processLibraryImage(LibraryContext& context, const LibraryTables& tables, const string& tempPath, const string& name, LibraryEntry& entry, 
+								  std::vector<OutputFile>& output, const RuleMatches* batched)
+{
+	TraceImage traceImage(name);
+	TraceSpan traceSpan("image");
+	string imagePath = context.folder + SLASH_CHAR + name;
+	string profilePath = imagePath + ".pp3";
+	string profileFingerprint = hashFile(profilePath);
+
+	auto previous = context.manifest.find(name);
+	bool known = previous != context.manifest.end();
+	if (known)
+		entry = previous->second;
+
+	// don't overwrite profiles we didn't write, or that were changed since
+	if (!context.force && profileFingerprint != "-" && (!known || profileFingerprint != entry.output))
+		return known ? LibraryResult::Edited : LibraryResult::Foreign;
+
+	long long size, changed;
+	if (!fileStat(imagePath, size, changed))
+		return LibraryResult::Failed;
+
+	// Exif fields: projected ones from the manifest if the image (and the sidecar they were read from, if 
+	// any) didn't change and they cover all the keys used now
+	string sidecar = context.xmpSidecars ? findXmpSidecar(imagePath) : string();
+	bool fromSidecar = known && !sidecar.empty() && entry.files.count(sidecar) != 0;
+	auto savedSidecar = context.savedFingerprints.find(sidecar);
+	bool extract = !known || size != entry.size || changed != entry.changed ||
+		!std::includes(entry.keys.begin(), entry.keys.end(), tables.projectedKeys.begin(), tables.projectedKeys.end()) ||
+		(fromSidecar && (savedSidecar == context.savedFingerprints.end() || savedSidecar->second != context.fingerprints.get(sidecar)));
+
+	if (extract && context.dryRun)
+	{
+		RTPS_LOG(Info) << "Library: would read Exif fields and generate " << profilePath;
+		return LibraryResult::Generated;
+	}
+
+	if (extract)
+	{
+		StrMap exifFields;
+		string reason;
+		fromSidecar = false;
+		if (!sidecar.empty())
+		{
+			exifFields = readXmpSidecar(sidecar, context.basePath);
+			fromSidecar = !exifToolNeeded(*tables.rules, exifFields, context.basePath, reason);
+			if (!fromSidecar)
+				RTPS_LOG(Info) << "Library: XMP sidecar not enough for " << name << ": " << reason;
+		}
+		bool timedOut = false;
+		if (!fromSidecar)
+			exifFields = getExifFields(context.exiftool, tempPath, imagePath, context.exifToolTimeout, timedOut);
+		if (exifFields.empty())
+		{
+			RTPS_LOG(Error) << "Library: could not read Exif fields from " << imagePath;
+			return LibraryResult::Failed;
+		}
+		entry.keys = tables.projectedKeys;
+		entry.exif.clear();
+		for (const auto& key : tables.projectedKeys)
+		{
+			auto value = exifFields.find(key);
+			if (value != exifFields.end())
+				entry.exif.insert(*value);
+		}
+	}
+
+	// nothing to do if the image, the profiles selected for it and the files they're built from didn't change
+	StrSetVector partialProfilesList;
+	string sourceProfile = selectProfiles(context, tables, entry.exif, partialProfilesList, extract ? nullptr : batched);
+	if (known && !context.force && profileFingerprint != "-" && size == entry.size && changed == entry.changed &&
+		selectionSignature(sourceProfile, partialProfilesList) == entry.selection)
+	{
+		bool changedFiles = false;
+		for (const auto& file : entry.files)
+		{
+			auto saved = context.savedFingerprints.find(file);
+			if (saved == context.savedFingerprints.end() || saved->second != context.fingerprints.get(file))
+			{
+				changedFiles = true;
+				break;
+			}
+		}
+		if (!changedFiles)
+			return LibraryResult::Unchanged;
+	}
+
+	if (context.dryRun)
+	{
+		RTPS_LOG(Info) << "Library: would generate " << profilePath;
+		return LibraryResult::Generated;
+	}
+	entry.size = size;
+	entry.changed = changed;
+
+	// generates the profile, recording the files read
+	std::vector<string> files;
+	string profile, debugProfile;
+	{
+		DependencyScope scope(files);
+		if (!buildProfile(context.basePath, context.rtCustomProfilesPath, tables.rtSelectorIni, entry.exif, 
+				partialProfilesList, sourceProfile, profile, debugProfile))
+			return LibraryResult::Failed;
+	}
+	files.push_back(context.basePath + "RTProfileSelector.ini");
+	if (fromSidecar)
+		files.push_back(sidecar);
+
+	entry.files = StrSet(files.begin(), files.end());
+	entry.selection = selectionSignature(sourceProfile, partialProfilesList);
+	entry.output = hashString(profile);
+	output.push_back(OutputFile(profilePath, std::move(profile)));
+	RTPS_LOG(Info) << "Library: generated " << profilePath << " (base profile: " << sourceProfile << ")";
+	return LibraryResult::Generated;
+}
+
+// Library mode entry point (see above)
+int runLibrary(const string& basePath, IniMap& rtSelectorIni, const std::vector<string>& args)
+{
+	LibraryContext context;
+	context.basePath = basePath;
+	context.force = false;
+	context.dryRun = false;
+	unsigned jobs = std::max(1u, std::thread::hardware_concurrency());
+	for (size_t i = 0; i < args.size(); i++)
+	{
+		if (args[i] == "--force")
+			context.force = true;
+		else if (args[i] == "--dry-run")
+			context.dryRun = true;
+		else if (args[i] == "--jobs" && i + 1 < args.size())
+			jobs = static_cast<unsigned>(std::max(1.0, eval(args[++i], 1)));
+		else if (context.folder.empty())
+			context.folder = args[i];
+	}
+	while (context.folder.size() > 1 && (context.folder.back() == SLASH_CHAR || context.folder.back() == REVERSE_SLASH_CHAR))
+		context.folder.pop_back();
+
+	context.rtSelectorIni = rtSelectorIni;
+	EntryMap& general = context.rtSelectorIni[RTPS_INI_SECTION_GENERAL];
+	context.defaultProfile = general["LibraryDefaultProfile"];
+	context.rtCustomProfilesPath = general["RTCustomProfilesPath"];
+	size_t slash = context.defaultProfile.find_last_of(SLASH_CHAR);
+	if (context.rtCustomProfilesPath.empty() && slash != string::npos)
+		context.rtCustomProfilesPath = context.defaultProfile.substr(0, slash);
+	if (context.folder.empty() || context.defaultProfile.empty() || context.rtCustomProfilesPath.empty())
+	{
+		RTPS_LOG(Error) << "Library mode needs a folder and LibraryDefaultProfile (a custom profile, with its full path)";
+		std::cerr << "Usage: RTProfileSelector --library <folder> [--jobs <n>] [--force] [--dry-run]\n"
+			"(LibraryDefaultProfile must be set in RTProfileSelector.ini)\n";
+		return 1;
+	}
+	if (general["UseExifTool"] == "0")
+	{
+		RTPS_LOG(Error) << "Library mode needs exiftool (UseExifTool=0)";
+		return 1;
+	}
+	context.exiftool = general["ExifTool"];
+	if (context.exiftool.empty())
+		context.exiftool = DEFAULT_EXIFTOOL_CMD;
+	context.exifToolTimeout = static_cast<int>(std::max(0.0, eval(general["ExifToolTimeout"], RTPS_EXIFTOOL_TIMEOUT)));
+	context.xmpSidecars = general["UseXmpSidecars"] == "1";
+	context.outputBackend = general["LibraryOutput"];
+	context.outputSync = general["LibrarySync"] == "1";
+	std::unique_ptr<ProfileStore> store = ProfileStore::open(context.rtSelectorIni, basePath, true);
+	context.store = store.get();
+
+	// rules, and the Exif keys they use: reloaded when changed while running (see Reloader)
+	Published<LibraryTables> tables(loadLibraryTables(basePath));
+	int reloadInterval = static_cast<int>(eval(general["ReloadInterval"], RTPS_RELOAD_INTERVAL));
+	std::unique_ptr<Reloader<LibraryTables>> reloader;
+	if (!context.dryRun)
+	{
+		// the counts gathered so far carry over to the reloaded rules (by section and key)
+		auto load = [&basePath, &tables]() {
+			Published<LibraryTables>::Reader(tables)->ruleStats->save(basePath + "RTProfileSelectorRules.stats");
+			return loadLibraryTables(basePath);
+		};
+		reloader.reset(new Reloader<LibraryTables>(tables, load, reloadInterval, true));
+	}
+
+	string manifestPath = context.folder + SLASH_CHAR + RTPS_MANIFEST_FILE;
+	readManifest(manifestPath, context.manifest, context.savedFingerprints);
+
+	context.tempPath = context.folder + SLASH_CHAR + RTPS_MANIFEST_FILE + ".exif";
+	if (!context.dryRun && !makeDirectory(context.tempPath))
+	{
+		RTPS_LOG(Error) << "Library: can't create " << context.tempPath;
+		return 1;
+	}
+
+	// images in the folder
+	std::vector<string> names;
+	StrSet extensions = readRawExtensions(rtSelectorIni);
+	for (const auto& name : listDirectory(context.folder))
+		if (hasExtension(name, extensions))
+			names.push_back(name);
+	RTPS_LOG(Info) << "Library: " << names.size() << " image(s) in " << context.folder << ", " << jobs << " job(s)";
+
+	// the rules matched at once for the images whose Exif fields in the manifest cover the keys used (see RuleBatch),
+	// used by the workers unless the image changed or the rules were reloaded meanwhile (the tables they were
+	// matched with are kept until the end, so they can't be mistaken for reloaded ones)
+	std::unique_ptr<Published<LibraryTables>::Reader> batchTables(new Published<LibraryTables>::Reader(tables));
+	std::vector<RuleMatches> batchMatches(names.size());
+	std::vector<unsigned char> batched(names.size(), 0);
+	if (!(*batchTables)->ruleStats->profile)
+	{
+		std::vector<const StrMap*> images;
+		std::vector<size_t> indices;
+		for (size_t i = 0; i < names.size(); i++)
+		{
+			auto known = context.manifest.find(names[i]);
+			if (known != context.manifest.end() && std::includes(known->second.keys.begin(), known->second.keys.end(), 
+					(*batchTables)->projectedKeys.begin(), (*batchTables)->projectedKeys.end()))
+			{
+				images.push_back(&known->second.exif);
+				indices.push_back(i);
+			}
+		}
+		std::vector<RuleMatches> matches;
+		std::vector<unsigned char> matched;
+		RuleBatch(*(*batchTables)->rules).match(images, matches, matched);
+		for (size_t j = 0; j < indices.size(); j++)
+		{
+			if (matched[j])
+			{
+				batchMatches[indices[j]] = std::move(matches[j]);
+				batched[indices[j]] = 1;
+			}
+		}
+		if (!images.empty())
+			RTPS_LOG(Info) << "Library: rules matched at once for " << std::count(batched.begin(), batched.end(), 1) << " image(s) in the manifest";
+	}
+
+	// workers take images in turn, each writing the profiles it generates in batches
+	std::vector<LibraryEntry> entries(names.size());
+	std::vector<LibraryResult> results(names.size(), LibraryResult::Failed);
+	std::atomic<size_t> next(0);
+	size_t workers = std::max<size_t>(1, std::min<size_t>(jobs, names.size()));
+	std::vector<std::unique_ptr<ProfileWriter>> writers(workers);
+	auto worker = [&](unsigned id)
+	{
+		string tempPath = context.tempPath + SLASH_CHAR + std::to_string(id);
+		if (!context.dryRun)
+			makeDirectory(tempPath);
+		if (context.store != nullptr)
+			writers[id].reset(new StoreProfileWriter(*context.store, context.outputSync));
+		else
+			writers[id] = makeProfileWriter(context.outputBackend, context.outputSync);
+		std::vector<OutputFile> output;
+		std::vector<size_t> outputImages;
+		auto flush = [&]()
+		{
+			writers[id]->write(output);
+			for (size_t i = 0; i < output.size(); i++)
+			{
+				if (!output[i].ok)
+				{
+					RTPS_LOG(Error) << "Library: error writing " << output[i].path;
+					results[outputImages[i]] = LibraryResult::Failed;
+				}
+			}
+			output.clear();
+			outputImages.clear();
+		};
+		for (size_t i = next++; i < names.size(); i = next++)
+		{
+			try
+			{
+				Published<LibraryTables>::Reader current(tables);
+				EncodingScope encodingScope(&current->encoding);
+				const RuleMatches* matches = batched[i] && &*current == &**batchTables ? &batchMatches[i] : nullptr;
+				results[i] = processLibraryImage(context, *current, tempPath, names[i], entries[i], output, matches);
+			}
+			catch (const std::exception& e)
+			{
+				RTPS_LOG(Error) << "Library: " << names[i] << ": " << e.what();
+			}
+			outputImages.resize(output.size(), i);
+			if (output.size() >= RTPS_OUTPUT_BATCH)
+				flush();
+		}
+		flush();
+		if (!context.dryRun)
+			removeDirectory(tempPath);
+	};
+	std::vector<std::thread> threads;
+	for (unsigned i = 1; i < workers; i++)
+		threads.push_back(std::thread(worker, i));
+	worker(0);
+	for (auto& thread : threads)
+		thread.join();
+
+	batchTables.reset();
+	reloader.reset();
+	if (!context.dryRun)
+		removeDirectory(context.tempPath);
+	Published<LibraryTables>::Reader current(tables);
+
+	// new manifest: entries for the images processed (previous entries kept for images that failed or were edited)
+	LibraryManifest manifest;
+	size_t counts[5] = { 0 };
+	for (size_t i = 0; i < names.size(); i++)
+	{
+		counts[static_cast<int>(results[i])]++;
+		if (results[i] == LibraryResult::Unchanged || results[i] == LibraryResult::Generated)
+			manifest[names[i]] = entries[i];
+		else if (context.manifest.count(names[i]) != 0)
+			manifest[names[i]] = context.manifest[names[i]];
+	}
+
+	std::ostringstream summary;
+	summary << names.size() << " image(s): " << counts[static_cast<int>(LibraryResult::Generated)] << (context.dryRun ? " to generate, " : " generated, ")
+		<< counts[static_cast<int>(LibraryResult::Unchanged)] << " unchanged, "
+		<< counts[static_cast<int>(LibraryResult::Edited)] << " edited since generated, "
+		<< counts[static_cast<int>(LibraryResult::Foreign)] << " with other profiles, "
+		<< counts[static_cast<int>(LibraryResult::Failed)] << " failed";
+	RTPS_LOG(Info) << "Library: " << summary.str();
+	std::cout << summary.str() << std::endl;
+
+	// output throughput (files/s over the time the busiest worker spent writing)
+	unsigned long written = 0, syscalls = 0;
+	double seconds = 0;
+	for (const auto& writer : writers)
+	{
+		if (writer)
+		{
+			written += writer->fileCount();
+			syscalls += writer->syscallCount();
+			seconds = std::max(seconds, writer->elapsed());
+		}
+	}
+	if (written != 0)
+	{
+		std::ostringstream throughput;
+		throughput << std::setiosflags(std::ios::fixed) << std::setprecision(1) << "profiles written with " << writers[0]->name() 
+			<< (context.outputSync ? " (synced)" : "") << ": " << written / std::max(seconds, 1e-6) << " files/s, " 
+			<< std::setprecision(2) << static_cast<double>(syscalls) / written << " system calls/file";
+		RTPS_LOG(Info) << "Library: " << throughput.str();
+		std::cout << throughput.str() << std::endl;
+	}
+	if (current->rules->matchCache.hitCount() != 0)
+	{
+		std::ostringstream cacheSummary;
+		cacheSummary << "rules matched " << current->rules->matchCache.missCount() << " time(s), " << current->rules->matchCache.hitCount() 
+			<< " image(s) with the same values of the rules' Exif keys as a previous one";
+		RTPS_LOG(Info) << "Library: " << cacheSummary.str();
+	}
+	if (store && written != 0)
+	{
+		std::ostringstream storeSummary;
+		storeSummary << "profile store: " << store->storedCount() << " new profile(s) stored, " << store->linkedCount() 
+			<< " file(s) linked, " << store->copiedCount() << " written as copies";
+		RTPS_LOG(Info) << "Library: " << storeSummary.str();
+		std::cout << storeSummary.str() << std::endl;
+	}
+
+	if (!context.dryRun)
+	{
+		current->ruleStats->save(basePath + "RTProfileSelectorRules.stats");
+
+		// fingerprints of the files as they are now, i.e. when the profiles were (re)generated
+		StrMap fingerprints;
+		for (const auto& image : manifest)
+			for (const auto& file : image.second.files)
+				fingerprints[file] = context.fingerprints.get(file);
+		if (!writeManifest(manifestPath, manifest, fingerprints))
+		{
+			RTPS_LOG(Error) << "Library: can't write " << manifestPath;
+			return 1;
+		}
+	}
+	return counts[static_cast<int>(LibraryResult::Failed)] != 0 ? 1 : 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Library API (see librtps.h)
+//
+
+#ifdef _WIN32
+#define RTPS_EXECUTABLE				"RTProfileSelector.exe"
+#else
+#define RTPS_EXECUTABLE				"RTProfileSelector"
+#endif
+
+// log settings: LogLevel (none, error, warning, info, debug), LogMaxSize (KB) and LogMaxFiles (rotated files kept)
+void configureLogger(const IniMap& rtSelectorIni)
+{
+	const string& logMaxSize = getIniValue(rtSelectorIni, RTPS_INI_SECTION_GENERAL, "LogMaxSize");
+	const string& logMaxFiles = getIniValue(rtSelectorIni, RTPS_INI_SECTION_GENERAL, "LogMaxFiles");
+	Logger::configure(parseLogLevel(getIniValue(rtSelectorIni, RTPS_INI_SECTION_GENERAL, "LogLevel"), LogLevel::Info),
+		static_cast<size_t>(eval(logMaxSize, 1024) * 1024), static_cast<int>(eval(logMaxFiles, 3)));
+}
+
+// What a snapshot holds: settings and rules, never changed after load()
+struct RtpsSnapshot::Impl
+{
+	string basePath;
+	IniMap rtSelectorIni;
+	IniMultiMap rtSelectorRulesIni;
+	std::unique_ptr<RuleSet> rules;
+	std::unique_ptr<RuleStats> stats;	// the only mutable part (atomic counters)
+	string exiftool;					// empty with UseExifTool=0
+	bool lazyExifTool;
+	bool xmpSidecars;					// "UseXmpSidecars"
+	bool rtCache;						// "UseRTCache"
+	int exifToolTimeout;
+	string rtCustomProfilesPath;		// if declared in RTProfileSelector.ini
+	TextEncoding encoding;				// of the INI files read (see utf8ToString())
+
+	const string& general(const char* key) const { return getIniValue(rtSelectorIni, RTPS_INI_SECTION_GENERAL, key); }
+
+	// RtpsSnapshot::load() with RTProfileSelector.ini already read (by rtpsMain())
+	static std::shared_ptr<const RtpsSnapshot> load(const string& basePath, const IniMap& rtSelectorIni);
+};
+
+RtpsSnapshot::RtpsSnapshot() : impl(new Impl()) {}
+
+RtpsSnapshot::~RtpsSnapshot() {}
+
+std::shared_ptr<const RtpsSnapshot> RtpsSnapshot::load(const string& basePath)
+{
+	return Impl::load(basePath, readIni(basePath + "RTProfileSelector.ini"));
+}
+
+std::shared_ptr<const RtpsSnapshot> RtpsSnapshot::Impl::load(const string& basePath, const IniMap& rtSelectorIni)
+{
+	std::shared_ptr<RtpsSnapshot> snapshot(new RtpsSnapshot());
+	Impl& data = *snapshot->impl;
+	data.basePath = basePath;
+	data.rtSelectorIni = rtSelectorIni;
+
+	// if necessary, a specific locale can be set for reading INI-files (converting UTF-8 to single-byte char strings)
+	// (ex: DefaultLocale=.1252): the snapshot's own, used for the rules below and by select()
+	data.encoding = readTextEncoding(data.rtSelectorIni);
+	EncodingScope encodingScope(&data.encoding);
+
+	// use exiftool to extract Exif values from raw file into 'exif.txt' 
+	// (lazy mode: only if the Exif data from the keyfile is not enough, see exifToolNeeded())
+	data.lazyExifTool = data.general("UseExifTool") == "lazy";
+	data.xmpSidecars = data.general("UseXmpSidecars") == "1";
+	data.rtCache = data.general("UseRTCache") == "1";
+	if (data.general("UseExifTool") != "0")
+	{
+		data.exiftool = data.general("ExifTool");
+		if (data.exiftool.empty())
+			data.exiftool = DEFAULT_EXIFTOOL_CMD;
+	}
+
+	// exiftool is killed if it doesn't finish within "ExifToolTimeout" milliseconds (0 = no deadline), in which
+	// case the run goes on in degraded mode, with the Exif fields from the keyfile
+	data.exifToolTimeout = static_cast<int>(std::max(0.0, eval(data.general("ExifToolTimeout"), RTPS_EXIFTOOL_TIMEOUT)));
+
+	// path where custom profiles are located (if not declared, taken from the default profile)
+	data.rtCustomProfilesPath = data.general("RTCustomProfilesPath");
+
+	// profile selection rules
+	bool useComplexRules = data.general("ComplexRulesEnabled") != "0";
+	data.rtSelectorRulesIni = readMultiIni(basePath + "RTProfileSelectorRules.ini");
+	data.rules.reset(new RuleSet(data.rtSelectorRulesIni, useComplexRules));
+	loadCompiledRules(*data.rules, data.rtSelectorIni, basePath);
+	data.stats.reset(new RuleStats(*data.rules));
+	data.stats->load(basePath + "RTProfileSelectorRules.stats");
+	data.stats->loadProfile(data.rtSelectorIni, basePath);
+	return snapshot;
+}
+
+// body of RtpsSnapshot::select(), which turns any exception thrown here into an error result
+static bool selectProfile(const RtpsSnapshot::Impl& data, const RtpsRequest& request, RtpsResult& result)
+{
+	EncodingScope encodingScope(&data.encoding);
+	PhaseTimer timer;
+	TraceImage traceImage(request.imagePath);
+	result = RtpsResult();
+
+	// the default profile *must* be a custom one (with its full path)
+	size_t slash = request.defaultProfile.find_last_of(SLASH_CHAR);
+	if (slash == string::npos)
+	{
+		result.error = "default profile *must* be custom, not a bundled one (" + request.defaultProfile + ")";
+		RTPS_LOG(Error) << "RT misconfigured: " << result.error;
+		return false;
+	}
+	string rtCustomProfilesPath = data.rtCustomProfilesPath;
+	if (rtCustomProfilesPath.empty())
+		rtCustomProfilesPath = request.defaultProfile.substr(0, slash);
+
+	bool useExifTool = !data.exiftool.empty() && !request.imagePath.empty();
+	if (useExifTool && request.cachePath.empty())
+	{
+		result.error = "a cache path is needed to read the image's Exif fields";
+		RTPS_LOG(Error) << result.error;
+		return false;
+	}
+
+	// with "Prefetch=1", Exif fields are read from the metadata cache when the folder was prefetched, 
+	// otherwise extracted by exiftool while a worker prefetches the rest of the folder
+	PrefetchSettings prefetch = readPrefetchSettings(data.rtSelectorIni, request.cachePath);
+	auto extractExifFields = [&]() -> StrMap
+	{
+		if (prefetch.enabled)
+		{
+			StrMap cached = readCachedExifFields(prefetch, request.imagePath);
+			if (!cached.empty())
+			{
+				RTPS_LOG(Info) << "Exif fields read from metadata cache";
+				return cached;
+			}
+			startFolderPrefetch(prefetch, data.basePath + RTPS_EXECUTABLE, request.cachePath, request.imagePath);
+		}
+		return getExifFields(data.exiftool, request.cachePath, request.imagePath, data.exifToolTimeout, result.degraded);
+	};
+
+	// reads image Exif values into map (either extracted by exiftool or given by the caller, e.g. from RT keyfile) 
+	StrMap& exifFields = result.exifFields;
+	TraceSpan exifSpan("exif");
+
+	// cheaper sources than exiftool, used instead if their fields (with the keyfile's, in lazy mode) are enough:
+	// RT's cache data for the image ("UseRTCache=1") and the image's XMP sidecar ("UseXmpSidecars=1")
+	StrMap knownFields;
+	string knownSources, knownReason;
+	if (useExifTool && data.rtCache)
+	{
+		knownFields = readRTCacheExifFields(request.cachePath, request.imagePath, data.basePath);
+		if (!knownFields.empty())
+			knownSources = "RT's cache data";
+	}
+	string sidecar = useExifTool && data.xmpSidecars ? findXmpSidecar(request.imagePath) : string();
+	if (!sidecar.empty())
+	{
+		StrMap sidecarFields = readXmpSidecar(sidecar, data.basePath);
+		knownFields.insert(sidecarFields.begin(), sidecarFields.end());
+		knownSources += (knownSources.empty() ? "XMP sidecar " : " and XMP sidecar ") + sidecar;
+	}
+	if (!knownSources.empty() && data.lazyExifTool)
+	{
+		StrMap keyfileFields = getKeyfileExifFields(request.exifFields, data.basePath);
+		knownFields.insert(keyfileFields.begin(), keyfileFields.end());
+	}
+	if (!knownSources.empty() && !exifToolNeeded(*data.rules, knownFields, data.basePath, knownReason))
+	{
+		RTPS_LOG(Info) << "Exif fields read from " << knownSources;
+		exifFields = std::move(knownFields);
+	}
+	else if (useExifTool && data.lazyExifTool)
+	{
+		if (!knownSources.empty())
+			RTPS_LOG(Info) << "Exif fields from " << knownSources << " not enough: " << knownReason;
+		exifFields = getKeyfileExifFields(request.exifFields, data.basePath);
+		string reason;
+		if (exifToolNeeded(*data.rules, exifFields, data.basePath, reason))
+		{
+			RTPS_LOG(Info) << "Keyfile data not enough: " << reason;
+			// exiftool values take precedence over the ones from the keyfile
+			StrMap keyfileFields = std::move(exifFields);
+			exifFields = extractExifFields();
+			exifFields.insert(keyfileFields.begin(), keyfileFields.end());
+		}
+		else
+			RTPS_LOG(Info) << "Keyfile data resolves all rules and lookups: exiftool not called";
+	}
+	else if (useExifTool)
+	{
+		if (!knownSources.empty())
+			RTPS_LOG(Info) << "Exif fields from " << knownSources << " not enough: " << knownReason;
+		exifFields = extractExifFields();
+		if (result.degraded)
+			exifFields = getKeyfileExifFields(request.exifFields, data.basePath);
+	}
+	else
+		exifFields = request.exifFields;
+	if (result.degraded)
+		RTPS_LOG(Warning) << "Degraded mode: exiftool didn't finish within " << data.exifToolTimeout << " ms, rules matched against the keyfile's Exif fields only";
+	exifSpan.end();
+	timer.lap("exif");
+
+	// default source profile (reassigned below, if we can find a good match based on Exif)
+	result.baseProfile = request.defaultProfile;
+
+	// Exif-matched partial profiles list: 
+	// list of partial profiles that match the EXIF info for the current image
+	StrSetVector partialProfilesList;
+	if (exifFields.empty())
+	{
+		RTPS_LOG(Warning) << "Could not read Exif keys from image file: " << request.imagePath;
+	}
+	else
+	{
+		// check all profile selection rules for a match against the Exif values
+		// have we found a profile matching the Exif values?
+		RuleMatches matches = matchRules(*data.rules, exifFields, *data.stats);
+		if (matches.baseProfile != data.rtSelectorRulesIni.cend())
+			result.baseProfile = rtCustomProfilesPath + SLASH_CHAR + matches.baseProfile->first;
+			
+		// get matches for partial profiles
+		partialProfilesList = getPartialProfilesMatches(data.rtSelectorIni, matches.partialProfiles, data.stats->profile.get());
+	}
+	for (const auto& partialProfile : partialProfilesList)
+		result.partialProfiles.push_back(std::make_pair(partialProfile.first, 
+			std::vector<string>(partialProfile.second.begin(), partialProfile.second.end())));
+
+	// matching basic profile selected
+	RTPS_LOG(Info) << "Base profile file selected: " << result.baseProfile;
+	timer.lap("match");
+
+	// last step: apply any partial profiles (partial rules, lens or ISO-dependent) 
+	if (!buildProfile(data.basePath, rtCustomProfilesPath, data.rtSelectorIni, exifFields, partialProfilesList, 
+		result.baseProfile, result.profile, result.debugProfile))
+	{
+		result.error = "error opening base profile file: " + result.baseProfile;
+		return false;
+	}
+	timer.lap("profile");
+
+	result.timings = timer.laps();
+	result.ok = true;
+	return true;
+}
+
+bool RtpsSnapshot::select(const RtpsRequest& request, RtpsResult& result) const
+{
+	try
+	{
+		return selectProfile(*impl, request, result);
+	}
+	catch (const std::exception& e)
+	{	// e.g. a malformed number in an ISO or lens profile (also when thrown by a read-ahead of the profile)
+		result.ok = false;
+		result.error = e.what();
+		RTPS_LOG(Error) << "Profile selection failed: " << result.error;
+		return false;
+	}
+}
+
+void RtpsSnapshot::saveStatistics() const
+{
+	impl->stats->save(impl->basePath + "RTProfileSelectorRules.stats");
+}
+
+void RtpsSnapshot::appendStatistics() const
+{
+	impl->stats->append(impl->basePath + "RTProfileSelectorRules.stats");
+}
+
+int RtpsSnapshot::prefetchFolder(const string& imagePath, const string& cachePath) const
+{
+	return ::prefetchFolder(readPrefetchSettings(impl->rtSelectorIni, cachePath), imagePath);
+}
+
+int RtpsSnapshot::runLibrary(const std::vector<string>& args) const
+{
+	IniMap rtSelectorIni = impl->rtSelectorIni;
+	return ::runLibrary(impl->basePath, rtSelectorIni, args);
+}
+
+// What a live snapshot publishes: the current snapshot, and the files it was loaded from (see Reloader)
+struct LiveSnapshot
+{
+	std::shared_ptr<const RtpsSnapshot> snapshot;
+	FileWatch files;
+	int reloadInterval;		// "ReloadInterval"
+
+	static std::unique_ptr<LiveSnapshot> load(const string& basePath)
+	{
+		std::unique_ptr<LiveSnapshot> live(new LiveSnapshot());
+		std::vector<string> files;
+		{
+			DependencyScope scope(files);
+			live->snapshot = RtpsSnapshot::load(basePath);
+			live->reloadInterval = static_cast<int>(eval(getIniValue(readIni(basePath + "RTProfileSelector.ini"), 
+				RTPS_INI_SECTION_GENERAL, "ReloadInterval"), RTPS_RELOAD_INTERVAL));
+		}
+		live->files.add(files);
+		return live;
+	}
+};
+
+struct RtpsLiveSnapshot::Impl
+{
+	Published<LiveSnapshot> published;
+	std::unique_ptr<Reloader<LiveSnapshot>> reloader;
+
+	explicit Impl(const string& basePath) : published(LiveSnapshot::load(basePath)) {}
+};
+
+RtpsLiveSnapshot::RtpsLiveSnapshot(const string& basePath) : impl(new Impl(basePath))
+{
+	int reloadInterval = Published<LiveSnapshot>::Reader(impl->published)->reloadInterval;
+	Published<LiveSnapshot>& published = impl->published;
+	auto load = [basePath, &published]() {
+		Published<LiveSnapshot>::Reader(published)->snapshot->saveStatistics();		// (carried over, see runLibrary())
+		return LiveSnapshot::load(basePath);
+	};
+	impl->reloader.reset(new Reloader<LiveSnapshot>(published, load, reloadInterval, false));
+}
+
+RtpsLiveSnapshot::~RtpsLiveSnapshot() {}
+
+bool RtpsLiveSnapshot::select(const RtpsRequest& request, RtpsResult& result) const
+{
+	Published<LiveSnapshot>::Reader current(impl->published);
+	return current->snapshot->select(request, result);
+}
+
+void RtpsLiveSnapshot::reload()
+{
+	impl->reloader->reload();
+}
+
+void RtpsLiveSnapshot::saveStatistics() const
+{
+	Published<LiveSnapshot>::Reader current(impl->published);
+	current->snapshot->saveStatistics();
+}
+
+RtpsLogSession::RtpsLogSession(const string& basePath)
+{
+	Logger::start(basePath + "RTProfileSelector.log");
+	configureLogger(readIni(basePath + "RTProfileSelector.ini"));
+}
+
+RtpsLogSession::~RtpsLogSession()
+{
+	Logger::stop();
+}
+
+RtpsTraceSession::RtpsTraceSession(const string& path)
+{
+	Tracer::start(path);
+}
+
+RtpsTraceSession::~RtpsTraceSession()
+{
+	Tracer::stop();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+// 
+// The main program (see RTProfileSelector.cpp)
+//
+// Usage: RTProfileSelector <RawTherapee params file for profile selection>
+//        RTProfileSelector --prefetch <image file> <cache path>   (started by RTProfileSelector itself)
+//        RTProfileSelector --library <folder> [--jobs <n>] [--force] [--dry-run]
+//        RTProfileSelector --compile-rules <file.cpp>
+//        RTProfileSelector --check-matchers <folder of "exiftool -t" outputs>
+//        RTProfileSelector --gc-store [--dry-run]
+//
+int rtpsMain(int argc, const char* argv[])
+{
+	// per-phase timings, see "LogTimings" below
+	PhaseTimer timer;
+
+	// save program base path 
+	string basePath = argv[0];
+	size_t slash = basePath.find_last_of(SLASH_CHAR);
+	if (slash == string::npos)
+		basePath = "";
+	else
+		basePath = basePath.substr(0, slash + 1);
+
+	// for simple logging/debugging (appended to, rotated by size: see Logger)
+	LogSession logSession(basePath + "RTProfileSelector.log");
+
+	if (argc < 2)
+	{
+		RTPS_LOG(Error) << "Too few arguments";
+		return 1;
+	}
+
+	// reads profile selection configuration file (the rules only when selecting a profile, below)
+	IniMap rtSelectorIni = readIni(basePath + "RTProfileSelector.ini");
+	configureLogger(rtSelectorIni);
+	TextEncoding encoding = readTextEncoding(rtSelectorIni);
+	EncodingScope encodingScope(&encoding);		// (key file, rules compiled)
+
+	// if enabled, a line with the time spent in each phase is logged at the end of the run
+	bool logTimings = rtSelectorIni[RTPS_INI_SECTION_GENERAL]["LogTimings"] == "1";
+
+	// if enabled, the stages of each image are traced (see Tracer), into a file relative to RTPS's folder if not a full path
+	string traceFile = rtSelectorIni[RTPS_INI_SECTION_GENERAL]["TraceFile"];
+	if (!traceFile.empty() && !isFullPath(traceFile))
+		traceFile = basePath + traceFile;
+	TraceSession traceSession(traceFile);
+	TraceImage traceImage;
+	timer.lap("config");
+
+	// detached metadata prefetch worker started by a previous call (see prefetchFolder())
+	if (string(argv[1]) == "--prefetch")
+	{
+		if (argc < 4)
+		{
+			RTPS_LOG(Error) << "Too few arguments for --prefetch";
+			return 1;
+		}
+		return prefetchFolder(readPrefetchSettings(rtSelectorIni, argv[3]), argv[2]);
+	}
+
+	// library mode: brings the profiles of all raw files in a folder up to date (see runLibrary())
+	if (string(argv[1]) == "--library")
+		return runLibrary(basePath, rtSelectorIni, std::vector<string>(argv + 2, argv + argc));
+
+	// removes unreferenced profiles from the profile store (see ProfileStore)
+	if (string(argv[1]) == "--gc-store")
+		return collectProfileStore(basePath, rtSelectorIni, std::vector<string>(argv + 2, argv + argc));
+
+	// generates a compiled rules module from the rules (see CompiledRules)
+	if (string(argv[1]) == "--compile-rules")
+	{
+		if (argc < 3)
+		{
+			RTPS_LOG(Error) << "Too few arguments for --compile-rules";
+			return 1;
+		}
+		return compileRules(basePath, rtSelectorIni, argv[2]);
+	}
+
+	// checks that all the ways of matching the rules agree (see checkMatchers())
+	if (string(argv[1]) == "--check-matchers")
+	{
+		if (argc < 3)
+		{
+			RTPS_LOG(Error) << "Too few arguments for --check-matchers";
+			return 1;
+		}
+		return checkMatchers(basePath, rtSelectorIni, argv[2]);
+	}
+
+	// profile selection rules
+	std::shared_ptr<const RtpsSnapshot> snapshot = RtpsSnapshot::Impl::load(basePath, rtSelectorIni);
+	timer.lap("rules");
+
+	// reads RT's params for profile selection
+	TraceSpan keyfileSpan("keyfile");
+	IniMap rtProfileParams = readIni(argv[1]);
+
+	RTPS_LOG(Info) << "RT key file: " << argv[1];
+	if (rtProfileParams.empty())
+		RTPS_LOG(Warning) << "Empty key file!";
+		
+	// for debugging, save current RT params file as "LastKeyFile.txt"
+	copyFile(argv[1], basePath + "LastKeyFile.txt");
+
+	// necessary parameters for current raw file
+	RtpsRequest request;
+	request.imagePath = removeDoubleSlashes(rtProfileParams[RT_KEYFILE_GENERAL_SECTION]["ImageFileName"]);
+	string outputProfileFileName = removeDoubleSlashes(rtProfileParams[RT_KEYFILE_GENERAL_SECTION]["OutputProfileFileName"]);
+	request.cachePath = removeDoubleSlashes(rtProfileParams[RT_KEYFILE_GENERAL_SECTION]["CachePath"]);
+	request.defaultProfile = removeDoubleSlashes(rtProfileParams[RT_KEYFILE_GENERAL_SECTION]["DefaultProcParams"]);
+	request.exifFields = getParamsExifFields(rtProfileParams);
+	traceImage.set(request.imagePath);
+	keyfileSpan.end();
+
+	timer.lap("keyfile");
+
+	// all parameters found in RT's parameter file?
+	if (request.imagePath.empty() || outputProfileFileName.empty() || request.cachePath.empty() || request.defaultProfile.empty())
+	{
+		RTPS_LOG(Error) << "Invalid RT ini params file: " << argv[1];
+		return 1;
+	}
+
+	// select and build the profile
+	RtpsResult result;
+	if (!snapshot->select(request, result))
+	{
+		RTPS_LOG(Error) << "Error applying rules - operation aborted!";
+		return 1;
+	}
+	timer.append(result.timings);
+
+	// written from the profile store, if any (see ProfileStore: never hard linked, RT edits this file in place)
+	std::unique_ptr<ProfileStore> store = ProfileStore::open(rtSelectorIni, basePath, false);
+	if (!(store ? store->writeProfile(outputProfileFileName, result.profile) : writeProfileFile(outputProfileFileName, result.profile)))
+	{
+		RTPS_LOG(Error) << "Error applying rules - operation aborted!";
+		return 1;
+	}
+	saveLastProfileFiles(basePath, result.baseProfile, outputProfileFileName, result.profile, result.debugProfile);
+
+	// check whether a specific viewer is defined in the configuration file
+	string exifViewerCmd = rtSelectorIni[RTPS_INI_SECTION_GENERAL]["TextViewer"];
+	if (exifViewerCmd.empty())
+		exifViewerCmd = DEFAULT_TEXTVIEWER_CMD;
+
+	// save the fields in a text file containing "key=value" lines, for easy copying to rules files
+	if (!result.exifFields.empty())
+	{
+		bool viewExifKeys = rtSelectorIni[RTPS_INI_SECTION_GENERAL]["ViewExifKeys"] == "1";
+		saveExifFields(result.exifFields, request.imagePath, basePath + "ExifFields.txt", exifViewerCmd, viewExifKeys);
+	}
+	timer.lap("output");
+
+	// evaluation statistics, for ordering the rules in the next runs (appended: other instances are running too)
+	snapshot->appendStatistics();
+	timer.lap("stats");
+
+	if (logTimings)
+		RTPS_LOG(Info) << "Timings (ms): " << timer.summary() << " [" << request.imagePath << "]";
+
+	// if ViewPP3Debug is enabled, show PP3 debug text file
+	if (rtSelectorIni[RTPS_INI_SECTION_GENERAL]["ViewProfileDebug"] == "1")
+		executeProcess(exifViewerCmd + " \"" + basePath + "LastProfileDebug.txt" + "\"", "", false);			
+
+	return 0;
+}
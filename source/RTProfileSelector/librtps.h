@@ -0,0 +1,194 @@
+//////////////////////////////////////////////////////////////////////////////////////////////
+//
+//  librtps
+//
+//  RTProfileSelector's profile selection as a library, for hosts that want to select and
+//  build profiles in-process instead of running RTProfileSelector with a keyfile.
+//
+//  A snapshot is loaded once from RTProfileSelector's folder (RTProfileSelector.ini, the
+//  rules, ISO and lens profiles) and is immutable afterwards: select() may be called from
+//  any number of threads at the same time.  To pick up changes to the rules, load a new
+//  snapshot (snapshots are independent of each other), or use a live snapshot, which does
+//  so by itself when they change.
+//
+//	Copyright 2014 Marcos Capelini
+//
+//  This program is free software : you can redistribute it and / or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.If not, see <http://www.gnu.org/licenses/>.
+//
+//  Note: source best viewed with a tab size of four spaces
+//
+//////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef LIBRTPS_H
+#define LIBRTPS_H
+
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Building or using librtps as a shared library (DLL) needs LIBRTPS_SHARED defined,
+// and LIBRTPS_BUILD too when building it
+#if defined(LIBRTPS_SHARED) && defined(_WIN32)
+#ifdef LIBRTPS_BUILD
+#define LIBRTPS_API		__declspec(dllexport)
+#else
+#define LIBRTPS_API		__declspec(dllimport)
+#endif
+#elif defined(LIBRTPS_SHARED) && defined(__GNUC__)
+#define LIBRTPS_API		__attribute__((visibility("default")))
+#else
+#define LIBRTPS_API
+#endif
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+
+// Exif fields by name (exiftool's names, e.g. "Camera Model Name", or RT's keyfile names,
+// e.g. "CommonData.Model")
+typedef std::map<std::string, std::string> RtpsExifMap;
+
+// What to select a profile for
+struct RtpsRequest
+{
+	// image file: if not empty, its Exif fields are read as configured in RTProfileSelector.ini
+	// (UseExifTool, ExifToolTimeout, Prefetch)
+	std::string imagePath;
+
+	// Exif fields already known: all there is if imagePath is empty (or UseExifTool=0), otherwise
+	// the keyfile's fields used by UseExifTool=lazy, or when exiftool doesn't finish in time
+	RtpsExifMap exifFields;
+
+	// default profile (full path), used as the base profile when no full profile rule matches
+	std::string defaultProfile;
+
+	// folder for exiftool's output and the metadata cache (RT's cache folder); required with imagePath
+	std::string cachePath;
+};
+
+// Outcome of a selection
+struct RtpsResult
+{
+	bool ok;							// false: see error
+	std::string error;
+
+	bool degraded;						// exiftool didn't finish in time: matched against exifFields from the request
+	RtpsExifMap exifFields;				// the fields matched against the rules
+
+	std::string baseProfile;			// full path of the base profile
+	std::vector<std::pair<std::string, std::vector<std::string>>> partialProfiles;	// rule-matched partial profiles
+																					// (with their sections), in application order
+	std::string profile;				// the merged profile (.pp3 contents)
+	std::string debugProfile;			// the same, with the source of each entry as a comment
+
+	std::vector<std::pair<std::string, double>> timings;	// milliseconds spent in each phase
+
+	RtpsResult() : ok(false), degraded(false) {}
+};
+
+// Configuration and rules loaded from RTProfileSelector's folder
+class LIBRTPS_API RtpsSnapshot
+{
+public:
+	// Loads a snapshot from the folder with RTProfileSelector.ini and RTProfileSelectorRules.ini
+	// (basePath must end with a slash, or be empty for the current folder)
+	static std::shared_ptr<const RtpsSnapshot> load(const std::string& basePath);
+
+	~RtpsSnapshot();
+
+	// Selects the base and partial profiles for an image and builds the merged profile (thread-safe)
+	bool select(const RtpsRequest& request, RtpsResult& result) const;
+
+	// Saves the rule evaluation statistics gathered by select() (see RuleStats), which make the
+	// snapshots loaded afterwards evaluate the rules in a better order
+	void saveStatistics() const;
+
+	// The same, only appending the counts added since the snapshot was loaded (summed when loading): 
+	// cheaper for a host selecting a single profile per process, with several processes running at once
+	void appendStatistics() const;
+
+	// Extracts the Exif fields of the raw files in an image's folder into the metadata cache (see prefetchFolder())
+	int prefetchFolder(const std::string& imagePath, const std::string& cachePath) const;
+
+	// Brings the profiles of all the raw files in a folder up to date (see runLibrary())
+	int runLibrary(const std::vector<std::string>& args) const;
+
+	struct Impl;
+
+private:
+	RtpsSnapshot();
+	RtpsSnapshot(const RtpsSnapshot&);
+	RtpsSnapshot& operator=(const RtpsSnapshot&);
+
+	std::unique_ptr<Impl> impl;
+};
+
+// A snapshot reloaded in the background when RTProfileSelector.ini, the rules or the compiled rules module
+// change (checked every "ReloadInterval" seconds), without select() ever waiting for a reload: each call
+// uses the snapshot current when it started
+class LIBRTPS_API RtpsLiveSnapshot
+{
+public:
+	// basePath: as for RtpsSnapshot::load()
+	explicit RtpsLiveSnapshot(const std::string& basePath);
+	~RtpsLiveSnapshot();
+
+	// Selects the base and partial profiles for an image and builds the merged profile (thread-safe)
+	bool select(const RtpsRequest& request, RtpsResult& result) const;
+
+	// Reloads the snapshot now (e.g. when told so by the user)
+	void reload();
+
+	// Saves the rule evaluation statistics of the current snapshot (see RtpsSnapshot::saveStatistics())
+	void saveStatistics() const;
+
+	struct Impl;
+
+private:
+	RtpsLiveSnapshot(const RtpsLiveSnapshot&);
+	RtpsLiveSnapshot& operator=(const RtpsLiveSnapshot&);
+
+	std::unique_ptr<Impl> impl;
+};
+
+// Logs librtps' messages to "RTProfileSelector.log" in RTProfileSelector's folder while alive, as
+// configured in RTProfileSelector.ini (LogLevel, LogMaxSize, LogMaxFiles). Without one, nothing is logged.
+class LIBRTPS_API RtpsLogSession
+{
+public:
+	explicit RtpsLogSession(const std::string& basePath);
+	~RtpsLogSession();
+
+private:
+	RtpsLogSession(const RtpsLogSession&);
+	RtpsLogSession& operator=(const RtpsLogSession&);
+};
+
+// Traces the stages of each select() call while alive, appending them to a file in Chrome's trace event
+// format when destroyed (see Tracer), like TraceFile in RTProfileSelector.ini does for the command line
+class LIBRTPS_API RtpsTraceSession
+{
+public:
+	explicit RtpsTraceSession(const std::string& path);
+	~RtpsTraceSession();
+
+private:
+	RtpsTraceSession(const RtpsTraceSession&);
+	RtpsTraceSession& operator=(const RtpsTraceSession&);
+};
+
+// The RTProfileSelector command line program (RT's custom profile builder, --library, --prefetch)
+LIBRTPS_API int rtpsMain(int argc, const char* argv[]);
+
+#endif